@@ -0,0 +1,328 @@
+import std;
+import toyscheme;
+
+using namespace std::literals;
+using namespace toyscheme;
+
+/// A program whose `run` form is timed, after its `setup` forms are evaluated once
+struct EvalBenchmark {
+    std::string_view name;
+    std::string_view setup;
+    std::string_view run;
+};
+
+const EvalBenchmark EVAL_BENCHMARKS[] = {
+    {
+        "fib",
+        R"(
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+)",
+        "(fib 20)",
+    },
+    {
+        "tak",
+        R"(
+(define (tak x y z)
+  (if (< y x)
+      (tak (tak (- x 1) y z)
+           (tak (- y 1) z x)
+           (tak (- z 1) x y))
+      z))
+)",
+        "(tak 18 12 6)",
+    },
+    {
+        "ackermann",
+        R"(
+(define (ack m n)
+  (if (= m 0)
+      (+ n 1)
+      (if (= n 0)
+          (ack (- m 1) 1)
+          (ack (- m 1) (ack m (- n 1))))))
+)",
+        "(ack 2 9)",
+    },
+    {
+        "nqueens",
+        R"(
+(define (ok? row dist placed)
+  (if (null? placed)
+      #t
+      (if (= (car placed) (+ row dist))
+          #f
+          (if (= (car placed) (- row dist))
+              #f
+              (if (= (car placed) row)
+                  #f
+                  (ok? row (+ dist 1) (cdr placed)))))))
+
+(define (queens board-size)
+  (define (try col placed)
+    (if (= col board-size)
+        1
+        (try-rows 0 col placed)))
+  (define (try-rows row col placed)
+    (if (= row board-size)
+        0
+        (+ (if (ok? row 1 placed) (try (+ col 1) (cons row placed)) 0)
+           (try-rows (+ row 1) col placed))))
+  (try 0 '()))
+)",
+        "(queens 6)",
+    },
+    {
+        "remove-item",
+        R"(
+(define (iota n)
+  (let loop ((i n) (acc '()))
+    (if (= i 0)
+        acc
+        (loop (- i 1) (cons i acc)))))
+
+(define (remove-item x lst)
+  (if (null? lst)
+      '()
+      (if (= (car lst) x)
+          (remove-item x (cdr lst))
+          (cons (car lst) (remove-item x (cdr lst))))))
+
+(define numbers (iota 500))
+)",
+        "(remove-item 250 numbers)",
+    },
+    {
+        "make-counter",
+        R"(
+(define (make-counter)
+  (let ((n 0))
+    (lambda ()
+      (progn
+        (set! n (+ n 1))
+        n))))
+
+(define (count-with-counters i acc)
+  (if (= i 0)
+      acc
+      (let ((counter (make-counter)))
+        (progn
+          (counter)
+          (count-with-counters (- i 1) (+ acc (counter)))))))
+)",
+        "(count-with-counters 500 0)",
+    },
+    {
+        "let*-nesting",
+        R"(
+(define (nested x)
+  (let* ((a (+ x 1))
+         (b (+ a 1))
+         (c (+ a b)))
+    (let* ((d (+ c 1))
+           (e (+ d c))
+           (f (+ e d)))
+      (let* ((g (+ f 1))
+             (h (+ g f))
+             (i (+ h g)))
+        (let* ((j (+ i 1))
+               (k (+ j i))
+               (l (+ k j)))
+          (- l a b c d e f g h i j k))))))
+
+(define (nest-loop i acc)
+  (if (= i 0)
+      acc
+      (nest-loop (- i 1) (+ acc (nested i)))))
+)",
+        "(nest-loop 1000 0)",
+    },
+};
+
+/// Source text that is parsed, without being evaluated, as one op
+struct ParseBenchmark {
+    std::string_view name;
+    std::string text;
+};
+
+std::string repeat_until_size(std::string_view unit, size_t size) {
+    std::string res;
+    while (res.size() < size)
+        res += unit;
+    return res;
+}
+
+std::vector<ParseBenchmark> make_parse_benchmarks() {
+    constexpr size_t SIZE = 64 * 1024;
+    return {
+        {
+            "parse-symbols",
+            repeat_until_size(R"(
+(define (walk-tree tree visit-node)
+  (if (null? tree)
+      '()
+      (cons (visit-node (car tree))
+            (walk-tree (cdr tree) visit-node))))  ; a comment to skip
+)",
+                              SIZE),
+        },
+        {
+            "parse-numbers",
+            repeat_until_size("(1 22 333 -4444 55555 666666 7777777 1234567890123 3.25 -0.5 1e10 6.02e23)\n", SIZE),
+        },
+        {
+            "parse-strings",
+            repeat_until_size(R"--(("a plain string literal" "one with an \n escape" "" "(not a list)" "back\\slash"))--"
+                              "\n",
+                              SIZE),
+        },
+    };
+}
+
+struct Result {
+    std::string name;
+    uint64_t iterations = 0;
+    double ns_per_op = 0;
+    double allocations_per_op = 0;
+    double bytes_per_op = 0;
+    size_t peak_heap_bytes = 0;
+    /// Source bytes per op, for the parser benchmarks
+    size_t source_bytes = 0;
+};
+
+struct BenchOptions {
+    bool json = false;
+    std::string filter;
+    std::chrono::duration<double> min_time = 0.5s;
+};
+
+/// Runs `op` in batches until they took at least `min_time` in total, after a first warm up run
+template <typename Op>
+Result measure(std::string_view name, Environment& env, const BenchOptions& opts, Op op) {
+    using Clock = std::chrono::steady_clock;
+
+    op();
+
+    Result res{ .name = std::string(name) };
+    auto stats_before = env.heap.get_stats();
+    Clock::duration elapsed{};
+    uint64_t batch = 1;
+    while (elapsed < opts.min_time) {
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < batch; ++i)
+            op();
+        elapsed += Clock::now() - start;
+        res.iterations += batch;
+        batch *= 2;
+    }
+    auto& stats_after = env.heap.get_stats();
+
+    auto ops = static_cast<double>(res.iterations);
+    res.ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+    res.allocations_per_op = static_cast<double>(stats_after.allocations - stats_before.allocations) / ops;
+    res.bytes_per_op = static_cast<double>(stats_after.allocated_bytes - stats_before.allocated_bytes) / ops;
+    res.peak_heap_bytes = stats_after.peak_heap_bytes;
+    return res;
+}
+
+Sexp parse_one(std::string_view src, Environment& env) {
+    auto forms = parse_sexp(src, env);
+    auto pair = as_pair(forms);
+    if (!pair || !pair.cdr.is_nil())
+        throw ParseException("expected a single form");
+    return *pair.car;
+}
+
+Result run_eval_benchmark(const EvalBenchmark& bench, const BenchOptions& opts) {
+    Environment env;
+    SexpReader reader(bench.setup, env);
+    while (auto form = reader.next())
+        eval(*form, env);
+
+    auto run = parse_one(bench.run, env);
+    return measure(bench.name, env, opts, [&]() { eval(run, env); });
+}
+
+Result run_parse_benchmark(const ParseBenchmark& bench, const BenchOptions& opts) {
+    Environment env;
+    auto res = measure(bench.name, env, opts, [&]() { parse_sexp(bench.text, env); });
+    res.source_bytes = bench.text.size();
+    return res;
+}
+
+void print_table(const std::vector<Result>& results) {
+    std::cout << std::format("{:<16} {:>10} {:>14} {:>12} {:>12} {:>12} {:>10}\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op", "peak heap", "MB/s");
+    for (auto& r : results) {
+        auto throughput = r.source_bytes == 0 ? "-"s : std::format("{:.1f}", static_cast<double>(r.source_bytes) / r.ns_per_op * 1e9 / 1e6);
+        std::cout << std::format("{:<16} {:>10} {:>14.1f} {:>12.1f} {:>12.1f} {:>12} {:>10}\n",
+                                 r.name, r.iterations, r.ns_per_op, r.allocations_per_op, r.bytes_per_op, r.peak_heap_bytes, throughput);
+    }
+}
+
+void print_json(const std::vector<Result>& results) {
+    std::cout << "{\"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto& r = results[i];
+        std::cout << std::format(
+            R"(  {{"name": "{}", "iterations": {}, "ns_per_op": {:.3f}, "allocations_per_op": {:.3f}, "bytes_per_op": {:.3f}, "peak_heap_bytes": {}, "source_bytes": {}}}{})",
+            r.name, r.iterations, r.ns_per_op, r.allocations_per_op, r.bytes_per_op, r.peak_heap_bytes, r.source_bytes, i + 1 < results.size() ? "," : "");
+        std::cout << '\n';
+    }
+    std::cout << "]}\n";
+}
+
+void print_usage() {
+    std::cerr << "Usage: toyscheme-bench [--json] [--filter <substring>] [--min-time <seconds>]\n";
+}
+
+int main(int argc, char** argv) {
+    BenchOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg(argv[i]);
+        if (arg == "--json"sv) {
+            opts.json = true;
+        } else if (arg == "--filter"sv && i + 1 < argc) {
+            opts.filter = argv[++i];
+        } else if (arg == "--min-time"sv && i + 1 < argc) {
+            std::string_view value(argv[++i]);
+            double seconds;
+            auto [_, ec] = std::from_chars(value.data(), value.data() + value.size(), seconds);
+            if (ec != std::errc() || seconds < 0) {
+                print_usage();
+                return -1;
+            }
+            opts.min_time = std::chrono::duration<double>(seconds);
+        } else {
+            print_usage();
+            return -1;
+        }
+    }
+
+    auto is_selected = [&](std::string_view name) { return name.contains(opts.filter); };
+
+    std::vector<Result> results;
+    try {
+        for (auto& bench : EVAL_BENCHMARKS) {
+            if (is_selected(bench.name))
+                results.push_back(run_eval_benchmark(bench, opts));
+        }
+        for (auto& bench : make_parse_benchmarks()) {
+            if (is_selected(bench.name))
+                results.push_back(run_parse_benchmark(bench, opts));
+        }
+    } catch (const ParseException& e) {
+        std::cerr << "Parsing exception: " << e.msg << '\n';
+        return -1;
+    } catch (const EvalException& e) {
+        std::cerr << "Eval exception: " << e.msg << '\n';
+        return -1;
+    }
+
+    if (opts.json)
+        print_json(results);
+    else
+        print_table(results);
+    return 0;
+}
@@ -11,8 +11,52 @@ namespace TaskType { constexpr int FILE = 0, LITERAL = 1; };
 struct ProgramOptions {
     std::vector<Task> tasks;
     bool parse_only = false;
+    /// Print a summary of the heap to stderr once everything ran
+    bool heap_stats = false;
+    /// Profile the procs run, and print the ones that took the most time to stderr, see Profiler
+    bool profile = false;
+    /// If not empty, where to write the folded stacks of the profile
+    fs::path profile_folded_path;
+    /// If not empty, the image to restore the globals from before running anything, see load_image()
+    fs::path load_image_path;
+    /// If not empty, where to save the globals once everything ran, see dump_image()
+    fs::path dump_image_path;
+    /// Keep the parsed forms of input files in a form cache next to each, e.g. lib.scmc for lib.scm, to skip parsing them in later runs.
+    /// Not used while profiling, which needs the position of forms in the source. See FormCacheReader.
+    bool cache = false;
+    /// If not empty, where to keep the form caches instead, named after the hash of the text they were parsed from
+    fs::path cache_dir;
+    /// Threads to lex big input files on, a window ahead of where they are read; see SexpReader
+    unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    /// Set by --heap-initial, --heap-max and --heap-huge-pages
+    HeapConfig heap_config;
 };
 
+/// Parses a size like 512M: a number of bytes, with an optional K, M or G suffix for binary multiples
+std::optional<size_t> parse_byte_size(std::string_view text) {
+    size_t value;
+    auto [rest, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc())
+        return std::nullopt;
+
+    std::string_view suffix(rest, text.data() + text.size());
+    int shift;
+    if (suffix.empty()) {
+        shift = 0;
+    } else if (suffix == "K"sv || suffix == "k"sv) {
+        shift = 10;
+    } else if (suffix == "M"sv || suffix == "m"sv) {
+        shift = 20;
+    } else if (suffix == "G"sv || suffix == "g"sv) {
+        shift = 30;
+    } else {
+        return std::nullopt;
+    }
+    if (value > (std::numeric_limits<size_t>::max() >> shift))
+        return std::nullopt;
+    return value << shift;
+}
+
 ProgramOptions parse_args(int argc, char** argv) {
     ProgramOptions res;
 
@@ -22,9 +66,39 @@ ProgramOptions parse_args(int argc, char** argv) {
 
     bool positional_only = false;
     bool accept_str_input = false;
+    bool accept_jobs = false;
+    /// Set by the options followed by a path, to where it goes
+    fs::path* accept_path = nullptr;
+    /// Set by the options followed by a size in bytes, to where it goes
+    size_t* accept_size = nullptr;
     for (int i = 1; i < argc; ++i) {
         std::string_view arg(argv[i]);
 
+        if (accept_path) {
+            *accept_path = fs::path(arg);
+            accept_path = nullptr;
+            continue;
+        }
+
+        if (accept_size) {
+            if (auto size = parse_byte_size(arg))
+                *accept_size = *size;
+            else
+                std::cerr << "Invalid heap size, expected a number of bytes with an optional K, M or G suffix; using the default.\n";
+            accept_size = nullptr;
+            continue;
+        }
+
+        if (accept_jobs) {
+            accept_jobs = false;
+            auto [_, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), res.jobs);
+            if (ec != std::errc() || res.jobs == 0) {
+                std::cerr << "Invalid number of jobs, using 1.\n";
+                res.jobs = 1;
+            }
+            continue;
+        }
+
         if (positional_only)
             goto handle_positional_arg;
 
@@ -32,6 +106,52 @@ ProgramOptions parse_args(int argc, char** argv) {
             res.parse_only = true;
             continue;
         }
+        if (arg == "--heap-stats"sv) {
+            res.heap_stats = true;
+            continue;
+        }
+        if (arg == "--profile"sv) {
+            res.profile = true;
+            continue;
+        }
+        if (arg == "--profile-folded"sv) {
+            res.profile = true;
+            accept_path = &res.profile_folded_path;
+            continue;
+        }
+        if (arg == "--load-image"sv) {
+            accept_path = &res.load_image_path;
+            continue;
+        }
+        if (arg == "--dump-image"sv) {
+            accept_path = &res.dump_image_path;
+            continue;
+        }
+        if (arg == "--cache"sv) {
+            res.cache = true;
+            continue;
+        }
+        if (arg == "--cache-dir"sv) {
+            res.cache = true;
+            accept_path = &res.cache_dir;
+            continue;
+        }
+        if (arg == "--heap-initial"sv) {
+            accept_size = &res.heap_config.initial_bytes;
+            continue;
+        }
+        if (arg == "--heap-max"sv) {
+            accept_size = &res.heap_config.max_bytes;
+            continue;
+        }
+        if (arg == "--heap-huge-pages"sv) {
+            res.heap_config.huge_pages = true;
+            continue;
+        }
+        if (arg == "--jobs"sv || arg == "-j"sv) {
+            accept_jobs = true;
+            continue;
+        }
         if (arg == "--exec"sv || arg == "-e"sv) {
             accept_str_input = true;
             continue;
@@ -53,36 +173,131 @@ ProgramOptions parse_args(int argc, char** argv) {
     return res;
 }
 
-void run_buffer(std::string_view buffer, const ProgramOptions& opts, Environment& env) {
-    Sexp program;
-    try {
-        program = parse_sexp(buffer, env);
-    } catch (const ParseException& e) {
-        std::cerr << "Parsing exception: " << e.msg << '\n';
-        return;
-    }
+/// Runs the forms of `reader`, a SexpReader or a FormCacheReader, recording them into `cache` if set.
+/// Returns false if the input failed to parse.
+template <typename Reader>
+bool run_forms(Reader& reader, const ProgramOptions& opts, Environment& env, FormCacheWriter* cache = nullptr) {
+    // Each form is run as soon as it is parsed, so that a large input doesn't have to be loaded as a whole first
+    while (true) {
+        std::optional<Sexp> sexp;
+        try {
+            sexp = reader.next();
+        } catch (const ParseException& e) {
+            std::cerr << "Parsing exception: " << e.msg << '\n';
+            return false;
+        }
+        if (!sexp)
+            break;
+        if (cache)
+            cache->add(*sexp);
 
-    for (auto& sexp : iterate(program, env)) {
         try {
             if (opts.parse_only) {
-                std::cout << dump_sexp(sexp, env) << std::endl;
+                std::cout << dump_sexp(*sexp, env) << std::endl;
             } else {
-                auto res = eval(sexp, env);
+                auto res = eval(*sexp, env);
                 std::cout << dump_sexp(res, env) << std::endl;
             }
         } catch (const EvalException& e) {
             std::cerr << "Eval exception: " << e.msg << std::endl;
+        } catch (const OutOfMemoryException& e) {
+            // Unless fatal, the heap is left as it was before the allocation that failed, so the next forms may still run
+            if (e.fatal)
+                throw;
+            std::cerr << "Out of memory: " << e.msg << std::endl;
         } catch (const std::runtime_error& e) {
             std::cerr << "Internal error: " << e.what() << std::endl;
         }
     }
+    return true;
 }
 
-int main(int argc, char** argv) {
-    auto opts = parse_args(argc, argv);
+/// Whether `path` is a pipe or a device such as /dev/stdin, whose text comes as it is read, rather than a file that can be mapped
+bool is_stream(const fs::path& path) {
+    std::error_code ec;
+    auto status = fs::status(path, ec);
+    return !ec && (fs::is_fifo(status) || fs::is_character_file(status));
+}
 
-    Environment env;
-    for (auto& task : opts.tasks) {
+fs::path form_cache_path(const fs::path& input_file, uint64_t source_hash, const ProgramOptions& opts) {
+    if (opts.cache_dir.empty())
+        return fs::path(input_file).replace_extension(".scmc");
+    return opts.cache_dir / std::format("{:016x}.scmc", source_hash);
+}
+
+void print_heap_stats(const Heap& heap) {
+    auto& stats = heap.get_stats();
+    auto snapshot = heap.take_snapshot();
+
+    std::cerr << std::format("heap: {} allocations, {} bytes allocated, {} minor and {} major collections\n",
+                             stats.allocations, stats.allocated_bytes, stats.minor_collections, stats.major_collections);
+    std::cerr << std::format("heap: {} old ({} by size class) and {} nursery segments of {} bytes, {} large objects of {} bytes\n",
+                             snapshot.old_segments, snapshot.old_size_class_segments, snapshot.nursery_segments, snapshot.segment_size,
+                             snapshot.large_objects, snapshot.large_object_bytes);
+    std::cerr << std::format("heap: {} bytes committed, peak {} bytes, limit {} bytes\n",
+                             snapshot.committed_bytes, stats.peak_heap_bytes, snapshot.max_bytes);
+    std::cerr << std::format("heap: old generation has {} bytes in objects, {} in free chunks, {} unused, fragmentation {:.1f}%\n",
+                             snapshot.old_object_bytes, snapshot.old_free_bytes, snapshot.old_unused_bytes, snapshot.fragmentation() * 100);
+    auto& by_occupancy = snapshot.old_segments_by_occupancy;
+    std::cerr << std::format("heap: old segments by occupancy: {} under 25%, {} under 50%, {} under 75%, {} above\n",
+                             by_occupancy[0], by_occupancy[1], by_occupancy[2], by_occupancy[3]);
+    std::cerr << std::format("heap: {} bytes live at the last full collection, {} bytes in the nursery\n",
+                             snapshot.live_bytes_at_last_gc, snapshot.nursery_object_bytes);
+
+    std::cerr << std::format("{:<14} {:>12} {:>12} {:>14}\n", "type", "objects", "bytes", "allocations");
+    for (size_t i = 0; i < OBJECT_TYPE_COUNT; ++i) {
+        auto& count = snapshot.types[i];
+        if (count.objects == 0 && stats.allocations_by_type[i] == 0)
+            continue;
+        std::cerr << std::format("{:<14} {:>12} {:>12} {:>14}\n",
+                                 object_type_name(static_cast<ObjectType>(i)), count.objects, count.bytes, stats.allocations_by_type[i]);
+    }
+}
+
+/// Number of procs listed by --profile
+constexpr size_t PROFILE_TOP_PROCS = 20;
+
+void print_profile(const Profiler& profiler, const ProgramOptions& opts) {
+    profiler.print_report(std::cerr, PROFILE_TOP_PROCS);
+
+    if (opts.profile_folded_path.empty())
+        return;
+    std::ofstream out(opts.profile_folded_path);
+    profiler.write_folded_stacks(out);
+    if (!out)
+        std::cerr << "Unable to write the folded stacks.\n";
+}
+
+int run_tasks(const ProgramOptions& opts, Environment& env) {
+    // Open all input files first, reading those whose form cache is up to date from it
+    bool use_cache = opts.cache && !env.profiler;
+    std::vector<const SourceFile*> task_files(opts.tasks.size(), nullptr);
+    // Read and run a form at a time instead of as a whole, unless the profiler needs their text; they are never cached
+    std::vector<bool> streamed(opts.tasks.size(), false);
+    std::vector<uint64_t> source_hashes(opts.tasks.size(), 0);
+    std::vector<std::unique_ptr<FormCacheReader>> cached_forms(opts.tasks.size());
+    for (size_t i = 0; i < opts.tasks.size(); ++i) {
+        auto input_file = std::get_if<TaskType::FILE>(&opts.tasks[i]);
+        if (!input_file || input_file->empty())
+            continue;
+        if (!env.profiler && is_stream(*input_file)) {
+            streamed[i] = true;
+            continue;
+        }
+        auto file = task_files[i] = env.load_source(*input_file);
+        if (!file)
+            continue;
+        if (env.profiler)
+            env.profiler->add_source(file->text(), input_file->string());
+
+        if (use_cache) {
+            source_hashes[i] = hash_source_text(file->text());
+            cached_forms[i] = FormCacheReader::open(form_cache_path(*input_file, source_hashes[i], opts), *file, source_hashes[i], env);
+        }
+    }
+
+    for (size_t i = 0; i < opts.tasks.size(); ++i) {
+        auto& task = opts.tasks[i];
         switch (task.index()) {
             case TaskType::FILE: {
                 auto& input_file = *std::get_if<TaskType::FILE>(&task);
@@ -92,25 +307,91 @@ int main(int argc, char** argv) {
                     return -1;
                 }
 
-                std::ifstream ifs(input_file);
-                if (!ifs) {
+                if (streamed[i]) {
+                    std::ifstream input(input_file, std::ios::binary);
+                    if (!input) {
+                        std::cerr << "Unable to open input file.\n";
+                        return -1;
+                    }
+                    SexpReader reader(input, env);
+                    run_forms(reader, opts, env);
+                    break;
+                }
+
+                auto file = task_files[i];
+                if (!file) {
                     std::cerr << "Unable to open input file.\n";
                     return -1;
                 }
 
-                std::stringstream buffer;
-                buffer << ifs.rdbuf();
+                if (cached_forms[i]) {
+                    run_forms(*cached_forms[i], opts, env);
+                    break;
+                }
 
-                run_buffer(buffer.view(), opts, env);
+                SexpReader reader(*file, env, opts.jobs);
+                if (!use_cache) {
+                    run_forms(reader, opts, env);
+                    break;
+                }
+                // Only a file that parsed to the end is cached, so that its errors are reported again
+                FormCacheWriter cache(*file, source_hashes[i]);
+                if (run_forms(reader, opts, env, &cache) && !cache.save(form_cache_path(input_file, source_hashes[i], opts)))
+                    std::cerr << "Unable to write the form cache of " << input_file.string() << ".\n";
             } break;
 
             case TaskType::LITERAL: {
                 auto& input = *std::get_if<TaskType::LITERAL>(&task);
+                if (env.profiler)
+                    env.profiler->add_source(input, "<exec>");
 
-                run_buffer(input, opts, env);
+                SexpReader reader(input, env);
+                run_forms(reader, opts, env);
             } break;
         }
     }
 
     return 0;
 }
+
+int run_program(const ProgramOptions& opts, Environment& env) {
+    if (opts.profile)
+        env.profiler = std::make_unique<Profiler>();
+
+    if (!opts.load_image_path.empty()) {
+        try {
+            load_image(opts.load_image_path, env);
+        } catch (const ImageException& e) {
+            std::cerr << "Unable to load image: " << e.msg << '\n';
+            return -1;
+        }
+    }
+
+    int res = run_tasks(opts, env);
+    if (res == 0 && !opts.dump_image_path.empty()) {
+        try {
+            dump_image(opts.dump_image_path, env);
+        } catch (const ImageException& e) {
+            std::cerr << "Unable to save image: " << e.msg << '\n';
+            res = -1;
+        }
+    }
+    if (env.profiler)
+        print_profile(*env.profiler, opts);
+    if (opts.heap_stats)
+        print_heap_stats(env.heap);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    auto opts = parse_args(argc, argv);
+
+    // Running out of memory outside of a form, e.g. while setting up the environment or loading an image, stops everything
+    try {
+        Environment env(opts.heap_config);
+        return run_program(opts, env);
+    } catch (const OutOfMemoryException& e) {
+        std::cerr << "Out of memory: " << e.msg << '\n';
+        return -1;
+    }
+}
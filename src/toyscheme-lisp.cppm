@@ -1,4 +1,5 @@
 module;
+#include "toyscheme/opcodes.hpp"
 #include "toyscheme/util.hpp"
 #include <cassert>
 
@@ -16,134 +17,76 @@ export struct EvalException {
     std::string msg;
 };
 
-export class SymbolPool;
-export class Symbol {
-private:
-    friend class SymbolPool;
-
-    uintptr_t _data = 0;
-    size_t _size = 0;
-
-public:
-    /// Constructs an empty symbol
-    Symbol() = default;
-
-    Symbol(const Symbol&) = delete;
-    Symbol& operator=(const Symbol&) = delete;
-
-    Symbol(Symbol&& s) noexcept
-        : _data{ s._data }
-        , _size{ s._size } //
-    {
-        s._data = 0;
-        s._size = 0;
-    }
-
-    Symbol& operator=(Symbol&& s) noexcept {
-        if ((_data & 0x1) == 0) {
-            delete data();
-        }
-        this->_data = std::exchange(s._data, 0);
-        this->_size = std::exchange(s._size, 0);
-        return *this;
-    }
-
-    ~Symbol() {
-        // NOTE: for _data == nullptr, delete is no-op, so considering that as heap-allocated is fine
-        if ((_data & 0x1) == 0) {
-            delete data();
-        }
-    }
-
-    const char* data() const { return std::bit_cast<const char*>(_data & ~0x1); }
-    size_t size() const { return _size; }
-
-    operator std::string_view() const { return { data(), size() }; }
-
-    bool empty() const { return _size == 0; }
+/// An image file that can't be written or read, see dump_image() and load_image()
+export struct ImageException {
+    std::string msg;
 };
 
-export class SymbolPool {
-private:
-    // TODO custom hashtable
-    std::unordered_map<std::string, Symbol, StringHash, std::equal_to<>> _pool;
+export class Symbol;
 
-public:
-    // Constructor for string literals
-    // This *technically* also accepts things like `const char arr[5];` - just don't do it
-    template <size_t N>
-    const Symbol& intern(const char (&str)[N]) {
-        // Length of the char array from a literal contains the null terminator
-        size_t actual_len = N - 1;
-        auto& sym = _pool[std::string(str, actual_len)];
-        // If this Symbol is default constructed, i.e. this is a new entry in the symbol pool
-        if (sym.data() == nullptr) {
-            // `str` is of type const char[N], we need a pointer for std::bit_cast
-            const char* str_ptr = str;
-
-            // Sanity check: the pointer is not using the lowest bit
-            assert((std::bit_cast<uintptr_t>(str_ptr) & 0x1) == 0);
-
-            // Set lowest bit, indicating this is a literal
-            sym._data = std::bit_cast<uintptr_t>(str_ptr) | 0x1;
-            sym._size = actual_len;
-        }
-        return sym;
-    }
+// Sexp is NaN-boxed: a double is stored as is, with all NaNs folded into a single positive one, SCVAL_CANONICAL_NAN.
+// The negative quiet NaNs, i.e. words starting with 0xFFF8, are then free to store everything else in their remaining 51 bits:
+// heap pointers when bit 50 is set, other values below that, tagged by their lowest 3 bits, see get_flags().
+export constexpr uintptr_t SCVAL_NANBOX_BASE = 0xFFF8'0000'0000'0000;
+export constexpr uintptr_t SCVAL_CANONICAL_NAN = 0x7FF8'0000'0000'0000;
 
-    // Constructor for runtime strings (make a copy)
-    const Symbol& intern(const char* str, size_t len) {
-        auto& sym = _pool[std::string(str, len)];
-        if (sym.data() == nullptr) {
-            char* data = new char[len + 1]{};
-            sym._size = len;
-            sym._data = std::bit_cast<uintptr_t>(data);
-            // Sanity check: the pointer is not using the lowest bit
-            assert((std::bit_cast<uintptr_t>(data) & 0x1) == 0);
-            // Copy string content
-            std::memcpy(data, str, len);
-            // Null terminate
-            data[len] = 0;
-        }
-        return sym;
-    }
-
-    // Constructor for runtime strings (make a copy)
-    const Symbol& intern(std::string_view str) {
-        return intern(str.data(), str.size());
-    }
-};
-
-// All heap objects are 8-byte aligned
+// Tag of values other than pointers and doubles; all heap objects and symbols are 8-byte aligned
 export constexpr uintptr_t SCVAL_MASK_FLAG = 0x0000'0000'0000'0007;
+// Bits to compare, in addition to the tag, to tell a tagged value apart from doubles and pointers
+export constexpr uintptr_t SCVAL_MASK_TAGGED = 0xFFFC'0000'0000'0000 | SCVAL_MASK_FLAG;
 
-// 32 bit signed integer in the MSB
+// 32 bit signed integer in bits 16..47
 export constexpr unsigned int SCVAL_FLAG_INT = 0b000;
 
-// 32 bit IEEE754 floating pointer number in the MSB
+// 64 bit IEEE754 floating point number, stored as is, anywhere below SCVAL_NANBOX_BASE
 export constexpr unsigned int SCVAL_FLAG_FLOAT = 0b010;
 
 // Bi-state value
 export constexpr unsigned int SCVAL_FLAG_BOOL = 0b100;
-export constexpr uintptr_t SCVAL_FALSE = 0x0000'0000'0000'0000 | SCVAL_FLAG_BOOL;
-export constexpr uintptr_t SCVAL_TRUE = 0x0000'0000'0000'0010 | SCVAL_FLAG_BOOL;
+export constexpr uintptr_t SCVAL_FALSE = SCVAL_NANBOX_BASE | 0x0000'0000'0000'0000 | SCVAL_FLAG_BOOL;
+export constexpr uintptr_t SCVAL_TRUE = SCVAL_NANBOX_BASE | 0x0000'0000'0000'0010 | SCVAL_FLAG_BOOL;
 
-// 32-bit unsigned integer in the MSB, storing the symbol ID
+// Pointer to the Symbol, in bits 0..47
 export constexpr unsigned int SCVAL_FLAG_SYMBOL = 0b110;
 
-// 64-bit pointer with the lowest 3 bits assumed to be 0 (aligned to 8 byte boundries)
+// Lexical address of a local variable, see LocalRef, in bits 16..47
+export constexpr unsigned int SCVAL_FLAG_LOCAL_REF = 0b011;
+
+// Pointer to a heap object, at or above SCVAL_PTR_BASE
+// User space addresses fit in 48 bits, and with the lowest 3 bits being 0 (aligned to 8 byte boundries), they are stored shifted in bits 0..44.
+// Bits 45..49 hold the index of the item pointed at in a CompactList, 0 otherwise. Those are all the bits left between the address and bit 50,
+// which tells pointers apart, so CompactList::MAX_SIZE is 32 and longer lists are chains of them.
 export constexpr unsigned int SCVAL_FLAG_PTR = 0b001;
-// Empty list, special value for SCVAL_MASK_PTR
-// All address bits are 0 and flag == SCVAL_MASK_PTR
-export constexpr uintptr_t SCVAL_NIL = 0x0000'0000'0000'0000 | SCVAL_FLAG_PTR;
+export constexpr uintptr_t SCVAL_PTR_BASE = 0xFFFC'0000'0000'0000;
+export constexpr uintptr_t SCVAL_MASK_PTR_ADDRESS = 0x0000'1FFF'FFFF'FFFF;
+export constexpr int SCVAL_PTR_OFFSET_SHIFT = 45;
+export constexpr size_t SCVAL_PTR_OFFSET_BITS = 5;
+// Empty list, special value for SCVAL_FLAG_PTR
+// All address bits are 0
+export constexpr uintptr_t SCVAL_NIL = SCVAL_PTR_BASE;
+
+/// Where a local variable lives: in the scope `depth` levels up the chain from the current one, at index `slot`
+export struct LocalRef {
+    uint16_t depth;
+    uint16_t slot;
+};
 
 export struct Sexp {
     uintptr_t _value;
 
     [[nodiscard]] constexpr uint8_t get_flags() const {
+        if (_value < SCVAL_NANBOX_BASE)
+            return SCVAL_FLAG_FLOAT;
+        if (_value >= SCVAL_PTR_BASE)
+            return SCVAL_FLAG_PTR;
         return _value & SCVAL_MASK_FLAG;
     }
 
+    /// Whether this is a value tagged with `flag` by its lowest bits, i.e. anything but a double or a pointer
+    [[nodiscard]] constexpr bool is_tagged(unsigned int flag) const {
+        return (_value & SCVAL_MASK_TAGGED) == (SCVAL_NANBOX_BASE | flag);
+    }
+
     [[nodiscard]] constexpr bool is_numeric() const {
         return is_int() || is_float();
     }
@@ -151,12 +94,12 @@ export struct Sexp {
     /******** Fixnum ********/
 
     [[nodiscard]] constexpr bool is_int() const {
-        return get_flags() == SCVAL_FLAG_INT;
+        return is_tagged(SCVAL_FLAG_INT);
     }
 
     [[nodiscard]] constexpr int32_t as_int() const {
         assert(is_int());
-        auto payload = static_cast<uint32_t>(_value >> 32);
+        auto payload = static_cast<uint32_t>(_value >> 16);
         return std::bit_cast<int32_t>(payload);
     }
 
@@ -164,29 +107,28 @@ export struct Sexp {
 
     constexpr void set_int(int32_t v) {
         auto payload = std::bit_cast<uint32_t>(v);
-        _value = (static_cast<uint64_t>(payload) << 32) | SCVAL_FLAG_INT;
+        _value = SCVAL_NANBOX_BASE | (static_cast<uint64_t>(payload) << 16) | SCVAL_FLAG_INT;
     }
 
     /******** Flonum ********/
 
-    constexpr bool is_float() const { return get_flags() == SCVAL_FLAG_FLOAT; }
+    constexpr bool is_float() const { return _value < SCVAL_NANBOX_BASE; }
 
-    constexpr float as_float() const {
+    constexpr double as_float() const {
         assert(is_float());
-        auto payload = static_cast<uint32_t>(_value >> 32);
-        return std::bit_cast<float>(payload);
+        return std::bit_cast<double>(_value);
     }
 
-    constexpr explicit Sexp(float v) { set_float(v); }
+    constexpr explicit Sexp(double v) { set_float(v); }
 
-    constexpr void set_float(float v) {
-        auto payload = std::bit_cast<uint32_t>(v);
-        _value = (static_cast<uint64_t>(payload) << 32) | SCVAL_FLAG_FLOAT;
+    constexpr void set_float(double v) {
+        // Any NaN could collide with the other values
+        _value = v == v ? std::bit_cast<uint64_t>(v) : SCVAL_CANONICAL_NAN;
     }
 
     /******** Boolean ********/
 
-    constexpr bool is_bool() const { return get_flags() == SCVAL_FLAG_BOOL; }
+    constexpr bool is_bool() const { return is_tagged(SCVAL_FLAG_BOOL); }
 
     constexpr bool as_bool() const {
         assert(is_bool());
@@ -208,35 +150,59 @@ export struct Sexp {
 
     /******** Symbol ********/
 
-    constexpr bool is_symbol() const { return get_flags() == SCVAL_FLAG_SYMBOL; }
+    constexpr bool is_symbol() const { return is_tagged(SCVAL_FLAG_SYMBOL); }
 
     constexpr const Symbol& as_symbol() const {
         assert(is_symbol());
-        return *std::bit_cast<const Symbol*>(_value & ~0b111);
+        return *std::bit_cast<const Symbol*>(_value & ~(SCVAL_NANBOX_BASE | SCVAL_MASK_FLAG));
     }
 
     constexpr explicit Sexp(const Symbol& sym) { set_symbol(sym); }
 
     constexpr void set_symbol(const Symbol& sym) {
         auto bits = std::bit_cast<uintptr_t>(&sym);
-        assert((bits & SCVAL_MASK_FLAG) == 0);
-        _value = bits | SCVAL_FLAG_SYMBOL;
+        assert((bits & (SCVAL_NANBOX_BASE | SCVAL_MASK_FLAG)) == 0);
+        _value = SCVAL_NANBOX_BASE | bits | SCVAL_FLAG_SYMBOL;
+    }
+
+    /******** Local variable reference ********/
+
+    constexpr bool is_local_ref() const { return is_tagged(SCVAL_FLAG_LOCAL_REF); }
+
+    constexpr LocalRef as_local_ref() const {
+        assert(is_local_ref());
+        return LocalRef{
+            .depth = static_cast<uint16_t>(_value >> 32),
+            .slot = static_cast<uint16_t>(_value >> 16),
+        };
+    }
+
+    constexpr explicit Sexp(LocalRef ref) { set_local_ref(ref); }
+
+    constexpr void set_local_ref(LocalRef ref) {
+        _value = SCVAL_NANBOX_BASE | (static_cast<uint64_t>(ref.depth) << 32) | (static_cast<uint64_t>(ref.slot) << 16) | SCVAL_FLAG_LOCAL_REF;
     }
 
     /******** Heap pointer ********/
 
     constexpr bool is_nil() const { return _value == SCVAL_NIL; }
 
-    constexpr bool is_ptr() const { return get_flags() == SCVAL_FLAG_PTR; }
+    constexpr bool is_ptr() const { return _value >= SCVAL_PTR_BASE; }
 
     template <typename T>
     constexpr bool is_ptr() const {
-        return is_ptr() && as_ptr().get_type() == T::HEAP_OBJECT_TYPE;
+        return is_ptr() && !is_nil() && as_ptr().get_type() == T::HEAP_OBJECT_TYPE;
     }
 
     constexpr HeapPtr<void> as_ptr() const {
         assert(is_ptr());
-        return HeapPtr(std::bit_cast<void*>(_value & ~0b111));
+        return HeapPtr(std::bit_cast<void*>((_value & SCVAL_MASK_PTR_ADDRESS) << 3));
+    }
+
+    /// Index of the item this points at, for a CompactList
+    constexpr size_t get_ptr_offset() const {
+        assert(is_ptr());
+        return (_value >> SCVAL_PTR_OFFSET_SHIFT) & ((1 << SCVAL_PTR_OFFSET_BITS) - 1);
     }
 
     template <typename T>
@@ -257,25 +223,340 @@ export struct Sexp {
     // Handles Sexp(HeapPtr<T>) by the implicit conversion operator
     constexpr explicit Sexp(HeapPtr<void> v) { set_pointer(v); }
 
-    constexpr void set_pointer(HeapPtr<void> v) {
+    constexpr explicit Sexp(HeapPtr<void> v, size_t offset) { set_pointer(v, offset); }
+
+    constexpr void set_pointer(HeapPtr<void> v, size_t offset = 0) {
         auto bits = std::bit_cast<uintptr_t>(v.get());
-        assert((bits & SCVAL_MASK_FLAG) == 0);
-        _value = bits | SCVAL_FLAG_PTR;
+        assert((bits & ~(SCVAL_MASK_PTR_ADDRESS << 3)) == 0);
+        assert(offset < (1 << SCVAL_PTR_OFFSET_BITS));
+        _value = SCVAL_PTR_BASE | (static_cast<uint64_t>(offset) << SCVAL_PTR_OFFSET_SHIFT) | (bits >> 3);
     }
 };
 
+export class SymbolPool;
+export class Symbol {
+private:
+    friend class SymbolPool;
+
+    /// Name, not owned: either a string literal or a copy in the SymbolPool's arena, null terminated in both cases,
+    /// or for symbols parsed from a SourceFile, its bytes, not null terminated
+    const char* _data = nullptr;
+    size_t _size = 0;
+
+public:
+    /// Value of the global variable with this name, if `is_global`.
+    /// Globals are shallow bound, right in their symbol, so that reading one is a single load instead of a hash table lookup.
+    /// NOTE: mutable, as the symbol itself is immutable and handed out as a const reference by SymbolPool; see Environment::define_global()
+    mutable Sexp global_value;
+    mutable bool is_global = false;
+
+    /// Constructs an empty symbol
+    Symbol() = default;
+
+    // Symbols never move, Sexp points at them
+    Symbol(const Symbol&) = delete;
+    Symbol& operator=(const Symbol&) = delete;
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+    operator std::string_view() const { return { data(), size() }; }
+
+    bool empty() const { return _size == 0; }
+};
+
+export class SymbolPool {
+private:
+    struct Entry {
+        /// Hash of the symbol's name, so that probing mostly compares integers, and growing doesn't hash the names again
+        size_t hash;
+        /// nullptr for an empty entry
+        Symbol* sym;
+    };
+
+    /// Open addressing hash table with linear probing, with a power of 2 number of entries
+    std::vector<Entry> _table;
+    size_t _count = 0;
+
+    /// Storage of the symbols; a std::deque never moves its elements as it grows
+    std::deque<Symbol> _symbols;
+
+    /// Arena of the names of symbols interned from runtime strings, copied back to back into chunks
+    std::vector<std::unique_ptr<char[]>> _name_chunks;
+    char* _name_cursor = nullptr;
+    size_t _name_space_left = 0;
+
+public:
+    SymbolPool();
+
+    SymbolPool(const SymbolPool&) = delete;
+    SymbolPool& operator=(const SymbolPool&) = delete;
+
+    // Constructor for string literals, which are referenced instead of copied
+    // This *technically* also accepts things like `const char arr[5];` - just don't do it
+    template <size_t N>
+    const Symbol& intern(const char (&str)[N]) {
+        // Length of the char array from a literal contains the null terminator
+        return intern_impl({ str, N - 1 }, true);
+    }
+
+    // Constructor for runtime strings (make a copy)
+    const Symbol& intern(const char* str, size_t len) {
+        return intern_impl({ str, len }, false);
+    }
+
+    // Constructor for runtime strings (make a copy)
+    const Symbol& intern(std::string_view str) {
+        return intern_impl(str, false);
+    }
+
+    // Constructor for strings that outlive the pool, such as the text of a SourceFile, which are referenced instead of copied
+    const Symbol& intern_borrowed(std::string_view str) {
+        return intern_impl(str, true);
+    }
+
+private:
+    /// Looks `name` up, only allocating if it is not interned yet
+    const Symbol& intern_impl(std::string_view name, bool is_literal);
+    /// Copies `name` into the arena, null terminated
+    const char* store_name(std::string_view name);
+    void grow_table();
+};
+
+/// Sexp flavor of Heap::write_barrier(), to be called after storing `value` into the already existing heap object `container`
+export void write_barrier(Heap& heap, const void* container, Sexp value) {
+    if (value.is_ptr())
+        heap.write_barrier(container, value.as_ptr().get());
+}
+
+export enum class Opcode : uint8_t {
+#define X(name) name,
+    TOYSCHEME_OPCODES(X)
+#undef X
+};
+
+export struct Bytecode;
+
+/// What the VM needs to resume a caller, once the proc it called returns
+export struct VmFrame {
+    Bytecode* code;
+    const uint8_t* pc;
+    Scope* scope;
+    /// Number of Environment::stack_scopes in use when the caller was entered, which it pops when it returns
+    size_t stack_scope_base;
+};
+
+/// A token of source text, or a paren, as the lexer splits it; see LexedSource
+export struct Lexeme {
+    enum Kind : uint8_t {
+        OPEN_LIST,
+        /// #( #s64( and #f64(
+        OPEN_VECTOR,
+        OPEN_INT_VECTOR,
+        OPEN_FLOAT_VECTOR,
+        CLOSE,
+        /// ' , and `, that wrap the datum that follows
+        QUOTE,
+        UNQUOTE,
+        QUASIQUOTE,
+        INTEGER,
+        FLOAT,
+        TRUE,
+        FALSE,
+        /// `size` characters at `offset` in LexedSource::src
+        STRING,
+        SYMBOL,
+        /// `size` characters at `offset` in LexedSource::decoded
+        DECODED_STRING,
+    };
+
+    Kind kind;
+    uint32_t size = 0;
+    union {
+        int64_t integer;
+        double flonum;
+        size_t offset;
+    };
+};
+
+/// Lexemes of consecutive top-level forms of some source text.
+/// Lexing only needs the text, not an Environment, so that it can be done on other threads; see SexpReader
+export struct LexedSource {
+    struct Form {
+        /// Where it starts in `src`, past the whitespace and comments before it
+        size_t src_begin;
+        size_t first_lexeme;
+    };
+
+    std::string_view src;
+    std::vector<Lexeme> lexemes;
+    std::vector<Form> forms;
+    /// String literals with escape sequences, decoded back to back
+    std::string decoded;
+    /// Where lexing stopped in `src`: past the last form and whatever follows it up to the next one, or at the form that failed to lex
+    size_t end = 0;
+    /// Why the form at `end` failed to lex, if it did
+    std::optional<std::string> error;
+};
+
+/// The text of a source file, memory mapped where supported, so that loading it costs page faults rather than copies.
+/// See Environment::load_source().
+export class SourceFile {
+private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+    /// Whether `_data` is mapped, rather than read into `_fallback`
+    bool _is_mapped = false;
+    std::string _fallback;
+
+public:
+    /// Returns nullptr if the file can't be read
+    static std::unique_ptr<SourceFile> open(const std::filesystem::path& path);
+
+    SourceFile() = default;
+    ~SourceFile();
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    std::string_view text() const { return { _data, _size }; }
+
+    /// Hints that the text before `offset` has been parsed, so that the OS may drop its pages, to be read again from the file if accessed
+    void release_before(size_t offset) const;
+};
+
+/// Call counts, time and allocations of each proc, recorded by the VM while Environment::profiler is set; see --profile.
+/// Procs are told apart by name, unnamed ones by where their (lambda) or (define) form is in the source text.
+/// The total figures of a proc count it once however deeply it recurses. Instructions the compiler inlines, such as ADD or CAR, are not calls:
+/// they count towards the proc running them.
+export class Profiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Names the source text `text` after `name`, e.g. its path, so that the lambdas parsed from it are reported at their line
+    void add_source(std::string_view text, std::string name);
+
+    /// Records that the (lambda) or (define) form whose head is stored at `form_head` starts at `pos` in some source text, for the parser.
+    /// Only kept until the top-level form it is in is compiled, as the memory of the form may hold another one after that.
+    void note_form_position(const Sexp* form_head, const char* pos) { _form_positions[form_head] = pos; }
+    /// Where the form whose head is stored at `form_head` starts, or nullptr if the parser didn't record it
+    const char* find_form_position(const Sexp* form_head) const;
+    /// Drops the positions recorded so far, once the top-level form they are in is compiled into Bytecode with their Bytecode::source_pos
+    void forget_form_positions() { _form_positions.clear(); }
+
+    size_t depth() const { return _frames.size(); }
+    /// Starts running a top-level form
+    void enter_toplevel(const Heap& heap);
+    /// Starts a call of the user proc running `code`
+    void enter(Bytecode& code, const Heap& heap);
+    void enter(const BuiltinProc& proc, const Heap& heap);
+    /// Ends the innermost call
+    void leave(const Heap& heap);
+    /// Ends every call above `depth`, e.g. when an exception unwinds the VM
+    void leave_to(size_t depth, const Heap& heap);
+
+    /// Prints the `top_n` procs that took the most time by themselves
+    void print_report(std::ostream& out, size_t top_n) const;
+    /// Writes the time spent in each call stack, in microseconds, as the "folded stacks" read by flamegraph.pl and compatible tools
+    void write_folded_stacks(std::ostream& out) const;
+
+private:
+    struct Proc {
+        std::string label;
+        uint64_t calls = 0;
+        Clock::duration total_time{};
+        Clock::duration self_time{};
+        uint64_t total_alloc_bytes = 0;
+        uint64_t self_alloc_bytes = 0;
+        /// Calls of it currently on the stack, only the outermost one adds to the totals
+        uint32_t active = 0;
+    };
+    /// A call stack, as a node of the tree of all of them
+    struct StackNode {
+        uint32_t proc;
+        uint32_t parent;
+        Clock::duration self_time{};
+    };
+    struct Frame {
+        uint32_t node;
+        Clock::time_point start;
+        uint64_t start_alloc_bytes;
+        Clock::duration child_time{};
+        uint64_t child_alloc_bytes = 0;
+    };
+    struct Source {
+        std::string_view text;
+        std::string name;
+        /// Offset of the start of each line, computed the first time a position in `text` is looked up
+        std::vector<size_t> line_starts;
+    };
+
+    static constexpr uint32_t NO_NODE = std::numeric_limits<uint32_t>::max();
+    static constexpr uint32_t NO_PROC = std::numeric_limits<uint32_t>::max();
+
+    std::vector<Proc> _procs;
+    std::unordered_map<std::string, uint32_t> _proc_ids;
+    std::unordered_map<const Symbol*, uint32_t> _builtin_ids;
+    uint32_t _toplevel_id = NO_PROC;
+    std::vector<StackNode> _nodes;
+    /// Children of each StackNode, keyed by the parent's index in the upper 32 bits and the proc in the lower ones
+    std::unordered_map<uint64_t, uint32_t> _children;
+    std::vector<Frame> _frames;
+    std::vector<Source> _sources;
+    std::unordered_map<const Sexp*, const char*> _form_positions;
+
+    uint32_t find_proc(std::string label);
+    void enter_proc(uint32_t proc, const Heap& heap);
+    /// "file:line" of `pos`, if it is in one of `_sources`
+    std::string describe_position(const char* pos);
+};
+
 export struct Environment {
+    /// Source files loaded so far; strings and symbols parsed from them refer to their text, so they live as long as everything else here
+    std::vector<std::unique_ptr<SourceFile>> sources;
+
     Heap heap;
     SymbolPool sym_pool;
 
-    /// A stack of scopes, added as we call into functions and popped as we exit
-    Scope* curr_scope;
-    Scope* global_scope;
+    /// Symbols with a global variable defined, i.e. those whose Symbol::global_value is bound, in order of definition
+    std::vector<const Symbol*> globals;
+    /// A stack of scopes, added as we call into functions and popped as we exit; nullptr at the top level
+    Scope* curr_scope = nullptr;
+
+    /// Operands and temporaries of the bytecode being run, shared by all procs on the call stack
+    std::vector<Sexp> vm_stack;
+    /// Callers of the proc currently running in the VM
+    std::vector<VmFrame> vm_frames;
+    /// Scopes of the procs and lets that never capture them in a closure, see Bytecode::captures_scope.
+    /// They are old heap objects, reused in LIFO order so that entering such a scope doesn't allocate; the first `stack_scope_count` are in use.
+    /// Those are roots of their own for the garbage collector, so their slots are written to without write barriers.
+    std::vector<Scope*> stack_scopes;
+    size_t stack_scope_count = 0;
 
-    Environment();
+    /// Set to profile the procs run from now on
+    std::unique_ptr<Profiler> profiler;
+
+    explicit Environment(const HeapConfig& heap_config = {});
+
+    /// Opens the source file at `path`, for the lifetime of the Environment; returns nullptr if it can't be read
+    const SourceFile* load_source(const std::filesystem::path& path);
 
     const Sexp* lookup_binding(const Symbol& name) const;
     void set_binding(const Symbol& name, Sexp value);
+    void define_global(const Symbol& name, Sexp value);
+
+    Sexp lookup_local(LocalRef ref) const;
+    void set_local(LocalRef ref, Sexp value);
+
+    /// Takes the next scope of `stack_scopes`, for the caller to fill in. This may run a garbage collection, the first time the stack gets this deep.
+    Scope* push_stack_scope() {
+        if (stack_scope_count == stack_scopes.size())
+            grow_stack_scopes();
+        return stack_scopes[stack_scope_count++];
+    }
+
+private:
+    void grow_stack_scopes();
 };
 
 /// A heap allocated cons, with a car/left and cdr/right Sexp
@@ -286,29 +567,166 @@ export struct ConsCell {
     Sexp cdr;
 };
 
+/// A cdr-coded list: its items are stored back to back, and the cdr of each of them is implicitly the list starting at the next one.
+/// Sexp references the pair formed by the i-th item with a pointer to the CompactList whose offset is i, see Sexp::get_ptr_offset().
+export struct CompactList {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_COMPACT_LIST;
+    /// Longer lists are split into several CompactList, chained by their tail, as many as a Sexp can index
+    static constexpr size_t MAX_SIZE = 1 << SCVAL_PTR_OFFSET_BITS;
+
+    size_t size;
+    /// The cdr of the last item: nil for a proper list, or the CompactList of the next items
+    Sexp tail;
+    // Followed by `size` items
+
+    Sexp* items() { return reinterpret_cast<Sexp*>(this + 1); }
+};
+
+/// The car and cdr of a pair, i.e. of a non-empty list, see as_pair()
+export struct PairRef {
+    /// Where the car is stored, it can be assigned to in place; nullptr if the Sexp is not a pair
+    Sexp* car;
+    Sexp cdr;
+
+    explicit operator bool() const { return car != nullptr; }
+};
+
+/// Takes apart the pair `s` references, either a ConsCell or an item of a CompactList
+export PairRef as_pair(Sexp s) {
+    if (!s.is_ptr() || s.is_nil())
+        return { nullptr, Sexp() };
+
+    auto ptr = s.as_ptr();
+    switch (ptr.get_type()) {
+        case ObjectType::TYPE_CONS_CELL: {
+            auto& cons_cell = *ptr.get_as_unchecked<ConsCell>();
+            return { &cons_cell.car, cons_cell.cdr };
+        }
+        case ObjectType::TYPE_COMPACT_LIST: {
+            auto& list = *ptr.get_as_unchecked<CompactList>();
+            size_t i = s.get_ptr_offset();
+            auto next = i + 1 < list.size ? Sexp(ptr, i + 1) : list.tail;
+            return { &list.items()[i], next };
+        }
+        default: return { nullptr, Sexp() };
+    }
+}
+
+export bool is_pair(Sexp s) {
+    if (!s.is_ptr() || s.is_nil())
+        return false;
+    auto type = s.as_ptr().get_type();
+    return type == ObjectType::TYPE_CONS_CELL || type == ObjectType::TYPE_COMPACT_LIST;
+}
+
+/// An exact integer too big for a fixnum; see make_integer()
+export struct BoxedInt {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_BOXED_INT;
+
+    int64_t v;
+};
+
+/// Reads the exact integer `s` into `out`, either a fixnum or a BoxedInt; returns false if it is neither
+export bool get_integer(Sexp s, int64_t& out) {
+    if (s.is_int()) {
+        out = s.as_int();
+        return true;
+    }
+    if (s.is_ptr<BoxedInt>()) {
+        out = s.as_ptr<BoxedInt>()->v;
+        return true;
+    }
+    return false;
+}
+
+/// A vector of arbitrary values, see #(...) and (make-vector).
+/// Its items are stored right after it, like those of a CompactList, so that a big vector is a large object of the heap, see allocate_vector().
+export struct Vector {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_VECTOR;
+    using Item = Sexp;
+
+    size_t size;
+    // Followed by `size` items
+
+    std::span<Sexp> items() { return { reinterpret_cast<Sexp*>(this + 1), size }; }
+};
+
+/// A vector of numbers of type T only, stored unboxed and back to back for the bulk numerical builtins such as (vector-sum).
+/// See #s64(...), #f64(...), (make-s64vector) and (make-f64vector).
+export template <typename T>
+struct NumericVector {
+    static constexpr auto HEAP_OBJECT_TYPE = std::is_same_v<T, double> ? ObjectType::TYPE_FLOAT_VECTOR : ObjectType::TYPE_INT_VECTOR;
+    using Item = T;
+
+    size_t size;
+    // Followed by `size` items
+
+    std::span<T> items() { return { reinterpret_cast<T*>(this + 1), size }; }
+};
+export using IntVector = NumericVector<int64_t>;
+export using FloatVector = NumericVector<double>;
+
+/// Allocates a vector of type TVec with `size` items, nil for a Vector, and left for the caller to fill in for a numeric one.
+/// One too big for the segments of the heap is mapped on its own, and counts towards its limit like any other object.
+/// If `pretenure`, it is allocated directly in the old generation, like parsed code.
+export template <typename TVec>
+TVec* allocate_vector(size_t size, Heap& heap, bool pretenure = false) {
+    size_t bytes = sizeof(TVec) + size * sizeof(typename TVec::Item);
+    auto [obj, _] = pretenure ? heap.allocate_old(bytes, alignof(TVec), TVec::HEAP_OBJECT_TYPE)
+                              : heap.allocate(bytes, alignof(TVec), TVec::HEAP_OBJECT_TYPE);
+    auto vec = new (obj) TVec{ .size = size };
+    if constexpr (std::is_same_v<typename TVec::Item, Sexp>)
+        std::uninitialized_fill_n(vec->items().data(), size, Sexp());
+    return vec;
+}
+
 export struct String {
     static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_STRING;
 
+    /// Characters owned by the String, unless `borrowed` is set
     std::string v;
+    /// If not empty, the characters, borrowed from the text of a SourceFile instead of copied into `v`
+    std::string_view borrowed;
+
+    std::string_view view() const { return borrowed.empty() ? std::string_view(v) : borrowed; }
+};
+
+/// Compiled form of a proc body or of a top-level form, run by the VM in eval()
+export struct Bytecode {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_BYTECODE;
+
+    /// Name the proc is defined with, or nullptr for lambdas and top-level forms
+    const Symbol* name = nullptr;
+    /// Number of parameters, which are bound to the first slots of the proc's scope
+    size_t n_params = 0;
+    /// Opcode bytes, each followed by its operands, see TOYSCHEME_OPCODES
+    std::vector<uint8_t> ops;
+    /// Quoted data, symbols of the globals used, and the Bytecode of nested procs
+    std::vector<Sexp> constants;
+    /// Where the (lambda) or (define) form it was compiled from starts in the source text, only recorded while profiling
+    const char* source_pos = nullptr;
+    /// Index of its Profiler::Proc plus 1, or 0 until its first call while profiling
+    uint32_t profile_id = 0;
+    /// Whether a closure may be created while the scope of the proc is current, which captures it.
+    /// If not, it is taken from Environment::stack_scopes rather than allocated for each call.
+    bool captures_scope = true;
 };
 
 export struct UserProc {
     static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_USER_PROC;
 
-    const Symbol* name;
     HeapPtr<Scope> closure_frame;
-    std::vector<const Symbol*> arguments;
-    // NOTE: we could use Sexp here, but since the body is always a list, pointing directly to ConsCell is just easier
-    HeapPtr<ConsCell> body;
+    HeapPtr<Bytecode> code;
 };
 
 export struct BuiltinProc {
     static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_BUILTIN_PROC;
 
-    // NOTE: we don't bind parameters to names in a scope when evaluating builtin functions, instead just using the list directly
-    using FnPtr = Sexp (*)(Sexp args, Environment& env);
+    // NOTE: we don't bind parameters to names in a scope when calling builtin functions, instead just passing the evaluated arguments directly
+    using FnPtr = Sexp (*)(std::span<const Sexp> args, Environment& env);
 
     const Symbol* name;
+    /// nullptr for special forms such as (if) and (define), which are compiled into bytecode and can't be called at runtime
     FnPtr fn;
 };
 
@@ -317,29 +735,47 @@ export struct Scope {
 
     /// The CallFrame in the "previous level" of closure
     HeapPtr<Scope> prev;
-    std::unordered_map<const Symbol*, Sexp> bindings;
+    /// Values of the variables, indexed by the slot resolve_lexical_addresses() assigned to each of them
+    std::vector<Sexp> slots;
 };
 
 /// Constructs a ConsCell on heap, with car = a and cdr = b, and return a reference Sexp to it.
 export Sexp cons(Sexp a, Sexp b, Environment& env);
 export void cons_inplace(Sexp a, Sexp& list, Environment& env);
 
+/// Constructs a proper list of `items`, as CompactList.
+/// If `pretenure`, it is allocated directly in the old generation, like parsed code.
+/// NOTE: `items` must stay reachable by the garbage collector, e.g. by being on the native stack or Environment::vm_stack, as this allocates.
+export Sexp make_compact_list(std::span<const Sexp> items, Environment& env, bool pretenure = false);
+
+/// Constructs a vector of `type`, one of TYPE_VECTOR, TYPE_INT_VECTOR or TYPE_FLOAT_VECTOR, holding `items`.
+/// Throws if some item doesn't fit in a numeric vector. If `pretenure`, it is allocated directly in the old generation, like parsed code.
+export Sexp make_vector(std::span<const Sexp> items, ObjectType type, Environment& env, bool pretenure = false);
+
+/// Constructs the exact integer `v`: a fixnum if it fits in one, a BoxedInt otherwise, so that each integer has a single representation
+export Sexp make_integer(int64_t v, Environment& env);
+
 // NB: we use varadic template for perfect forwarding, std::initializer_list forces us to make copies
 export template <typename... Ts>
 Sexp make_list_v(Environment& env, Ts&&... sexps) {
-    Sexp the_list;
-    FOLD_ITER_BACKWARDS(cons_inplace(std::forward<Ts>(sexps), the_list, env));
-    return the_list;
+    if constexpr (sizeof...(Ts) == 0) {
+        return Sexp();
+    } else {
+        const Sexp items[] = { Sexp(std::forward<Ts>(sexps))... };
+        return make_compact_list(items, env);
+    }
 }
 
 export template <typename TIter, typename TSentinel>
 Sexp make_list(TIter&& iter, TSentinel&& sentinel, Environment& env) {
-    // TODO use compact list optimization here
-    Sexp lst;
+    // Gather the items where the garbage collector can see them, while the list is being allocated
+    auto& items = env.vm_stack;
+    size_t first = items.size();
+    DEFER { items.resize(first); };
     for (; iter != sentinel; ++iter) {
-        cons_inplace(*iter, lst, env);
+        items.push_back(*iter);
     }
-    return lst;
+    return make_compact_list(std::span(items).subspan(first), env);
 }
 
 // Returns true if its cdr is a cons cell pointer, e.g. (1 . ()) or (1 . (2 . ()))
@@ -348,10 +784,10 @@ export bool is_list(const ConsCell& cons) {
     return cons.cdr.is_ptr();
 }
 
-// Same as is_list(ConsCell) but ensures the Sexp is a ConsCell
+// Same as is_list(ConsCell) but for any kind of pair
 export bool is_list(Sexp s) {
-    if (!s.is_ptr()) return false;
-    return is_list(*s.as_ptr().as<ConsCell>());
+    auto pair = as_pair(s);
+    return pair && pair.cdr.is_ptr();
 }
 
 export Sexp car(Sexp s);
@@ -361,45 +797,37 @@ export Sexp list_nth_elm(Sexp list, int idx, Environment& env);
 export void list_get_prefix(Sexp list, std::initializer_list<Sexp*> out_prefix, Sexp* out_rest, Environment& env);
 export void list_get_everything(Sexp list, std::initializer_list<Sexp*> out, Environment& env);
 
-export UserProc* make_user_proc(Sexp param_decl, Sexp body_decl, Environment& env);
-
 export struct SexpListSentinel {};
 export struct SexpListIterator {
     using Sentinel = SexpListSentinel;
 
-    ConsCell* curr;
+    /// The pair we are at, whose car is nullptr past the end of the list
+    PairRef curr;
     Environment* env;
 
-    static ConsCell* calc_next(Sexp s, Environment& env) {
-        if (s.is_ptr()) {
-            return s.as_ptr().get_as<ConsCell>();
-        }
-        return nullptr;
-    }
-
     SexpListIterator(ConsCell* cons, Environment& env)
-        : curr{ cons }
+        : curr{ as_pair(cons ? Sexp(cons) : Sexp()) }
         , env{ &env } {}
 
     SexpListIterator(Sexp s, Environment& env)
-        : curr{ calc_next(s, env) }
+        : curr{ as_pair(s) }
         , env{ &env } {}
 
     Sexp& operator*() const {
-        return curr->car;
+        return *curr.car;
     }
 
     SexpListIterator& operator++() {
-        curr = calc_next(curr->cdr, *env);
+        curr = as_pair(curr.cdr);
         return *this;
     }
 
     bool operator==(SexpListSentinel) const {
-        return curr == nullptr;
+        return curr.car == nullptr;
     }
 
     bool is_end() const {
-        return curr == nullptr;
+        return curr.car == nullptr;
     }
 };
 export using SexpListIterable = Iterable<SexpListIterator, SexpListIterator>;
@@ -411,20 +839,121 @@ export SexpListIterable iterate(Sexp s, Environment& env) {
     return { SexpListIterator(s, env) };
 }
 
-export Sexp parse_sexp(std::string_view src, Environment& env);
+/// Parses all the sexps of `src` into a list.
+/// If `borrow_src`, `src` lives as long as `env`, so string literals and symbols may refer to it instead of being copied.
+export Sexp parse_sexp(std::string_view src, Environment& env, bool borrow_src = false);
+
+/// Parses source text one top-level form at a time, so that each can be evaluated before the rest is even read.
+/// Only the source of the forms not returned yet is kept around, and consumed forms are left for the garbage collector.
+export class SexpReader {
+private:
+    Environment* _env;
+    /// nullptr when reading from a string or a SourceFile
+    std::istream* _input = nullptr;
+    /// Set when reading from a SourceFile, whose text strings and symbols can borrow
+    const SourceFile* _file = nullptr;
+    /// Source read from `_input` but not parsed yet, starting at `_cursor`
+    std::string _buffer;
+    /// The source left to parse, i.e. the string the reader was constructed with, or the unparsed part of `_buffer`
+    std::string_view _src;
+    size_t _cursor = 0;
+    bool _at_eof = false;
+    /// Lexemes of the forms read so far, that next() builds one at a time, up to `_next_form`
+    LexedSource _lexed;
+    size_t _next_form = 0;
+    /// Lexemes of the window of a SourceFile lexed ahead on `_lex_threads` threads, to move into `_lexed` in turn
+    std::vector<LexedSource> _lexed_ahead;
+    size_t _next_segment = 0;
+    unsigned _lex_threads = 1;
+    /// Offset in `_file` of the text given back to the OS, see SourceFile::release_before()
+    size_t _released = 0;
+
+public:
+    /// Reads from `input`, which must outlive the reader
+    SexpReader(std::istream& input, Environment& env);
+    /// Reads from `src`, which must outlive the reader
+    SexpReader(std::string_view src, Environment& env);
+    /// Reads the text of `file`, which must be one of `env.sources`.
+    /// A big file is lexed a window ahead at a time on up to `lex_threads` threads, split at what look like top-level forms.
+    SexpReader(const SourceFile& file, Environment& env, unsigned lex_threads = 1);
+
+    /// Parses the next top-level form, or returns std::nullopt at the end of the input
+    std::optional<Sexp> next();
+
+private:
+    /// Reads at least `min_size` more bytes from `_input`, unless it ends first
+    void read_more(size_t min_size);
+};
 export std::string dump_sexp(Sexp sexp, Environment& env);
 
-export Sexp call_user_proc(const UserProc& proc, Sexp params, Environment& env);
+/// Saves the global variables of `env`, and every object reachable from them, into an image file at `path`, for load_image() to restore in a later run.
+/// Throws ImageException on failure.
+export void dump_image(const std::filesystem::path& path, Environment& env);
+/// Defines the global variables saved by dump_image() into `env`, as fresh copies of the objects they reference, with the builtins bound to those of `env`.
+/// The image is mapped for the lifetime of `env`, as names and strings borrow its bytes. Throws ImageException on failure.
+export void load_image(const std::filesystem::path& path, Environment& env);
+
+/// Hash of source text, that a form cache must have been saved with to be used for that text
+export uint64_t hash_source_text(std::string_view text);
+
+/// Reads back the top-level forms of a source file from its form cache (.scmc), saved by FormCacheWriter in an earlier run,
+/// without lexing or parsing the file again; see --cache.
+export class FormCacheReader {
+private:
+    struct Reader;
+    std::unique_ptr<Reader> _reader;
+
+    explicit FormCacheReader(std::unique_ptr<Reader> reader);
+
+public:
+    /// Returns nullptr if `cache_path` can't be read, is corrupt, or wasn't saved from the text of `source`, whose hash_source_text() is `source_hash`,
+    /// by this version of the reader. Otherwise the cache is mapped for the lifetime of `env`, as names and strings borrow its bytes.
+    static std::unique_ptr<FormCacheReader> open(const std::filesystem::path& cache_path, const SourceFile& source, uint64_t source_hash, Environment& env);
+    ~FormCacheReader();
+
+    /// Decodes the next top-level form, or returns std::nullopt at the end of the file. Throws ParseException if the cache is corrupt.
+    std::optional<Sexp> next();
+};
+
+/// Records the top-level forms of a source file as they are parsed, to save them in a form cache for FormCacheReader
+export class FormCacheWriter {
+private:
+    struct Writer;
+    std::unique_ptr<Writer> _writer;
+    uint64_t _source_hash;
+    uint64_t _source_size;
+
+public:
+    /// `source_hash` is the hash_source_text() of `source`
+    FormCacheWriter(const SourceFile& source, uint64_t source_hash);
+    ~FormCacheWriter();
+
+    /// Records `form`, which must be fresh from the parser: evaluating a form rewrites it
+    void add(Sexp form);
+    /// Writes the forms recorded so far to `cache_path`, creating its directory if needed; returns false on failure
+    bool save(const std::filesystem::path& cache_path);
+};
 
 void setup_scope_for_builtins(Environment& env);
+/// Binds the vector builtins, see vector.cpp
+void setup_vector_builtins(Environment& env);
+/// Binds the global `name` to a new builtin calling `fn`, or standing for a special form if nullptr
+void define_builtin(Environment& env, std::string_view name, BuiltinProc::FnPtr fn);
+/// If `name` is bound to the builtin of the same name, i.e. it has not been redefined, returns that builtin
+const BuiltinProc* find_builtin(Sexp name, const Environment& env);
+
+/// Rewrites, in place, every reference to a parameter or local variable inside the procs and lets of the top-level form `form` into its LocalRef.
+/// Free variables are left as symbols, to be looked up in the globals.
+void resolve_lexical_addresses(Sexp form, Environment& env);
+/// Compiles the top-level form `form` into a Bytecode with no parameters
+Bytecode* compile_toplevel(Sexp form, Environment& env);
+/// Runs `code` in the current scope until it returns. The profiler counts it as a call of the proc whose body it is if `is_proc`, of a top-level form otherwise.
+Sexp run_bytecode(Bytecode& code, Environment& env, bool is_proc = false);
+/// Calls `proc`, a builtin or a user proc, with `args` and returns its result, for builtins that call procs they are given.
+/// `args` must not point into env.vm_stack, which the call may grow.
+Sexp apply_proc(Sexp proc, std::span<const Sexp> args, Environment& env);
 
 /// Implements (eval)
 export Sexp eval(Sexp sexp, Environment& env);
 
-/// If `forms` isd a list, given to eval_many();
-/// If `forms` is not a list, given to eval().
-export Sexp eval_maybe_many(Sexp forms, Environment& env);
-/// Implements (progn): evalute each element in `forms`, and return the result of the last one.
-export Sexp eval_many(ConsCell* forms, Environment& env);
-
 } // namespace toyscheme
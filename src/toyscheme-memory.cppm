@@ -9,8 +9,19 @@ import std.compat;
 namespace toyscheme {
 
 /******** Forward declarations ********/
+struct Sexp;
 struct ConsCell;
 struct Scope;
+struct Environment;
+struct String;
+struct UserProc;
+struct BuiltinProc;
+struct Bytecode;
+struct CompactList;
+struct BoxedInt;
+struct Vector;
+template <typename T>
+struct NumericVector;
 
 export enum class ObjectType : uint16_t {
     TYPE_UNKNOWN,
@@ -19,13 +30,32 @@ export enum class ObjectType : uint16_t {
     TYPE_USER_PROC,
     TYPE_BUILTIN_PROC,
     TYPE_CALL_FRAME,
+    TYPE_BYTECODE,
+    TYPE_COMPACT_LIST,
+    TYPE_BOXED_INT,
+    TYPE_VECTOR,
+    TYPE_INT_VECTOR,
+    TYPE_FLOAT_VECTOR,
+    /// A dead object, or a coalesced run of them, waiting in a free list to be reused
+    TYPE_FREE,
 };
 
+export constexpr size_t OBJECT_TYPE_COUNT = std::to_underlying(ObjectType::TYPE_FREE) + 1;
+
+/// Name of `type` as shown in heap statistics, e.g. "cons-cell"
+export std::string_view object_type_name(ObjectType type);
+
 export struct ObjectHeader {
     static constexpr int TRACKED_FLAG_BIT = 0;
     static constexpr int TRACKED_GC_MARK_BIT = 1;
-
-    // TODO we should move the size as an extra allocation after the header, only for UNKNOWN heap objects
+    /// Object lives in the nursery, and is either evacuated or promoted in place by the next minor collection
+    static constexpr int TRACKED_GC_YOUNG_BIT = 2;
+    /// Old object that is in Heap's remembered set, because it may reference young objects
+    static constexpr int TRACKED_GC_REMEMBERED_BIT = 3;
+    /// Young object that has been evacuated, the first word of its payload points to the new copy
+    static constexpr int TRACKED_GC_FORWARDED_BIT = 4;
+
+    /// Size of the payload, stored for every object so that segments can be walked without looking at types
     uint8_t _size_p0, _size_p1, _size_p2, _size_p3;
     uint8_t _type_p0, _type_p1;
     uint8_t _align;
@@ -37,7 +67,6 @@ export struct ObjectHeader {
     bool is_flag_set(int flag_bit) const;
     void set_flag(int flag_bit, bool value);
 
-    size_t _read_size() const;
     size_t get_size() const;
     void set_size(size_t size);
 
@@ -46,6 +75,18 @@ export struct ObjectHeader {
 
     ObjectType get_type() const;
     void set_type(ObjectType type);
+
+    /// Sets up everything in one go, for the allocation fast path
+    void init(size_t size, size_t alignment, ObjectType type, uint8_t flags) {
+        _size_p0 = size & 0xFF;
+        _size_p1 = (size >> 8) & 0xFF;
+        _size_p2 = (size >> 16) & 0xFF;
+        _size_p3 = (size >> 24) & 0xFF;
+        _type_p0 = std::to_underlying(type) & 0xFF;
+        _type_p1 = (std::to_underlying(type) >> 8) & 0xFF;
+        _align = static_cast<uint8_t>(alignment);
+        _flags = flags;
+    }
 };
 
 static_assert(sizeof(ObjectHeader) == sizeof(uint64_t));
@@ -55,6 +96,10 @@ struct HeapSegment {
     std::byte* arena;
     std::byte* last_object;
     size_t arena_size;
+    /// Size of every object in the segment including its header, if the segment belongs to a size class; 0 if objects of any size are mixed in it
+    size_t slot_size = 0;
+    /// Mapped on its own, for a single object too big for the other segments, see Heap::allocate_large()
+    bool large_object = false;
 };
 
 export template <typename T>
@@ -146,75 +191,304 @@ struct HeapPtr<void> {
     }
 };
 
+/// Intrusive free list node, living in the payload of a TYPE_FREE object
+struct FreeChunk {
+    FreeChunk* next;
+};
+
+/// Old objects with a payload of up to this many bytes are allocated in segments of their size class, and their free slots kept in one list per class.
+/// Bigger objects share the remaining segments, and their free chunks a single first-fit list.
+constexpr size_t SIZE_CLASS_LIMIT = 128;
+constexpr size_t SIZE_CLASS_COUNT = SIZE_CLASS_LIMIT / alignof(void*) + 1;
+constexpr size_t FREE_LIST_COUNT = SIZE_CLASS_COUNT + 1;
+
+constexpr size_t HEAP_SEGMENT_SIZE = 32 * 1024;
+/// Objects taking more than this many bytes, header included, are not allocated in segments, but each in a mapping of its own
+constexpr size_t LARGE_OBJECT_THRESHOLD = HEAP_SEGMENT_SIZE / 4;
+
+/// How much memory a Heap may take, see Heap::Heap()
+export struct HeapConfig {
+    /// Memory committed up front, which is also the least allocation budget of the old generation between two full collections
+    size_t initial_bytes = 0;
+    /// Memory the heap may take at most, large objects included. Going past it throws OutOfMemoryException, once a full collection failed to make room.
+    size_t max_bytes = size_t(16) << 30;
+    /// Ask the system to back the heap with transparent huge pages, for fewer TLB misses; only supported on Linux
+    bool huge_pages = false;
+};
+
+/// Thrown by the allocation functions of Heap, when the heap is full and can't grow anymore
+export struct OutOfMemoryException {
+    std::string msg;
+    /// Set when it happened halfway through a collection, which leaves the heap unusable, rather than before the allocation changed anything
+    bool fatal = false;
+};
+
+/// Running totals of what a Heap did, see Heap::get_stats()
+/// These are bumped on the allocation fast path, so they are kept to plain counters.
+export struct HeapStats {
+    /// Objects allocated, in either generation, and their size including headers
+    uint64_t allocations = 0;
+    uint64_t allocated_bytes = 0;
+    /// Objects allocated, by ObjectType
+    std::array<uint64_t, OBJECT_TYPE_COUNT> allocations_by_type{};
+    /// The most memory the heap's segments and large objects took at any one time
+    size_t peak_heap_bytes = 0;
+    uint64_t minor_collections = 0;
+    uint64_t major_collections = 0;
+};
+
+/// What a Heap holds at one point in time, found by walking all of its objects, see Heap::take_snapshot()
+export struct HeapSnapshot {
+    struct TypeCount {
+        size_t objects = 0;
+        /// Including headers
+        size_t bytes = 0;
+    };
+
+    /// Objects in the heap by ObjectType, whether they are still reachable or not, as only a collection can tell.
+    /// TYPE_FREE counts the free chunks of the old generation.
+    std::array<TypeCount, OBJECT_TYPE_COUNT> types{};
+
+    size_t old_segments = 0;
+    /// Old generation segments that belong to a size class, out of `old_segments`
+    size_t old_size_class_segments = 0;
+    size_t nursery_segments = 0;
+    size_t segment_size = 0;
+    /// Objects too big for segments, each mapped on its own, and the memory their mappings take
+    size_t large_objects = 0;
+    size_t large_object_bytes = 0;
+    /// Memory taken by all segments and large objects, and the most they may take, see HeapConfig
+    size_t committed_bytes = 0;
+    size_t max_bytes = 0;
+
+    /// Bytes of the old generation's segments taken by objects, by free chunks between them, and not handed out yet by the bump allocator
+    size_t old_object_bytes = 0;
+    size_t old_free_bytes = 0;
+    size_t old_unused_bytes = 0;
+    /// Bytes of the nursery taken by objects since the last minor collection
+    size_t nursery_object_bytes = 0;
+
+    /// Old generation segments by how much of them is taken by objects: under 25%, under 50%, under 75%, and the rest
+    std::array<size_t, 4> old_segments_by_occupancy{};
+
+    /// Bytes found reachable in the old generation by the last full collection
+    size_t live_bytes_at_last_gc = 0;
+
+    /// Share of the old generation's free space that is scattered in free chunks between objects, rather than left in one piece at the bottom of segments
+    double fragmentation() const {
+        size_t free_space = old_free_bytes + old_unused_bytes;
+        return free_space == 0 ? 0.0 : static_cast<double>(old_free_bytes) / static_cast<double>(free_space);
+    }
+};
+
 export class Heap {
 private:
+    /// The owner of this heap, whose globals and scopes are the roots of garbage collection
+    Environment* env;
+    HeapConfig config;
+
+    /// Address range reserved up front for all segments, which only take memory once handed out
+    std::byte* reserved_range;
+    size_t reserved_size;
+    /// Where the next segment is carved out of `reserved_range`, once `released_segments` is empty
+    std::byte* next_segment;
+    /// Segments no longer in use, whose address range is still reserved. The first `cold_segments` of them had their memory given back to the system;
+    /// the others only get to once a full collection finds that no allocation took them back since the previous one, see collect_old_generation()
+    std::vector<std::byte*> released_segments;
+    size_t cold_segments = 0;
+    /// The fewest `released_segments` there were since the last full collection
+    size_t released_low_water = 0;
+    /// Memory taken by the segments and large objects currently mapped
+    size_t committed_bytes = 0;
+    /// Set while a collection runs, which may take the heap past its limit, see account_committed()
+    bool collecting = false;
+
+    /// Old generation, collected by mark-sweep, including the large objects
     std::vector<HeapSegment> heap_segments;
+    /// Index of the segment allocate_in_old_segments() currently bumps from, for each size class, and for the bigger objects last
+    std::array<size_t, FREE_LIST_COUNT> curr_segments{};
+    /// Dead objects reclaimed by the last sweep, see free_list_index()
+    std::array<FreeChunk*, FREE_LIST_COUNT> free_lists{};
+
+    /// Young generation, a fixed number of segments that new objects are bump allocated in
+    /// Survivors are copied to the old generation by a minor collection, except for segments pinned by the native stack, which are promoted as a whole.
+    std::vector<HeapSegment> nursery_segments;
+    HeapSegment* nursery;
+    /// Old objects that had a reference to some young object written into them
+    std::vector<ObjectHeader*> remembered_set;
+    /// Young objects with a non-trivial destructor, that need to be destroyed if they die young
+    std::vector<ObjectHeader*> young_destructibles;
+
+    /// The highest address of the native stack, i.e. the end of the region that is conservatively scanned for roots
+    std::byte* stack_top;
+    /// Work list of objects that are marked, but whose children are not yet
+    std::vector<ObjectHeader*> mark_stack;
+
+    /// Bytes allocated in the old generation, either promoted or pretenured, since the last full collection
+    size_t bytes_since_gc = 0;
+    size_t gc_threshold;
+    size_t live_bytes = 0;
+
+    HeapStats stats;
 
 public:
-    Heap();
+    /// Reserves the address range for `config.max_bytes` of segments, or throws OutOfMemoryException.
+    /// If the system won't reserve that much, e.g. with strict overcommit, the limit is lowered until it does.
+    Heap(Environment& env, const HeapConfig& config);
     ~Heap();
 
-    std::pair<std::byte*, ObjectHeader*> allocate(size_t size, size_t alignment);
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    /// Allocates a young object in the nursery, or a large object in a mapping of its own.
+    /// This may run a garbage collection first, when the nursery is full.
+    std::pair<std::byte*, ObjectHeader*> allocate(size_t size, size_t alignment, ObjectType type = ObjectType::TYPE_UNKNOWN) {
+        return allocate_young(size, alignment, type);
+    }
 
     template <typename T, typename... TArgs>
     std::pair<T*, ObjectHeader*> allocate(TArgs&&... args) {
-        auto [obj_raw, header] = allocate(sizeof(T), alignof(T));
+        auto [obj_raw, header] = allocate_only<T>();
         auto obj = new (obj_raw) T(std::forward<TArgs>(args)...);
-        header->set_type(T::HEAP_OBJECT_TYPE);
         return { obj, header };
     }
 
     template <typename T>
     std::pair<T*, ObjectHeader*> allocate_only() {
-        auto [obj_raw, header] = allocate(sizeof(T), alignof(T));
-        header->set_type(T::HEAP_OBJECT_TYPE);
+        static_assert(sizeof(T) + sizeof(ObjectHeader) <= LARGE_OBJECT_THRESHOLD, "young_destructibles only tracks objects in the nursery");
+        auto [obj_raw, header] = allocate_young(sizeof(T), alignof(T), T::HEAP_OBJECT_TYPE);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            young_destructibles.push_back(header);
         return { reinterpret_cast<T*>(obj_raw), header };
     }
 
-    std::byte* find_object(ObjectHeader* header) const;
-    ObjectHeader* find_header(std::byte* object) const;
+    /// Allocates an object directly in the old generation, for data that is known to be long lived, such as parsed code.
+    /// This may run a full garbage collection first, when the allocation budget set up by the last one is used up.
+    /// NOTE: if the object is initialized to reference young objects, write_barrier() must be called
+    std::pair<std::byte*, ObjectHeader*> allocate_old(size_t size, size_t alignment, ObjectType type = ObjectType::TYPE_UNKNOWN);
 
+    template <typename T, typename... TArgs>
+    std::pair<T*, ObjectHeader*> allocate_old(TArgs&&... args) {
+        auto [obj_raw, header] = allocate_old(sizeof(T), alignof(T), T::HEAP_OBJECT_TYPE);
+        auto obj = new (obj_raw) T(std::forward<TArgs>(args)...);
+        return { obj, header };
+    }
+
+    /// Must be called after a reference to `value` is stored into the already existing object `container`, unless `container` has just been allocated by allocate().
+    void write_barrier(const void* container, const void* value) {
+        if (value == nullptr)
+            return;
+        auto c = find_header(static_cast<const std::byte*>(container));
+        auto v = find_header(static_cast<const std::byte*>(value));
+        if (v->is_flag_set(ObjectHeader::TRACKED_GC_YOUNG_BIT) && !c->is_flag_set(ObjectHeader::TRACKED_GC_YOUNG_BIT))
+            remember(c);
+    }
+
+    /// Runs a minor collection, evacuating everything alive in the nursery into the old generation.
+    void collect_nursery();
+
+    /// Runs a full collection: a minor one, followed by a mark-sweep over the old generation.
+    /// Roots are the environment's globals and scopes, plus anything on the native stack that looks like a pointer into the heap.
+    void collect_garbage();
+
+    std::byte* find_object(ObjectHeader* header) const {
+        return reinterpret_cast<std::byte*>(header) + sizeof(ObjectHeader);
+    }
+
+    ObjectHeader* find_header(const std::byte* object) const {
+        return reinterpret_cast<ObjectHeader*>(const_cast<std::byte*>(object) - sizeof(ObjectHeader));
+    }
+
+    const HeapStats& get_stats() const { return stats; }
+
+    /// Walks every object of both generations, to tally them by type and see how full the segments are.
+    /// This is linear in the size of the heap, unlike get_stats().
+    HeapSnapshot take_snapshot() const;
+
+    /// Calls `visitor` with a typed pointer to every object in the heap, reachable or not; free chunks are skipped.
+    /// Objects of TYPE_UNKNOWN are passed as the span of their payload.
     void walk_heap_objects(auto&& visitor) const {
-        for (auto& hg : heap_segments) {
-            auto curr = std::bit_cast<uintptr_t>(hg.last_object);
-            auto end = std::bit_cast<uintptr_t>(hg.arena) + hg.arena_size;
-            while (curr < end) {
-                auto header = std::bit_cast<ObjectHeader*>(curr);
-                curr += sizeof(ObjectHeader);
-                size_t obj_size = header->get_size();
-                size_t obj_align = header->get_alignment();
-
-                auto obj = std::bit_cast<std::byte*>(curr);
-                curr += obj_size;
-
-                switch (header->get_type()) {
-                    using enum ObjectType;
-                    case TYPE_UNKNOWN:
-                        visitor(std::span<std::byte>(obj, obj_size));
-                        break;
-                    case TYPE_CONS_CELL:
-                        visitor(reinterpret_cast<ConsCell*>(obj));
-                        break;
-                    case TYPE_CALL_FRAME:
-                        visitor(reinterpret_cast<Scope*>(obj));
-                        break;
-                    // TODO
-                    // case TYPE_STRING:
-                    //     visitor(reinterpret_cast<String*>(obj));
-                    //     break;
-                    // case TYPE_USER_PROC:
-                    //     visitor(reinterpret_cast<String*>(obj));
-                    //     break;
-                    // case TYPE_BUILTIN_PROC:
-                    //     visitor(reinterpret_cast<String*>(obj));
-                    //     break;
-                }
+        auto visit_object = [&](ObjectHeader* header, std::byte* obj) {
+            switch (header->get_type()) {
+                using enum ObjectType;
+                case TYPE_UNKNOWN: visitor(std::span<std::byte>(obj, header->get_size())); break;
+                case TYPE_CONS_CELL: visitor(reinterpret_cast<ConsCell*>(obj)); break;
+                case TYPE_STRING: visitor(reinterpret_cast<String*>(obj)); break;
+                case TYPE_USER_PROC: visitor(reinterpret_cast<UserProc*>(obj)); break;
+                case TYPE_BUILTIN_PROC: visitor(reinterpret_cast<BuiltinProc*>(obj)); break;
+                case TYPE_CALL_FRAME: visitor(reinterpret_cast<Scope*>(obj)); break;
+                case TYPE_BYTECODE: visitor(reinterpret_cast<Bytecode*>(obj)); break;
+                case TYPE_COMPACT_LIST: visitor(reinterpret_cast<CompactList*>(obj)); break;
+                case TYPE_BOXED_INT: visitor(reinterpret_cast<BoxedInt*>(obj)); break;
+                case TYPE_VECTOR: visitor(reinterpret_cast<Vector*>(obj)); break;
+                case TYPE_INT_VECTOR: visitor(reinterpret_cast<NumericVector<int64_t>*>(obj)); break;
+                case TYPE_FLOAT_VECTOR: visitor(reinterpret_cast<NumericVector<double>*>(obj)); break;
+                case TYPE_FREE: break;
             }
-        }
+        };
+        for (auto& hg : heap_segments)
+            walk_segment(hg, visit_object);
+        for (auto& hg : nursery_segments)
+            walk_segment(hg, visit_object);
     }
 
 private:
+    /// Calls `fn` with the header and payload of every object in `hg`, free chunks included
+    static void walk_segment(const HeapSegment& hg, auto&& fn) {
+        auto curr = hg.last_object;
+        auto end = hg.arena + hg.arena_size;
+        while (curr < end) {
+            auto header = reinterpret_cast<ObjectHeader*>(curr);
+            auto obj = curr + sizeof(ObjectHeader);
+            curr = obj + header->get_size();
+            fn(header, obj);
+        }
+    }
+
+    std::pair<std::byte*, ObjectHeader*> allocate_young(size_t size, size_t alignment, ObjectType type) {
+        // We only support types that aligns to 64-bit word boundraries
+        // because Sexp uses pointer tagging with the lowest 3 bits
+        assert(alignment == alignof(void*));
+
+        // Keep every object a multiple of the alignment, so that objects are packed back to back and can be walked without knowing the padding
+        size = (size + alignment - 1) & ~(alignment - 1);
+        size_t total_size = size + sizeof(ObjectHeader);
+        if (total_size > LARGE_OBJECT_THRESHOLD) [[unlikely]]
+            return allocate_large(size, alignment, type);
+        if (static_cast<size_t>(nursery->last_object - nursery->arena) < total_size) [[unlikely]]
+            refill_nursery(total_size);
+
+        nursery->last_object -= total_size;
+        stats.allocations += 1;
+        stats.allocated_bytes += total_size;
+        stats.allocations_by_type[std::to_underlying(type)] += 1;
+        auto h = reinterpret_cast<ObjectHeader*>(nursery->last_object);
+        h->init(size, alignment, type, 1 << ObjectHeader::TRACKED_GC_YOUNG_BIT);
+        return { nursery->last_object + sizeof(ObjectHeader), h };
+    }
+
+    void refill_nursery(size_t size);
+    /// Maps a new object of its own, that is never young nor moved.
+    /// It is remembered right away, so that it can be initialized with young references like any object from allocate().
+    std::pair<std::byte*, ObjectHeader*> allocate_large(size_t size, size_t alignment, ObjectType type);
+    /// Hands out an empty segment from the reserved range
+    HeapSegment map_segment();
+    /// Gives the memory of `hg` back to the system: right away for a large object, at a later full collection for a segment, see released_segments
+    void unmap_segment(const HeapSegment& hg);
+    /// Accounts for `size` more bytes taken by the heap, or throws OutOfMemoryException if that would take it past its limit
+    void account_committed(size_t size);
     void new_heap_segment();
+    std::byte* allocate_in_old_segments(size_t size);
+    std::byte* allocate_from_free_list(size_t size);
+    void push_free_chunk(std::byte* chunk, size_t size);
+    void remember(ObjectHeader* header);
+
+    void collect_old_generation();
+    /// Drops the references held by the stack scopes not in use, see Environment::stack_scopes
+    void clear_unused_stack_scopes();
+    void mark_object(void* obj);
+    /// Frees unmarked objects, and returns the number of bytes still in use
+    size_t sweep_segment(HeapSegment& hg);
 };
 
 } // namespace toyscheme
@@ -70,6 +70,54 @@ bool is_power_of_two(T v) {
     return v != 0 && (v & (v - 1)) == 0;
 }
 
+// Overflow checked arithmetic on exact integers, returning true if the result doesn't fit in `res`, which is then left untouched
+#if defined(__GNUC__) || defined(__clang__)
+bool add_overflow(int64_t a, int64_t b, int64_t& res) {
+    int64_t v;
+    if (__builtin_add_overflow(a, b, &v))
+        return true;
+    res = v;
+    return false;
+}
+bool sub_overflow(int64_t a, int64_t b, int64_t& res) {
+    int64_t v;
+    if (__builtin_sub_overflow(a, b, &v))
+        return true;
+    res = v;
+    return false;
+}
+bool mul_overflow(int64_t a, int64_t b, int64_t& res) {
+    int64_t v;
+    if (__builtin_mul_overflow(a, b, &v))
+        return true;
+    res = v;
+    return false;
+}
+#else
+constexpr auto INT64_MIN_V = std::numeric_limits<int64_t>::min();
+constexpr auto INT64_MAX_V = std::numeric_limits<int64_t>::max();
+bool add_overflow(int64_t a, int64_t b, int64_t& res) {
+    if ((b > 0 && a > INT64_MAX_V - b) || (b < 0 && a < INT64_MIN_V - b))
+        return true;
+    res = a + b;
+    return false;
+}
+bool sub_overflow(int64_t a, int64_t b, int64_t& res) {
+    if ((b < 0 && a > INT64_MAX_V + b) || (b > 0 && a < INT64_MIN_V + b))
+        return true;
+    res = a - b;
+    return false;
+}
+bool mul_overflow(int64_t a, int64_t b, int64_t& res) {
+    bool overflow = a > 0 ? (b > 0 ? a > INT64_MAX_V / b : b < INT64_MIN_V / a)
+                          : (b > 0 ? a < INT64_MIN_V / b : a != 0 && b < INT64_MAX_V / a);
+    if (overflow)
+        return true;
+    res = a * b;
+    return false;
+}
+#endif
+
 uintptr_t shift_down_and_align(uintptr_t start, size_t size, size_t alignment) {
     assert(is_power_of_two(alignment));
 
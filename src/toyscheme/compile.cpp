@@ -0,0 +1,450 @@
+module;
+#include "opcodes.hpp"
+#include "util.hpp"
+
+module toyscheme;
+import std;
+
+using namespace std::literals;
+
+namespace toyscheme {
+
+namespace {
+/// Compiles forms, whose variable references have been resolved by resolve_lexical_addresses(), into the ops of a single Bytecode.
+/// Each form compiles to code that pushes exactly one value: its result.
+/// A form in tail position, i.e. whose result is returned right away by the Bytecode, may instead leave the current scope and return by itself.
+///
+/// It also tells which scopes can be captured: a closure captures the whole chain of scopes current when it is created, so a proc or let
+/// whose body (nested lets and all) creates none never has its scope outlive it, and takes it from Environment::stack_scopes instead.
+class BytecodeCompiler {
+public:
+    Environment* env;
+    Bytecode* code;
+    /// Number of CLOSURE instructions emitted so far
+    size_t closure_count = 0;
+
+    BytecodeCompiler(Environment& env, Bytecode& code)
+        : env{ &env }
+        , code{ &code } {}
+
+    void compile(Sexp form, bool is_tail = false) {
+        switch (form.get_flags()) {
+            case SCVAL_FLAG_LOCAL_REF: {
+                auto ref = form.as_local_ref();
+                if (ref.depth == 0)
+                    emit(Opcode::LOCAL_0, ref.slot);
+                else
+                    emit_local(Opcode::LOCAL, ref);
+            } break;
+            case SCVAL_FLAG_SYMBOL: emit(Opcode::GLOBAL, add_constant(form)); break;
+            case SCVAL_FLAG_PTR: {
+                if (form.is_nil())
+                    emit(Opcode::NIL);
+                else if (auto pair = as_pair(form))
+                    compile_form(pair, is_tail);
+                else
+                    emit(Opcode::CONST, add_constant(form));
+            } break;
+            // For every other sexp x, (eval x) => x
+            default: emit(Opcode::CONST, add_constant(form)); break;
+        }
+    }
+
+    /// Compiles the forms of a proc or let body in order, keeping only the result of the last one
+    void compile_body(Sexp body, bool is_tail) {
+        if (!is_list(body))
+            throw EvalException("proc body must have 1 or more forms"s);
+
+        for (auto it = SexpListIterator(body, *env); !it.is_end();) {
+            auto form = *it;
+            ++it;
+            if (it.is_end()) {
+                compile(form, is_tail);
+            } else {
+                compile(form);
+                emit(Opcode::POP);
+            }
+        }
+    }
+
+    /// Pushes the closure of a new proc, whose parameters are the first `n_params` slots of its scope.
+    /// `form_head` is where the head of the (lambda) or (define) form it comes from is stored, to tell where it is in the source while profiling.
+    void compile_lambda(size_t n_params, Sexp body, const Symbol* name, const Sexp* form_head = nullptr) {
+        auto [proc_code, _] = env->heap.allocate_old<Bytecode>();
+        proc_code->name = name;
+        proc_code->n_params = n_params;
+        if (env->profiler && form_head != nullptr)
+            proc_code->source_pos = env->profiler->find_form_position(form_head);
+        // Referenced from the constants right away, so that it survives the collections running while the body is compiled
+        auto k = add_constant(Sexp(proc_code));
+
+        BytecodeCompiler body_compiler(*env, *proc_code);
+        body_compiler.compile_body(body, true);
+        body_compiler.emit(Opcode::RETURN);
+        proc_code->captures_scope = body_compiler.closure_count > 0;
+
+        emit(Opcode::CLOSURE, k);
+        closure_count += 1;
+    }
+
+    void emit(Opcode op) {
+        code->ops.push_back(std::to_underlying(op));
+    }
+
+    void emit(Opcode op, size_t operand) {
+        emit(op);
+        emit_u16(operand);
+    }
+
+private:
+    void emit_u16(size_t v) {
+        if (v > std::numeric_limits<uint16_t>::max())
+            throw EvalException("proc is too large to be compiled"s);
+        auto v16 = static_cast<uint16_t>(v);
+        auto bytes = std::bit_cast<std::array<uint8_t, sizeof(v16)>>(v16);
+        code->ops.insert(code->ops.end(), bytes.begin(), bytes.end());
+    }
+
+    void emit_local(Opcode op, LocalRef ref) {
+        emit(op);
+        emit_u16(ref.depth);
+        emit_u16(ref.slot);
+    }
+
+    /// Emits a jump to a target not known yet, returning where to patch it in with patch_jump()
+    size_t emit_jump(Opcode op) {
+        emit(op, 0);
+        return code->ops.size() - sizeof(uint16_t);
+    }
+
+    /// Makes the jump emitted at `at` continue right after the code emitted so far
+    void patch_jump(size_t at) {
+        auto target = code->ops.size();
+        if (target > std::numeric_limits<uint16_t>::max())
+            throw EvalException("proc is too large to be compiled"s);
+        auto target16 = static_cast<uint16_t>(target);
+        std::memcpy(&code->ops[at], &target16, sizeof(target16));
+    }
+
+    size_t add_constant(Sexp value) {
+        auto& constants = code->constants;
+        auto iter = std::ranges::find(constants, value._value, &Sexp::_value);
+        if (iter != constants.end())
+            return iter - constants.begin();
+
+        constants.push_back(value);
+        write_barrier(env->heap, code, value);
+        return constants.size() - 1;
+    }
+
+    void compile_form(PairRef form, bool is_tail) {
+        auto head = *form.car;
+        auto params = form.cdr;
+
+        auto builtin = find_builtin(head, *env);
+        if (builtin && builtin->fn == nullptr) {
+            compile_special_form(*builtin->name, form.car, params, is_tail);
+            return;
+        }
+        if (builtin && compile_primitive(*builtin, params))
+            return;
+
+        // (proc arg ...)
+        size_t n_args = 0;
+        for (auto& arg : iterate(params, *env)) {
+            compile(arg);
+            n_args += 1;
+        }
+        if (builtin) {
+            // Called straight through its function pointer as long as its global still holds it, without checking what kind of proc it is
+            emit(Opcode::CALL_BUILTIN, add_constant(Sexp(const_cast<BuiltinProc*>(builtin))));
+            emit_u16(n_args);
+            return;
+        }
+        compile(head);
+        emit(is_tail ? Opcode::TAIL_CALL : Opcode::CALL, n_args);
+    }
+
+    /// Compiles calls to the arithmetic and list primitives into their own instructions, returning false if `params` doesn't fit.
+    /// The instructions check that the global of `builtin` still holds it when run, so that redefining it later applies to code compiled before.
+    bool compile_primitive(const BuiltinProc& builtin, Sexp params) {
+        static constexpr std::pair<std::string_view, Opcode> VARIADIC_OPS[] = {
+            { "+", Opcode::ADD },
+            { "-", Opcode::SUB },
+            { "*", Opcode::MUL },
+            { "/", Opcode::DIV },
+            { "=", Opcode::NUM_EQ },
+            { "<", Opcode::LT },
+            { "<=", Opcode::LE },
+            { ">", Opcode::GT },
+            { ">=", Opcode::GE },
+        };
+        static constexpr std::tuple<std::string_view, Opcode, size_t> FIXED_ARITY_OPS[] = {
+            { "car", Opcode::CAR, 1 },
+            { "cdr", Opcode::CDR, 1 },
+            { "null?", Opcode::IS_NULL, 1 },
+            { "cons", Opcode::CONS, 2 },
+        };
+
+        std::string_view name = *builtin.name;
+        size_t n_args = 0;
+        for (auto& _ : iterate(params, *env))
+            n_args += 1;
+
+        if (auto iter = std::ranges::find(VARIADIC_OPS, name, &std::pair<std::string_view, Opcode>::first); iter != std::end(VARIADIC_OPS)) {
+            for (auto& arg : iterate(params, *env))
+                compile(arg);
+            emit(iter->second, add_constant(Sexp(const_cast<BuiltinProc*>(&builtin))));
+            emit_u16(n_args);
+            return true;
+        }
+
+        for (auto& [op_name, op, arity] : FIXED_ARITY_OPS) {
+            if (op_name != name)
+                continue;
+            if (n_args != arity)
+                return false;
+            for (auto& arg : iterate(params, *env))
+                compile(arg);
+            emit(op, add_constant(Sexp(const_cast<BuiltinProc*>(&builtin))));
+            return true;
+        }
+
+        return false;
+    }
+
+    void compile_special_form(std::string_view name, const Sexp* head, Sexp params, bool is_tail) {
+        if (name == "quote") {
+            emit(Opcode::CONST, add_constant(car(params)));
+        } else if (name == "if") {
+            compile_if(params, is_tail);
+        } else if (name == "define") {
+            compile_define(head, params);
+        } else if (name == "lambda") {
+            Sexp decl_params;
+            Sexp body;
+            list_get_prefix(params, { &decl_params }, &body, *env);
+            compile_lambda(count_params(decl_params), body, nullptr, head);
+        } else if (name == "set!") {
+            compile_set(params);
+        } else if (name == "let") {
+            compile_let(params, false, is_tail);
+        } else if (name == "let*") {
+            compile_let(params, true, is_tail);
+        } else if (name == "progn") {
+            compile_body(params, is_tail);
+        } else {
+            throw EvalException(std::format("special form '{}' is not supported", name));
+        }
+    }
+
+    void compile_if(Sexp params, bool is_tail) {
+        Sexp cond;
+        Sexp true_case;
+        Sexp false_case;
+        list_get_everything(params, { &cond, &true_case, &false_case }, *env);
+
+        // Only the case taken is compiled if the condition is a constant, e.g. a debugging flag written as #f
+        if (auto value = constant_value(cond)) {
+            compile(value->evalute_bool() ? true_case : false_case, is_tail);
+            return;
+        }
+
+        compile(cond);
+        auto to_false_case = emit_jump(Opcode::JUMP_IF_FALSE);
+        compile(true_case, is_tail);
+        auto to_end = emit_jump(Opcode::JUMP);
+        patch_jump(to_false_case);
+        compile(false_case, is_tail);
+        patch_jump(to_end);
+    }
+
+    /// Value of `form` if it always evaluates to the same one, i.e. it is self-evaluating or quoted
+    std::optional<Sexp> constant_value(Sexp form) {
+        switch (form.get_flags()) {
+            case SCVAL_FLAG_SYMBOL:
+            case SCVAL_FLAG_LOCAL_REF: return std::nullopt;
+            case SCVAL_FLAG_PTR: {
+                auto pair = as_pair(form);
+                if (!pair)
+                    return form;
+                auto builtin = find_builtin(*pair.car, *env);
+                if (builtin && builtin->fn == nullptr && std::string_view(*builtin->name) == "quote")
+                    return car(pair.cdr);
+                return std::nullopt;
+            }
+            default: return form;
+        }
+    }
+
+    void compile_define(const Sexp* head, Sexp params) {
+        Sexp declaration;
+        Sexp body;
+        list_get_prefix(params, { &declaration }, &body, *env);
+
+        switch (declaration.get_flags()) {
+            // Defining a global value
+            case SCVAL_FLAG_SYMBOL: {
+                Sexp val;
+                list_get_everything(body, { &val }, *env);
+                compile(val);
+                emit(Opcode::DEFINE_GLOBAL, add_constant(declaration));
+            } break;
+
+            // Defining a local value, inside a proc or let body
+            case SCVAL_FLAG_LOCAL_REF: {
+                Sexp val;
+                list_get_everything(body, { &val }, *env);
+                compile(val);
+                emit_local(Opcode::SET_LOCAL, declaration.as_local_ref());
+            } break;
+
+            // Defining a function
+            case SCVAL_FLAG_PTR: {
+                Sexp decl_name;
+                Sexp decl_params;
+                list_get_prefix(declaration, { &decl_name }, &decl_params, *env);
+
+                if (decl_name.is_local_ref()) {
+                    compile_lambda(count_params(decl_params), body, nullptr, head);
+                    emit_local(Opcode::SET_LOCAL, decl_name.as_local_ref());
+                    break;
+                }
+
+                if (!decl_name.is_symbol())
+                    throw EvalException("proc name must be a symbol"s);
+
+                compile_lambda(count_params(decl_params), body, &decl_name.as_symbol(), head);
+                emit(Opcode::DEFINE_GLOBAL, add_constant(decl_name));
+            } break;
+
+            default:
+                throw EvalException("(define) expected symbol or func-declaration as 1st element"s);
+        }
+
+        emit(Opcode::NIL);
+    }
+
+    void compile_set(Sexp params) {
+        Sexp binding;
+        Sexp value;
+        list_get_prefix(params, { &binding, &value }, nullptr, *env);
+
+        if (binding.is_local_ref()) {
+            compile(value);
+            emit_local(Opcode::SET_LOCAL, binding.as_local_ref());
+        } else if (binding.is_symbol()) {
+            compile(value);
+            emit(Opcode::SET_GLOBAL, add_constant(binding));
+        } else {
+            throw EvalException("(set!) expected symbol as 1st argument"s);
+        }
+
+        emit(Opcode::NIL);
+    }
+
+    size_t count_params(Sexp param_decl) {
+        size_t n_params = 0;
+        for (Sexp param : iterate(param_decl, *env)) {
+            if (!param.is_symbol())
+                throw EvalException("proc parameter must be a symbol"s);
+            n_params += 1;
+        }
+        return n_params;
+    }
+
+    /// Pushes the val-expr of each (id val-expr) in `binding_forms`, returning how many there are.
+    /// If `sequential`, each value is instead stored into the next slot of the current scope as soon as it is evaluated.
+    size_t compile_let_bindings(Sexp binding_forms, bool sequential) {
+        size_t n_bindings = 0;
+        for (auto& form : iterate(binding_forms, *env)) {
+            Sexp id;
+            Sexp val_expr;
+            list_get_prefix(form, { &id, &val_expr }, nullptr, *env);
+
+            if (!id.is_symbol())
+                throw EvalException("(let) id must be a symbol"s);
+
+            compile(val_expr);
+            if (sequential)
+                emit_local(Opcode::SET_LOCAL, LocalRef{ .depth = 0, .slot = static_cast<uint16_t>(n_bindings) });
+            n_bindings += 1;
+        }
+        return n_bindings;
+    }
+
+    void compile_let(Sexp params, bool sequential, bool is_tail) {
+        Sexp arg_1st;
+        Sexp arg_rest;
+        list_get_prefix(params, { &arg_1st }, &arg_rest, *env);
+
+        // (let proc-id ((id val-expr) ...) body ...)
+        // This is a call to a proc, bound to proc-id in a scope of its own so that the body can recurse into it.
+        if (arg_1st.is_symbol()) {
+            Sexp binding_forms;
+            Sexp body;
+            list_get_prefix(arg_rest, { &binding_forms }, &body, *env);
+
+            // The val-exprs are evaluated in the enclosing scope, as arguments
+            auto n_args = compile_let_bindings(binding_forms, false);
+            constexpr LocalRef PROC_SLOT{ .depth = 0, .slot = 0 };
+            emit(Opcode::ENTER_SCOPE, 0);
+            compile_lambda(n_args, body, &arg_1st.as_symbol());
+            emit_local(Opcode::SET_LOCAL, PROC_SLOT);
+            emit_local(Opcode::LOCAL, PROC_SLOT);
+            if (is_tail) {
+                emit(Opcode::TAIL_CALL, n_args);
+            } else {
+                emit(Opcode::CALL, n_args);
+                emit(Opcode::LEAVE_SCOPE);
+            }
+            return;
+        }
+
+        // (let ((id val-expr) ...) body ...)
+        // (let* ((id val-expr) ...) body ...)
+        auto& binding_forms = arg_1st;
+        auto& body = arg_rest;
+        size_t enter_at;
+        size_t closures_before;
+        if (sequential) {
+            // Each val-expr sees the ids bound before it
+            enter_at = code->ops.size();
+            emit(Opcode::ENTER_SCOPE, 0);
+            closures_before = closure_count;
+            compile_let_bindings(binding_forms, true);
+        } else {
+            auto n_bindings = compile_let_bindings(binding_forms, false);
+            enter_at = code->ops.size();
+            emit(Opcode::ENTER_SCOPE, n_bindings);
+            closures_before = closure_count;
+        }
+        compile_body(body, is_tail);
+
+        // Nothing created in the scope can capture it, so it can come from the stack scopes, once the scope is known to be left
+        bool captures_scope = closure_count > closures_before;
+        if (!captures_scope)
+            code->ops[enter_at] = std::to_underlying(Opcode::ENTER_STACK_SCOPE);
+        // Returning restores the caller's scope anyway, and the body may not even come back here after a tail call
+        if (!is_tail)
+            emit(captures_scope ? Opcode::LEAVE_SCOPE : Opcode::LEAVE_STACK_SCOPE);
+    }
+};
+} // namespace
+
+Bytecode* compile_toplevel(Sexp form, Environment& env) {
+    // The positions of its lambdas are in their Bytecode once compiled, or never will be, e.g. for a quoted one
+    DEFER {
+        if (env.profiler)
+            env.profiler->forget_form_positions();
+    };
+    resolve_lexical_addresses(form, env);
+
+    auto [code, _] = env.heap.allocate_old<Bytecode>();
+    BytecodeCompiler compiler(env, *code);
+    compiler.compile(form, true);
+    compiler.emit(Opcode::RETURN);
+    return code;
+}
+
+} // namespace toyscheme
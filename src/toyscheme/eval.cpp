@@ -1,4 +1,5 @@
 module;
+#include "opcodes.hpp"
 #include "util.hpp"
 
 module toyscheme;
@@ -6,134 +7,127 @@ import std;
 
 using namespace std::literals;
 
+#if defined(__GNUC__) || defined(__clang__)
+// Jump straight from one instruction to the next through a table of label addresses ("computed goto"),
+// instead of going back to a single switch, which gives each instruction its own indirect branch to predict
+#    define TOYSCHEME_THREADED_DISPATCH 1
+#else
+#    define TOYSCHEME_THREADED_DISPATCH 0
+#endif
+
 namespace toyscheme {
 
 namespace {
-Sexp wrap_number(double v) {
-    // TODO makes this less wack
-    if (auto n = static_cast<int32_t>(v); n == v)
-        return Sexp(n);
-    else
-        return Sexp(static_cast<float>(v));
+bool is_number(Sexp v) {
+    return v.is_int() || v.is_float() || v.is_ptr<BoxedInt>();
 }
 
-Sexp builtin_add(Sexp params, Environment& env) {
-    double res = 0.0;
-
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        switch (v.get_flags()) {
-            case SCVAL_FLAG_INT: res += v.as_int(); break;
-            case SCVAL_FLAG_FLOAT: res += v.as_float(); break;
-            default: throw EvalException("+ cannot accept non-numerical parameters"s);
-        }
+/// Value of a numerical parameter of `op`, for the inexact paths
+double to_double(Sexp v, std::string_view op) {
+    switch (v.get_flags()) {
+        case SCVAL_FLAG_INT: return v.as_int();
+        case SCVAL_FLAG_FLOAT: return v.as_float();
     }
+    if (v.is_ptr<BoxedInt>())
+        return static_cast<double>(v.as_ptr<BoxedInt>()->v);
+    throw EvalException(std::format("{} cannot accept non-numerical parameters", op));
+}
 
-    return wrap_number(res);
+// Arithmetic runs on exact integers for as long as all parameters are, and the result fits in 64 bits;
+// otherwise, it picks up from the partial result `acc` in floating point, for the remaining parameters `rest`.
+
+template <typename Op>
+Sexp inexact_fold(double acc, std::span<const Sexp> rest, std::string_view op_name) {
+    Op op{};
+    for (auto v : rest)
+        acc = op(acc, to_double(v, op_name));
+    return Sexp(acc);
 }
 
-Sexp builtin_sub(Sexp params, Environment& env) {
-    double res = 0.0;
-    int param_cnt = 0;
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        double vf;
-        switch (v.get_flags()) {
-            case SCVAL_FLAG_INT: vf = v.as_int(); break;
-            case SCVAL_FLAG_FLOAT: vf = v.as_float(); break;
-            default: throw EvalException("- cannot accept non-numerical parameters"s);
-        }
+Sexp builtin_add(std::span<const Sexp> args, Environment& env) {
+    int64_t res = 0;
+    for (size_t i = 0; i < args.size(); ++i) {
+        int64_t v;
+        if (!get_integer(args[i], v) || add_overflow(res, v, res))
+            return inexact_fold<std::plus<>>(static_cast<double>(res), args.subspan(i), "+");
+    }
 
-        if (param_cnt == 0)
-            res = vf;
-        else
-            res -= vf;
+    return make_integer(res, env);
+}
 
-        param_cnt += 1;
+Sexp builtin_sub(std::span<const Sexp> args, Environment& env) {
+    if (args.empty())
+        return Sexp(0);
+
+    int64_t res;
+    if (!get_integer(args[0], res)) {
+        double first = to_double(args[0], "-");
+        // Unary minus
+        if (args.size() == 1)
+            return Sexp(-first);
+        return inexact_fold<std::minus<>>(first, args.subspan(1), "-");
     }
 
     // Unary minus
-    if (param_cnt == 1) {
-        res = -res;
+    if (args.size() == 1) {
+        if (sub_overflow(0, res, res))
+            return Sexp(-static_cast<double>(res));
+        return make_integer(res, env);
     }
 
-    return wrap_number(res);
-}
-
-Sexp builtin_mul(Sexp params, Environment& env) {
-    double res = 1.0;
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        switch (v.get_flags()) {
-            case SCVAL_FLAG_INT: res *= v.as_int(); break;
-            case SCVAL_FLAG_FLOAT: res *= v.as_float(); break;
-            default: throw EvalException("* cannot accept non-numerical parameters"s);
-        }
+    for (size_t i = 1; i < args.size(); ++i) {
+        int64_t v;
+        if (!get_integer(args[i], v) || sub_overflow(res, v, res))
+            return inexact_fold<std::minus<>>(static_cast<double>(res), args.subspan(i), "-");
     }
 
-    return wrap_number(res);
+    return make_integer(res, env);
 }
 
-Sexp builtin_div(Sexp params, Environment& env) {
-    double res = 0.0;
-    bool is_first = true;
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        double vf;
-        switch (v.get_flags()) {
-            case SCVAL_FLAG_INT: vf = v.as_int(); break;
-            case SCVAL_FLAG_FLOAT: vf = v.as_float(); break;
-            default: throw EvalException("/ cannot accept non-numerical parameters"s);
-        }
-
-        if (is_first) {
-            is_first = false;
-            res = vf;
-        } else {
-            res /= vf;
-        }
+Sexp builtin_mul(std::span<const Sexp> args, Environment& env) {
+    int64_t res = 1;
+    for (size_t i = 0; i < args.size(); ++i) {
+        int64_t v;
+        if (!get_integer(args[i], v) || mul_overflow(res, v, res))
+            return inexact_fold<std::multiplies<>>(static_cast<double>(res), args.subspan(i), "*");
     }
 
-    return wrap_number(res);
+    return make_integer(res, env);
 }
 
-Sexp builtin_sqrt(Sexp params, Environment& env) {
-    Sexp p;
-    list_get_everything(params, { &p }, env);
-
-    auto v = eval(p, env);
-    double x;
-    switch (v.get_flags()) {
-        case SCVAL_FLAG_INT: x = v.as_int(); break;
-        case SCVAL_FLAG_FLOAT: x = v.as_float(); break;
-        default: throw EvalException("sqrt cannot accept non-numerical parameters"s);
+Sexp builtin_div(std::span<const Sexp> args, Environment& env) {
+    if (args.empty())
+        return Sexp(0);
+
+    int64_t res;
+    if (!get_integer(args[0], res))
+        return inexact_fold<std::divides<>>(to_double(args[0], "/"), args.subspan(1), "/");
+
+    for (size_t i = 1; i < args.size(); ++i) {
+        int64_t v;
+        // Only exact as long as it divides evenly; INT64_MIN / -1 is the one quotient that overflows
+        bool is_exact = get_integer(args[i], v) && v != 0 && res % v == 0 && !(v == -1 && res == std::numeric_limits<int64_t>::min());
+        if (!is_exact)
+            return inexact_fold<std::divides<>>(static_cast<double>(res), args.subspan(i), "/");
+        res /= v;
     }
 
-    double res = std::sqrt(x);
-
-    return Sexp(static_cast<float>(res));
+    return make_integer(res, env);
 }
 
-Sexp builtin_if(Sexp params, Environment& env) {
-    Sexp cond;
-    Sexp true_case;
-    Sexp false_case;
-    list_get_everything(params, { &cond, &true_case, &false_case }, env);
+Sexp builtin_sqrt(std::span<const Sexp> args, Environment& env) {
+    if (args.size() != 1)
+        throw EvalException("sqrt expects exactly 1 parameter"s);
 
-    Sexp cond_val = eval(cond, env);
-    if (cond_val.evalute_bool()) {
-        return eval(true_case, env);
-    } else {
-        return eval(false_case, env);
-    }
+    double res = std::sqrt(to_double(args[0], "sqrt"));
+
+    return Sexp(res);
 }
 
-Sexp builtin_eq(Sexp params, Environment& env) {
+Sexp builtin_eq(std::span<const Sexp> args, Environment& env) {
     bool is_first = true;
     Sexp prev;
-    for (auto& param : iterate(params, env)) {
-        Sexp curr = eval(param, env);
-
+    for (auto curr : args) {
         if (is_first) {
             is_first = false;
             prev = curr;
@@ -150,323 +144,565 @@ Sexp builtin_eq(Sexp params, Environment& env) {
 }
 
 template <typename Op>
-Sexp builtin_binary_op(Sexp params, Environment& env) {
-    bool is_first = true;
-    double prev;
+Sexp builtin_binary_op(std::span<const Sexp> args, Environment& env) {
     Op op{};
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        double curr;
-        if (v.is_float())
-            curr = v.as_float();
-        else if (v.is_int())
-            curr = v.as_int();
-        else
+    for (size_t i = 0; i < args.size(); ++i) {
+        auto curr = args[i];
+        if (!is_number(curr))
             throw EvalException("parameters must be numerical"s);
-        if (!is_first) {
-            bool success = op(prev, curr);
-            if (!success)
-                return Sexp(false);
-        }
-        is_first = false;
-        prev = curr;
+        if (i == 0)
+            continue;
+
+        // Exact integers are compared as such, so that those beyond the precision of a double are told apart
+        auto prev = args[i - 1];
+        int64_t a, b;
+        bool success = get_integer(prev, a) && get_integer(curr, b)
+            ? op(a, b)
+            : op(to_double(prev, "comparison"), to_double(curr, "comparison"));
+        if (!success)
+            return Sexp(false);
     }
 
     return Sexp(true);
 }
 
-Sexp builtin_car(Sexp params, Environment& env) {
-    return car(eval(list_nth_elm(params, 0, env), env));
-}
-Sexp builtin_cdr(Sexp params, Environment& env) {
-    return cdr(eval(list_nth_elm(params, 0, env), env));
+Sexp builtin_car(std::span<const Sexp> args, Environment& env) {
+    if (args.empty())
+        throw EvalException("car expects 1 parameter"s);
+    return car(args[0]);
 }
-Sexp builtin_cons(Sexp params, Environment& env) {
-    Sexp a;
-    Sexp b;
-    list_get_everything(params, { &a, &b }, env);
-    return cons(
-        eval(a, env),
-        eval(b, env),
-        env);
+Sexp builtin_cdr(std::span<const Sexp> args, Environment& env) {
+    if (args.empty())
+        throw EvalException("cdr expects 1 parameter"s);
+    return cdr(args[0]);
 }
-
-Sexp builtin_is_null(Sexp params, Environment& env) {
-    return Sexp(eval(car(params), env).is_nil());
+Sexp builtin_cons(std::span<const Sexp> args, Environment& env) {
+    if (args.size() != 2)
+        throw EvalException("cons expects exactly 2 parameters"s);
+    return cons(args[0], args[1], env);
 }
 
-Sexp builtin_quote(Sexp params, Environment& env) {
-    return car(params);
+Sexp builtin_is_null(std::span<const Sexp> args, Environment& env) {
+    if (args.empty())
+        throw EvalException("null? expects 1 parameter"s);
+    return Sexp(args[0].is_nil());
 }
 
-Sexp builtin_define(Sexp params, Environment& env) {
-    auto& curr_scope = env.curr_scope->bindings;
-
-    Sexp declaration;
-    Sexp body;
-    list_get_prefix(params, { &declaration }, &body, env);
-
-    switch (declaration.get_flags()) {
-        // Defining a value
-        case SCVAL_FLAG_SYMBOL: {
-            auto& name = declaration.as_symbol();
-
-            Sexp val;
-            list_get_everything(body, { &val }, env);
-
-            curr_scope.insert_or_assign(&name, eval(val, env));
-        } break;
-
-        // Defining a function
-        case SCVAL_FLAG_PTR: {
-            Sexp decl_name;
-            Sexp decl_params;
-            list_get_prefix(declaration, { &decl_name }, &decl_params, env);
-
-            if (!decl_name.is_symbol())
-                throw EvalException("proc name must be a symbol"s);
-            auto& proc_name = decl_name.as_symbol();
-
-            auto p = make_user_proc(decl_params, body, env);
-            p->name = &proc_name;
-
-            env.curr_scope->bindings.insert_or_assign(&proc_name, Sexp(p));
-        } break;
+/// Returns an association list of `(name value)` entries, the last of which is `(types (type-name objects bytes allocations) ...)`.
+/// Objects and bytes count what the heap holds right now, garbage included; the rest are totals since the heap was created.
+Sexp builtin_heap_stats(std::span<const Sexp> args, Environment& env) {
+    if (!args.empty())
+        throw EvalException("heap-stats expects no parameters"s);
+
+    // Take the numbers before building the result, which allocates
+    auto stats = env.heap.get_stats();
+    auto snapshot = env.heap.take_snapshot();
+
+    auto& entries = env.vm_stack;
+    size_t first = entries.size();
+    DEFER { entries.resize(first); };
+    auto add_entry = [&](std::string_view name, Sexp value) {
+        entries.push_back(make_list_v(env, Sexp(env.sym_pool.intern_borrowed(name)), value));
+    };
+    auto add_count = [&](std::string_view name, uint64_t value) {
+        add_entry(name, make_integer(static_cast<int64_t>(value), env));
+    };
 
-        default:
-            throw EvalException("(define) expected symbol or func-declaration as 1st element"s);
+    add_count("allocations", stats.allocations);
+    add_count("allocated-bytes", stats.allocated_bytes);
+    add_count("peak-heap-bytes", stats.peak_heap_bytes);
+    add_count("minor-collections", stats.minor_collections);
+    add_count("major-collections", stats.major_collections);
+    add_count("old-segments", snapshot.old_segments);
+    add_count("old-size-class-segments", snapshot.old_size_class_segments);
+    add_count("large-objects", snapshot.large_objects);
+    add_count("large-object-bytes", snapshot.large_object_bytes);
+    add_count("committed-bytes", snapshot.committed_bytes);
+    add_count("max-bytes", snapshot.max_bytes);
+    add_count("nursery-segments", snapshot.nursery_segments);
+    add_count("old-object-bytes", snapshot.old_object_bytes);
+    add_count("old-free-bytes", snapshot.old_free_bytes);
+    add_count("old-unused-bytes", snapshot.old_unused_bytes);
+    add_count("nursery-object-bytes", snapshot.nursery_object_bytes);
+    add_count("live-bytes-at-last-gc", snapshot.live_bytes_at_last_gc);
+    add_entry("fragmentation", Sexp(snapshot.fragmentation()));
+
+    size_t types_first = entries.size();
+    for (size_t i = 0; i < OBJECT_TYPE_COUNT; ++i) {
+        auto& count = snapshot.types[i];
+        entries.push_back(make_list_v(env,
+                                      Sexp(env.sym_pool.intern_borrowed(object_type_name(static_cast<ObjectType>(i)))),
+                                      make_integer(static_cast<int64_t>(count.objects), env),
+                                      make_integer(static_cast<int64_t>(count.bytes), env),
+                                      make_integer(static_cast<int64_t>(stats.allocations_by_type[i]), env)));
     }
+    auto types = make_compact_list(std::span(entries).subspan(types_first), env);
+    entries.resize(types_first);
+    entries.push_back(cons(Sexp(env.sym_pool.intern_borrowed("types")), types, env));
 
-    return Sexp();
-}
-
-Sexp builtin_lambda(Sexp params, Environment& env) {
-    Sexp decl_params;
-    Sexp body;
-    list_get_prefix(params, { &decl_params }, &body, env);
-
-    auto p = make_user_proc(decl_params, body, env);
-
-    return Sexp(p);
-}
-
-Sexp builtin_set(Sexp params, Environment& env) {
-    Sexp binding;
-    Sexp value;
-    list_get_prefix(params, { &binding, &value }, nullptr, env);
-
-    if (!binding.is_symbol())
-        throw EvalException("(set!) expected symbol as 1st argument"s);
-
-    env.set_binding(
-        binding.as_symbol(),
-        eval(value, env));
-
-    return Sexp();
+    return make_compact_list(std::span(entries).subspan(first), env);
 }
+} // namespace
 
-// (let ((id val-expr) ...) body ...)
-// (let* ((id val-expr) ...) body ...)
-Sexp do_let_unnamed(Sexp binding_forms, Sexp body, Environment& env, bool prebind_scope) {
-    auto [scope, _] = env.heap.allocate<Scope>();
-    scope->prev = HeapPtr(env.curr_scope);
+Sexp run_bytecode(Bytecode& entry, Environment& env, bool is_proc) {
+    auto& stack = env.vm_stack;
+    auto& frames = env.vm_frames;
 
+    // Procs called from here return into this invocation, until the call stack is back to where it started.
+    // If an exception is thrown halfway, whatever they left behind is dropped.
+    size_t entry_stack_size = stack.size();
+    size_t entry_frame_count = frames.size();
     DEFER_RESTORE_VALUE(env.curr_scope);
-    if (prebind_scope)
-        env.curr_scope = scope;
-
-    // Eval each let-binding-form
-    for (auto& form : iterate(binding_forms, env)) {
-        Sexp id;
-        Sexp val_expr;
-        list_get_prefix(form, { &id, &val_expr }, nullptr, env);
-
-        if (!id.is_symbol())
-            throw EvalException("(let) id must be a symbol");
-        auto& id_sym = id.as_symbol();
-
-        scope->bindings.try_emplace(&id_sym, eval(val_expr, env));
+    DEFER_RESTORE_VALUE(env.stack_scope_count);
+    DEFER {
+        stack.resize(entry_stack_size);
+        frames.resize(entry_frame_count);
+    };
+    // Stack scopes in use when the running proc was entered; it pops the ones above, its own and those of its lets, when it returns
+    size_t stack_scope_base = env.stack_scope_count;
+
+    // Calls are only timed while profiling, at the cost of a well predicted branch otherwise
+    auto profiler = env.profiler.get();
+    size_t entry_profile_depth = profiler ? profiler->depth() : 0;
+    if (profiler) {
+        if (is_proc)
+            profiler->enter(entry, env.heap);
+        else
+            profiler->enter_toplevel(env.heap);
     }
+    DEFER {
+        if (profiler)
+            profiler->leave_to(entry_profile_depth, env.heap);
+    };
 
-    if (!prebind_scope)
-        env.curr_scope = scope;
-
-    return eval_many(body.as_ptr<ConsCell>().get(), env);
-}
+    // NOTE: any allocation may move young objects, updating the references in `stack` and env.curr_scope.
+    //       Don't keep a proc or scope in a local across an allocation, read it again from there instead.
+    //       Bytecode is allocated in the old generation, so `code` stays put.
+    Bytecode* code = &entry;
+    const uint8_t* pc = code->ops.data();
+
+    auto read_u16 = [&]() {
+        uint16_t v;
+        std::memcpy(&v, pc, sizeof(v));
+        pc += sizeof(v);
+        return v;
+    };
+    auto pop = [&]() {
+        auto v = stack.back();
+        stack.pop_back();
+        return v;
+    };
+    // Replaces the `n` values on the top of the stack with the result of calling `fn` on them
+    auto apply_builtin = [&](BuiltinProc::FnPtr fn, size_t n) {
+        auto result = fn(std::span(stack).last(n), env);
+        stack.resize(stack.size() - n);
+        stack.push_back(result);
+    };
 
-// (let proc-id ((id val-expr) ...) body ...)
-Sexp do_let_named(const Symbol& proc_name, Sexp binding_forms, Sexp body, Environment& env) {
-    auto [scope, _] = env.heap.allocate<Scope>();
-    scope->prev = HeapPtr(env.curr_scope);
+    // Fast path of the arithmetic and comparison instructions, for the common case of 2 fixnum operands:
+    // replaces them with the result of `op` and returns true, unless that doesn't fit in a fixnum, which is left to the builtin.
+    // The product of two int32_t always fits in an int64_t, so `op` itself can't overflow.
+    auto fixnum_op = [&](size_t n, auto op) {
+        if (n != 2)
+            return false;
+        auto a = stack.end()[-2];
+        auto b = stack.end()[-1];
+        if (!a.is_int() || !b.is_int())
+            return false;
+
+        auto res = op(static_cast<int64_t>(a.as_int()), static_cast<int64_t>(b.as_int()));
+        Sexp result;
+        if constexpr (std::is_same_v<decltype(res), bool>) {
+            result = Sexp(res);
+        } else {
+            if (res < std::numeric_limits<int32_t>::min() || res > std::numeric_limits<int32_t>::max())
+                return false;
+            result = Sexp(static_cast<int32_t>(res));
+        }
+        stack.pop_back();
+        stack.back() = result;
+        return true;
+    };
 
-    DEFER_RESTORE_VALUE(env.curr_scope);
-    env.curr_scope = scope;
+    // Calls the proc on the top of the stack with the `n_args` values below it, replacing all of them with its result.
+    // A user proc only starts running here, and returns false; once it returns, the VM resumes after the call, or if `is_tail`,
+    // goes straight back to our own caller: the current frame is reused, so that loops written as tail calls run in constant space.
+    // Builtins run to completion right away, and return true.
+    auto call_proc = [&](size_t n_args, bool is_tail) {
+        auto callee = stack.back();
+
+        if (callee.is_ptr<UserProc>()) {
+            auto& callee_code = *callee.as_ptr<UserProc>()->code;
+            size_t n_params = callee_code.n_params;
+            if (n_args < n_params)
+                throw EvalException(std::format("too few arguments provided to proc, expected {} but found {}", n_params, n_args));
+
+            if (is_tail) {
+                // The caller is done with its stack scopes, its arguments to the callee are on the VM stack
+                env.stack_scope_count = stack_scope_base;
+            } else {
+                frames.push_back(VmFrame{ .code = code, .pc = pc, .scope = env.curr_scope, .stack_scope_base = stack_scope_base });
+                stack_scope_base = env.stack_scope_count;
+            }
 
-    // Extract parameter ids, and bind val-exprs after evaluating them
-    std::vector<const Symbol*> proc_args;
-    for (auto& form : iterate(binding_forms, env)) {
-        Sexp id;
-        Sexp val_expr;
-        list_get_prefix(form, { &id, &val_expr }, nullptr, env);
+            auto s = callee_code.captures_scope ? env.heap.allocate<Scope>().first : env.push_stack_scope();
+            s->prev = stack.back().as_ptr<UserProc>()->closure_frame;
+            // Parameters take the first slots, in order, extra arguments are ignored
+            auto args = stack.end() - 1 - n_args;
+            s->slots.assign(args, args + n_params);
+            stack.resize(stack.size() - 1 - n_args);
+
+            if (profiler) {
+                // A tail call replaces its caller, except for the top-level form, which is left when we return from here
+                if (is_tail && profiler->depth() > entry_profile_depth + 1)
+                    profiler->leave(env.heap);
+                profiler->enter(callee_code, env.heap);
+            }
+            env.curr_scope = s;
+            code = &callee_code;
+            pc = code->ops.data();
+            return false;
+        }
 
-        if (!id.is_symbol())
-            throw EvalException("(let) id must be a symbol"s);
-        auto& id_sym = id.as_symbol();
+        if (callee.is_ptr<BuiltinProc>()) {
+            auto& bp = *callee.as_ptr<BuiltinProc>();
+            if (bp.fn == nullptr)
+                throw EvalException(std::format("'{}' is a special form, it can't be called as a proc", std::string_view(*bp.name)));
+
+            stack.pop_back();
+            if (profiler) {
+                profiler->enter(bp, env.heap);
+                apply_builtin(bp.fn, n_args);
+                profiler->leave(env.heap);
+            } else {
+                apply_builtin(bp.fn, n_args);
+            }
+            return true;
+        }
 
-        proc_args.push_back(&id_sym);
-        scope->bindings.try_emplace(&id_sym, eval(val_expr, env));
-    }
+        throw EvalException(std::format("{} is not a proc", dump_sexp(callee, env)));
+    };
 
-    auto [proc, DISCARD] = env.heap.allocate_only<UserProc>();
-    new (proc) UserProc{
-        .closure_frame = HeapPtr(env.curr_scope),
-        .arguments = std::move(proc_args),
-        .body = body.as_ptr<ConsCell>(),
+    // CALL_BUILTIN and the primitive instructions are bound to the builtin constants[k] when compiled. If its global has been redefined since,
+    // this calls whatever the global holds now with the `n_args` values on the top of the stack instead, and returns true.
+    auto call_if_rebound = [&](Sexp builtin, size_t n_args) {
+        auto& global = builtin.as_ptr<BuiltinProc>()->name->global_value;
+        if (global._value == builtin._value) [[likely]]
+            return false;
+        stack.push_back(global);
+        call_proc(n_args, false);
+        return true;
     };
-    scope->bindings.try_emplace(&proc_name, Sexp(HeapPtr<void>(proc)));
 
-    return eval_many(body.as_ptr<ConsCell>().get(), env);
-}
+#if TOYSCHEME_THREADED_DISPATCH
+#    define X(name) &&op_##name,
+    static constexpr void* dispatch_table[] = { TOYSCHEME_OPCODES(X) };
+#    undef X
+#    define VM_CASE(name) op_##name:
+#    define VM_NEXT() goto* dispatch_table[*pc++]
+#    define VM_FALLTHROUGH
+    VM_NEXT();
+#else
+#    define VM_CASE(name) case Opcode::name:
+#    define VM_NEXT() goto dispatch
+#    define VM_FALLTHROUGH [[fallthrough]]
+dispatch:
+    switch (static_cast<Opcode>(*pc++)) {
+#endif
+
+    VM_CASE(CONST) {
+        stack.push_back(code->constants[read_u16()]);
+        VM_NEXT();
+    }
 
-Sexp do_let(Sexp params, Environment& env, bool prebind_scope) {
-    Sexp arg_1st;
-    Sexp arg_rest;
-    list_get_prefix(params, { &arg_1st }, &arg_rest, env);
+    VM_CASE(NIL) {
+        stack.push_back(Sexp());
+        VM_NEXT();
+    }
 
-    auto [scope, _] = env.heap.allocate<Scope>();
-    scope->prev = HeapPtr(env.curr_scope);
+    VM_CASE(LOCAL) {
+        auto depth = read_u16();
+        auto slot = read_u16();
+        stack.push_back(env.lookup_local({ .depth = depth, .slot = slot }));
+        VM_NEXT();
+    }
 
-    if (arg_1st.is_symbol()) {
-        Sexp binding_forms;
-        Sexp body;
-        list_get_prefix(arg_rest, { &binding_forms }, &body, env);
+    VM_CASE(LOCAL_0) {
+        auto slot = read_u16();
+        if (env.curr_scope == nullptr) [[unlikely]]
+            throw EvalException("local variable outside of any scope"s);
+        auto& slots = env.curr_scope->slots;
+        // Slots of internal defines that have not run yet are unbound, as in Environment::lookup_local()
+        stack.push_back(slot < slots.size() ? slots[slot] : Sexp());
+        VM_NEXT();
+    }
 
-        return do_let_named(arg_1st.as_symbol(), binding_forms, body, env);
-    } else {
-        Sexp binding_forms = arg_1st;
-        Sexp body = arg_rest;
-        return do_let_unnamed(binding_forms, body, env, prebind_scope);
+    VM_CASE(SET_LOCAL) {
+        auto depth = read_u16();
+        auto slot = read_u16();
+        env.set_local({ .depth = depth, .slot = slot }, pop());
+        VM_NEXT();
     }
-}
 
-Sexp builtin_let_basic(Sexp params, Environment& env) {
-    return do_let(params, env, false);
-}
-Sexp builtin_let_star(Sexp params, Environment& env) {
-    return do_let(params, env, true);
-}
+    VM_CASE(GLOBAL) {
+        auto& name = code->constants[read_u16()].as_symbol();
+        // Non-existent binding evaluates to nil, which is what the value cell of a symbol never defined holds
+        stack.push_back(name.global_value);
+        VM_NEXT();
+    }
 
-Sexp builtin_progn(Sexp params, Environment& env) {
-    return eval_many(params.as_ptr<ConsCell>().get(), env);
-}
-} // namespace
+    VM_CASE(SET_GLOBAL) {
+        auto& name = code->constants[read_u16()].as_symbol();
+        env.set_binding(name, pop());
+        VM_NEXT();
+    }
 
-Sexp call_user_proc(const UserProc& proc, Sexp params, Environment& env) {
-    auto [s, _] = env.heap.allocate<Scope>();
-    s->prev = proc.closure_frame;
+    VM_CASE(DEFINE_GLOBAL) {
+        auto& name = code->constants[read_u16()].as_symbol();
+        env.define_global(name, pop());
+        VM_NEXT();
+    }
 
-    auto it_decl = proc.arguments.begin();
-    auto it_value = SexpListIterator(params, env);
-    int n_args = 0;
-    while (it_decl != proc.arguments.end() && !it_value.is_end()) {
-        auto& arg_name = *it_decl;
-        // NOTE: we are still evaluating in the parent CallFrame, but merely storing the result in the current CallFrame
-        auto arg_value = eval(*it_value, env);
-        s->bindings.try_emplace(arg_name, std::move(arg_value));
+    VM_CASE(POP) {
+        stack.pop_back();
+        VM_NEXT();
+    }
 
-        ++it_decl;
-        ++it_value;
-        n_args += 1;
+    VM_CASE(JUMP) {
+        auto target = read_u16();
+        pc = code->ops.data() + target;
+        VM_NEXT();
     }
 
-    if (it_decl != proc.arguments.end())
-        throw EvalException(std::format("too few arguments provided to proc, expected {} but found {}", proc.arguments.size(), n_args));
+    VM_CASE(JUMP_IF_FALSE) {
+        auto target = read_u16();
+        if (!pop().evalute_bool())
+            pc = code->ops.data() + target;
+        VM_NEXT();
+    }
 
-    DEFER_RESTORE_VALUE(env.curr_scope);
-    env.curr_scope = s;
+    VM_CASE(CLOSURE) {
+        auto proc_code = code->constants[read_u16()].as_ptr<Bytecode>();
+        auto [proc, _] = env.heap.allocate_only<UserProc>();
+        new (proc) UserProc{
+            .closure_frame = HeapPtr(env.curr_scope),
+            .code = proc_code,
+        };
+        stack.push_back(Sexp(proc));
+        VM_NEXT();
+    }
 
-    return eval_many(proc.body.get(), env);
-}
+    VM_CASE(CALL) {
+        size_t n_args = read_u16();
+        call_proc(n_args, false);
+        VM_NEXT();
+    }
 
-Sexp eval(Sexp sexp, Environment& env) {
-    switch (sexp.get_flags()) {
-        case SCVAL_FLAG_PTR: {
-            auto& cons_cell = *sexp.as_ptr<ConsCell>();
-            auto& func = cons_cell.car;
-            auto& params = cons_cell.cdr;
+    VM_CASE(TAIL_CALL) {
+        size_t n_args = read_u16();
+        if (!call_proc(n_args, true))
+            VM_NEXT();
+        // A builtin has returned already, so return its result to our caller, right below
+        VM_FALLTHROUGH;
+    }
 
-            if (func.is_symbol()) {
-                auto& proc_name = func.as_symbol();
-                auto proc = env.lookup_binding(proc_name);
+    VM_CASE(RETURN) {
+        auto result = stack.back();
+        if (frames.size() == entry_frame_count)
+            return result;
+
+        auto& frame = frames.back();
+        code = frame.code;
+        pc = frame.pc;
+        env.curr_scope = frame.scope;
+        env.stack_scope_count = stack_scope_base;
+        stack_scope_base = frame.stack_scope_base;
+        frames.pop_back();
+        if (profiler)
+            profiler->leave(env.heap);
+        VM_NEXT();
+    }
 
-                if (proc == nullptr)
-                    return Sexp();
+    VM_CASE(CALL_BUILTIN) {
+        auto builtin = code->constants[read_u16()];
+        size_t n_args = read_u16();
+        if (call_if_rebound(builtin, n_args))
+            VM_NEXT();
+        auto& bp = *builtin.as_ptr<BuiltinProc>();
+        if (profiler) {
+            profiler->enter(bp, env.heap);
+            apply_builtin(bp.fn, n_args);
+            profiler->leave(env.heap);
+        } else {
+            apply_builtin(bp.fn, n_args);
+        }
+        VM_NEXT();
+    }
 
-                if (auto up = proc->as_ptr<UserProc>())
-                    return call_user_proc(*up, params, env);
-                if (auto bp = proc->as_ptr<BuiltinProc>())
-                    return bp->fn(params, env);
+    VM_CASE(ENTER_SCOPE) {
+        size_t n = read_u16();
+        auto [s, _] = env.heap.allocate<Scope>();
+        s->prev = HeapPtr(env.curr_scope);
+        s->slots.assign(stack.end() - n, stack.end());
+        stack.resize(stack.size() - n);
+        env.curr_scope = s;
+        VM_NEXT();
+    }
 
-                throw EvalException(std::format("proc '{}' not found", std::string_view(proc_name)));
-            }
+    VM_CASE(LEAVE_SCOPE) {
+        env.curr_scope = env.curr_scope->prev.get();
+        VM_NEXT();
+    }
 
-            throw EvalException("(proc-call ...) form must begin with a symbol"s);
-        } break;
+    VM_CASE(ENTER_STACK_SCOPE) {
+        size_t n = read_u16();
+        auto s = env.push_stack_scope();
+        s->prev = HeapPtr(env.curr_scope);
+        s->slots.assign(stack.end() - n, stack.end());
+        stack.resize(stack.size() - n);
+        env.curr_scope = s;
+        VM_NEXT();
+    }
 
-        case SCVAL_FLAG_SYMBOL: {
-            const auto& name = sexp.as_symbol();
+    VM_CASE(LEAVE_STACK_SCOPE) {
+        env.curr_scope = env.curr_scope->prev.get();
+        env.stack_scope_count -= 1;
+        VM_NEXT();
+    }
 
-            if (auto binding = env.lookup_binding(name))
-                return *binding;
+    VM_CASE(ADD) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n) && !fixnum_op(n, std::plus<>{}))
+            apply_builtin(builtin_add, n);
+        VM_NEXT();
+    }
+    VM_CASE(SUB) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n) && !fixnum_op(n, std::minus<>{}))
+            apply_builtin(builtin_sub, n);
+        VM_NEXT();
+    }
+    VM_CASE(MUL) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n) && !fixnum_op(n, std::multiplies<>{}))
+            apply_builtin(builtin_mul, n);
+        VM_NEXT();
+    }
+    VM_CASE(DIV) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n))
+            apply_builtin(builtin_div, n);
+        VM_NEXT();
+    }
+    VM_CASE(NUM_EQ) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n) && !fixnum_op(n, std::equal_to<>{}))
+            apply_builtin(builtin_binary_op<std::equal_to<>>, n);
+        VM_NEXT();
+    }
+    VM_CASE(LT) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n) && !fixnum_op(n, std::less<>{}))
+            apply_builtin(builtin_binary_op<std::less<>>, n);
+        VM_NEXT();
+    }
+    VM_CASE(LE) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n) && !fixnum_op(n, std::less_equal<>{}))
+            apply_builtin(builtin_binary_op<std::less_equal<>>, n);
+        VM_NEXT();
+    }
+    VM_CASE(GT) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n) && !fixnum_op(n, std::greater<>{}))
+            apply_builtin(builtin_binary_op<std::greater<>>, n);
+        VM_NEXT();
+    }
+    VM_CASE(GE) {
+        auto builtin = code->constants[read_u16()];
+        size_t n = read_u16();
+        if (!call_if_rebound(builtin, n) && !fixnum_op(n, std::greater_equal<>{}))
+            apply_builtin(builtin_binary_op<std::greater_equal<>>, n);
+        VM_NEXT();
+    }
 
-            // Non-existent binding evaluates to nil
-            return Sexp();
-        } break;
+    VM_CASE(CAR) {
+        if (!call_if_rebound(code->constants[read_u16()], 1))
+            stack.back() = car(stack.back());
+        VM_NEXT();
+    }
+    VM_CASE(CDR) {
+        if (!call_if_rebound(code->constants[read_u16()], 1))
+            stack.back() = cdr(stack.back());
+        VM_NEXT();
+    }
+    VM_CASE(CONS) {
+        if (!call_if_rebound(code->constants[read_u16()], 2))
+            apply_builtin(builtin_cons, 2);
+        VM_NEXT();
+    }
+    VM_CASE(IS_NULL) {
+        if (!call_if_rebound(code->constants[read_u16()], 1))
+            stack.back() = Sexp(stack.back().is_nil());
+        VM_NEXT();
+    }
 
-        // For every other sexp x, (eval x) => x
-        default: return sexp;
+#if !TOYSCHEME_THREADED_DISPATCH
     }
+    std::unreachable();
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_FALLTHROUGH
 }
 
-Sexp eval_maybe_many(Sexp forms, Environment& env) {
-    if (!forms.is_ptr<ConsCell>())
-        return eval(forms, env);
-    else
-        return eval_many(forms.as_ptr<ConsCell>().get(), env);
+Sexp eval(Sexp sexp, Environment& env) {
+    auto code = compile_toplevel(sexp, env);
+    return run_bytecode(*code, env);
 }
 
-Sexp eval_many(ConsCell* forms, Environment& env) {
-    const ConsCell* curr = forms;
-    while (true) {
-        bool has_next = !curr->cdr.is_nil();
-        if (!has_next) {
-            // Last form in proc body is returned
-            return eval(curr->car, env);
-        } else {
-            eval(curr->car, env);
-            curr = curr->cdr.as_ptr<ConsCell>().get();
-        }
+Sexp apply_proc(Sexp proc, std::span<const Sexp> args, Environment& env) {
+    if (proc.is_ptr<BuiltinProc>()) {
+        auto& bp = *proc.as_ptr<BuiltinProc>();
+        if (bp.fn == nullptr)
+            throw EvalException(std::format("'{}' is a special form, it can't be called as a proc", std::string_view(*bp.name)));
+        return bp.fn(args, env);
     }
+    if (!proc.is_ptr<UserProc>())
+        throw EvalException(std::format("{} is not a proc", dump_sexp(proc, env)));
 
-    std::unreachable();
+    auto& code = *proc.as_ptr<UserProc>()->code;
+    size_t n_params = code.n_params;
+    if (args.size() < n_params)
+        throw EvalException(std::format("too few arguments provided to proc, expected {} but found {}", n_params, args.size()));
+
+    // The proc runs like a top-level form, in a scope holding its parameters. That scope is always on the heap, as stack scopes are only
+    // popped by the VM when it returns from a call.
+    auto [s, _] = env.heap.allocate<Scope>();
+    s->prev = proc.as_ptr<UserProc>()->closure_frame;
+    s->slots.assign(args.begin(), args.begin() + n_params);
+    DEFER_RESTORE_VALUE(env.curr_scope);
+    env.curr_scope = s;
+    return run_bytecode(code, env, true);
 }
 
 void setup_scope_for_builtins(Environment& env) {
-    auto& s = env.global_scope->bindings;
-    auto& h = env.heap;
-    auto& p = env.sym_pool;
-#define PROC(name, func)                                      \
-    do {                                                      \
-        auto& sym = p.intern(name);                           \
-        auto [proc, _] = h.allocate<BuiltinProc>(&sym, func); \
-        s.emplace(&sym, Sexp(proc));                          \
-    } while (false)
+#define PROC(name, func) define_builtin(env, name, func)
+// Special forms are compiled by BytecodeCompiler, they are bound to a builtin only so that they can be shadowed and redefined like the procs
+#define SYNTAX(name) define_builtin(env, name, nullptr)
     PROC("+", builtin_add);
     PROC("-", builtin_sub);
     PROC("*", builtin_mul);
     PROC("/", builtin_div);
     PROC("sqrt", builtin_sqrt);
-    PROC("if", builtin_if);
     PROC("=", builtin_binary_op<std::equal_to<>>);
     PROC("<", builtin_binary_op<std::less<>>);
     PROC("<=", builtin_binary_op<std::less_equal<>>);
@@ -476,13 +712,19 @@ void setup_scope_for_builtins(Environment& env) {
     PROC("cdr", builtin_cdr);
     PROC("cons", builtin_cons);
     PROC("null?", builtin_is_null);
-    PROC("quote", builtin_quote);
-    PROC("define", builtin_define);
-    PROC("lambda", builtin_lambda);
-    PROC("set!", builtin_set);
-    PROC("let", builtin_let_basic);
-    PROC("let*", builtin_let_star);
+    PROC("heap-stats", builtin_heap_stats);
+    SYNTAX("if");
+    SYNTAX("quote");
+    SYNTAX("define");
+    SYNTAX("lambda");
+    SYNTAX("set!");
+    SYNTAX("let");
+    SYNTAX("let*");
+    SYNTAX("progn");
+#undef SYNTAX
 #undef PROC
+
+    setup_vector_builtins(env);
 }
 
 } // namespace toyscheme
@@ -1,4 +1,5 @@
 module;
+#include "util.hpp"
 #include <cassert>
 
 module toyscheme;
@@ -8,38 +9,154 @@ using namespace std::literals;
 
 namespace toyscheme {
 
-Environment::Environment() {
-    auto [s, _] = heap.allocate<Scope>();
-    curr_scope = s;
-    global_scope = s;
+namespace {
+constexpr size_t SYMBOL_TABLE_INITIAL_SIZE = 256;
+constexpr size_t SYMBOL_NAME_CHUNK_SIZE = 16 * 1024;
+} // namespace
 
-    setup_scope_for_builtins(*this);
+SymbolPool::SymbolPool()
+    : _table(SYMBOL_TABLE_INITIAL_SIZE, Entry{ .hash = 0, .sym = nullptr }) {}
+
+const Symbol& SymbolPool::intern_impl(std::string_view name, bool is_literal) {
+    size_t hash = std::hash<std::string_view>{}(name);
+
+    size_t mask = _table.size() - 1;
+    size_t i = hash & mask;
+    for (; _table[i].sym != nullptr; i = (i + 1) & mask) {
+        auto& entry = _table[i];
+        if (entry.hash == hash && std::string_view(*entry.sym) == name)
+            return *entry.sym;
+    }
+
+    // Keep the load factor under 3/4, so that probe sequences stay short
+    if ((_count + 1) * 4 > _table.size() * 3) {
+        grow_table();
+        mask = _table.size() - 1;
+        for (i = hash & mask; _table[i].sym != nullptr; i = (i + 1) & mask) {}
+    }
+
+    auto& sym = _symbols.emplace_back();
+    sym._data = is_literal ? name.data() : store_name(name);
+    sym._size = name.size();
+
+    _table[i] = Entry{ .hash = hash, .sym = &sym };
+    _count += 1;
+    return sym;
 }
 
-const Sexp* Environment::lookup_binding(const Symbol& name) const {
-    Scope* curr = curr_scope;
-    while (curr) {
-        auto iter = curr->bindings.find(&name);
-        if (iter != curr->bindings.end()) {
-            return &iter->second;
-        }
+const char* SymbolPool::store_name(std::string_view name) {
+    size_t size = name.size() + 1;
+    if (size > _name_space_left) {
+        // Names too long to share a chunk get one of their own
+        size_t chunk_size = std::max(size, SYMBOL_NAME_CHUNK_SIZE);
+        _name_chunks.push_back(std::make_unique_for_overwrite<char[]>(chunk_size));
+        _name_cursor = _name_chunks.back().get();
+        _name_space_left = chunk_size;
+    }
 
-        curr = curr->prev.get();
+    auto data = _name_cursor;
+    std::memcpy(data, name.data(), name.size());
+    data[name.size()] = 0;
+    _name_cursor += size;
+    _name_space_left -= size;
+    return data;
+}
+
+void SymbolPool::grow_table() {
+    std::vector<Entry> old_table(_table.size() * 2, Entry{ .hash = 0, .sym = nullptr });
+    std::swap(_table, old_table);
+
+    size_t mask = _table.size() - 1;
+    for (auto& entry : old_table) {
+        if (entry.sym == nullptr)
+            continue;
+        size_t i = entry.hash & mask;
+        while (_table[i].sym != nullptr)
+            i = (i + 1) & mask;
+        _table[i] = entry;
     }
+}
+
+Environment::Environment(const HeapConfig& heap_config)
+    : heap(*this, heap_config) //
+{
+    setup_scope_for_builtins(*this);
+}
+
+const SourceFile* Environment::load_source(const std::filesystem::path& path) {
+    auto file = SourceFile::open(path);
+    if (!file)
+        return nullptr;
+    return sources.emplace_back(std::move(file)).get();
+}
+
+const Sexp* Environment::lookup_binding(const Symbol& name) const {
+    if (name.is_global)
+        return &name.global_value;
     return nullptr;
 }
 
 void Environment::set_binding(const Symbol& name, Sexp value) {
-    Scope* curr = curr_scope;
-    while (curr) {
-        auto iter = curr->bindings.find(&name);
-        if (iter != curr->bindings.end()) {
-            iter->second = value;
-            return;
-        }
+    if (name.is_global)
+        name.global_value = value;
+}
 
-        curr = curr->prev.get();
+void Environment::define_global(const Symbol& name, Sexp value) {
+    if (!name.is_global) {
+        name.is_global = true;
+        globals.push_back(&name);
     }
+    name.global_value = value;
+}
+
+void Environment::grow_stack_scopes() {
+    auto [s, _] = heap.allocate_old<Scope>();
+    stack_scopes.push_back(s);
+}
+
+void define_builtin(Environment& env, std::string_view name, BuiltinProc::FnPtr fn) {
+    auto& sym = env.sym_pool.intern(name);
+    auto [proc, _] = env.heap.allocate<BuiltinProc>(&sym, fn);
+    env.define_global(sym, Sexp(proc));
+}
+
+const BuiltinProc* find_builtin(Sexp name, const Environment& env) {
+    if (!name.is_symbol())
+        return nullptr;
+    auto binding = env.lookup_binding(name.as_symbol());
+    if (binding == nullptr || !binding->is_ptr())
+        return nullptr;
+    auto proc = binding->as_ptr().get_as<BuiltinProc>();
+    if (proc == nullptr || proc->name != &name.as_symbol())
+        return nullptr;
+    return proc;
+}
+
+namespace {
+Scope* find_scope(Scope* curr, LocalRef ref) {
+    for (int i = 0; i < ref.depth && curr != nullptr; ++i)
+        curr = curr->prev.get();
+    // Only bytecode loaded from an image can refer past the outermost scope, compiled code never does
+    if (curr == nullptr)
+        throw EvalException("local variable outside of any scope"s);
+    return curr;
+}
+} // namespace
+
+Sexp Environment::lookup_local(LocalRef ref) const {
+    auto& slots = find_scope(curr_scope, ref)->slots;
+    // Slots of internal defines that have not run yet are unbound, which evaluates to nil like any non-existent binding
+    if (ref.slot < slots.size())
+        return slots[ref.slot];
+    return Sexp();
+}
+
+void Environment::set_local(LocalRef ref, Sexp value) {
+    auto scope = find_scope(curr_scope, ref);
+    if (ref.slot >= scope->slots.size())
+        scope->slots.resize(ref.slot + 1);
+    scope->slots[ref.slot] = value;
+    write_barrier(heap, scope, value);
 }
 
 Sexp cons(Sexp a, Sexp b, Environment& env) {
@@ -52,51 +169,76 @@ void cons_inplace(Sexp a, Sexp& list, Environment& env) {
     list = Sexp(addr);
 }
 
+Sexp make_compact_list(std::span<const Sexp> items, Environment& env, bool pretenure) {
+    // Build the chunks from the last one, so that each can point to the next
+    Sexp list;
+    size_t end = items.size();
+    while (end > 0) {
+        size_t begin = end > CompactList::MAX_SIZE ? end - CompactList::MAX_SIZE : 0;
+        size_t n = end - begin;
+
+        size_t size = sizeof(CompactList) + n * sizeof(Sexp);
+        auto [obj, _] = pretenure
+            ? env.heap.allocate_old(size, alignof(CompactList), ObjectType::TYPE_COMPACT_LIST)
+            : env.heap.allocate(size, alignof(CompactList), ObjectType::TYPE_COMPACT_LIST);
+        auto chunk = new (obj) CompactList{ .size = n, .tail = list };
+        std::ranges::copy(items.subspan(begin, n), chunk->items());
+        if (pretenure) {
+            write_barrier(env.heap, chunk, chunk->tail);
+            for (size_t i = 0; i < n; ++i)
+                write_barrier(env.heap, chunk, chunk->items()[i]);
+        }
+
+        list = Sexp(HeapPtr<void>(chunk));
+        end = begin;
+    }
+    return list;
+}
+
+Sexp make_integer(int64_t v, Environment& env) {
+    if (v >= std::numeric_limits<int32_t>::min() && v <= std::numeric_limits<int32_t>::max())
+        return Sexp(static_cast<int32_t>(v));
+
+    auto [boxed, _] = env.heap.allocate<BoxedInt>(v);
+    return Sexp(boxed);
+}
+
 Sexp car(Sexp s) {
-    auto cons_cell = s.as_ptr<ConsCell>();
-    if (cons_cell == nullptr)
+    auto pair = as_pair(s);
+    if (!pair)
         throw EvalException("car(): argument is not not a cons");
-    return cons_cell->car;
+    return *pair.car;
 }
 
 Sexp cdr(Sexp s) {
-    auto cons_cell = s.as_ptr<ConsCell>();
-    if (cons_cell == nullptr)
+    auto pair = as_pair(s);
+    if (!pair)
         throw EvalException("cdr(): argument is not not a cons");
-    return cons_cell->cdr;
+    return pair.cdr;
 }
 
 Sexp list_nth_elm(Sexp list, int idx, Environment& env) {
-    Sexp* curr = &list;
-    int n_to_go = idx + 1;
-    while (curr->is_ptr()) {
-        auto& cons_cell = *curr->as_ptr<ConsCell>();
-        n_to_go -= 1;
-        if (n_to_go == 0)
-            break;
-        curr = &cons_cell.cdr;
-    }
+    auto it = SexpListIterator(list, env);
+    for (int i = 0; i < idx && !it.is_end(); ++i)
+        ++it;
 
-    if (n_to_go != 0) {
+    if (it.is_end()) {
         throw EvalException("list_nth_elm(): index out of bounds"s);
     }
-    return car(*curr);
+    return *it;
 }
 
 void list_get_prefix(Sexp list, std::initializer_list<Sexp*> out_prefix, Sexp* out_rest, Environment& env) {
-    Sexp* curr = &list;
-    auto it = out_prefix.begin();
-    while (curr->is_ptr()) {
-        auto& cons_cell = *curr->as_ptr<ConsCell>();
-        **it = cons_cell.car;
-        curr = &cons_cell.cdr;
-        if (++it == out_prefix.end())
-            break;
+    Sexp curr = list;
+    for (auto out : out_prefix) {
+        auto pair = as_pair(curr);
+        if (!pair)
+            throw EvalException("list_get_prefix(): too few elements in list"s);
+        *out = *pair.car;
+        curr = pair.cdr;
     }
-    if (it != out_prefix.end())
-        throw EvalException("list_get_prefix(): too few elements in list"s);
     if (out_rest)
-        *out_rest = *curr;
+        *out_rest = curr;
 }
 
 void list_get_everything(Sexp list, std::initializer_list<Sexp*> out, Environment& env) {
@@ -107,279 +249,6 @@ void list_get_everything(Sexp list, std::initializer_list<Sexp*> out, Environmen
         throw EvalException("list_get_everything(): too many elements in list"s);
 }
 
-UserProc* make_user_proc(Sexp param_decl, Sexp body_decl, Environment& env) {
-    std::vector<const Symbol*> proc_args;
-    for (Sexp param : iterate(param_decl, env)) {
-        if (!param.is_symbol())
-            throw EvalException("proc parameter must be a symbol"s);
-        proc_args.push_back(&param.as_symbol());
-    }
-
-    if (!is_list(body_decl))
-        throw EvalException("proc body must have 1 or more forms"s);
-
-    auto [proc, _] = env.heap.allocate_only<UserProc>();
-    new (proc) UserProc{
-        .closure_frame = HeapPtr(env.curr_scope),
-        .arguments = std::move(proc_args),
-        .body = body_decl.as_ptr<ConsCell>(),
-    };
-
-    return proc;
-}
-
-class SexpParser {
-public:
-    /* ---- Inputs ---- */
-    /* Initalize them with aggregate initilization, and then call parse() */
-    Environment* env;
-    std::string_view src;
-
-private:
-    /* ---- State Variables ---- */
-    /// A path of every list we have to visit to get to `curr`
-    /// For example, suppose we are parsing the following source, and the cursor is denoted by '|':
-    ///     (define (a b)
-    ///       (my-func a |b))
-    /// `curr` points to the the cdr of th e ConsCell `(a . '())`.
-    /// To push some `Sexp s` into the current list, just set curr to a new ConsCell `(s . '())`, and then set `curr` to its cdr (same logic as `toyscheme::cons_inplace()`).
-    std::vector<Sexp*> path;
-    Sexp* curr;
-    /// If not null, the next sexp `x` produced by the parser loop shall be rewritten as `(wrapper x)`
-    const Symbol* next_sexp_wrapper = nullptr;
-    size_t cursor;
-
-public:
-    // Defined out of line to reduce indentation
-    Sexp parse();
-
-private:
-    Sexp* push_sexp(Sexp val) {
-        // Pointer to the `val` moved to the heap
-        Sexp* p_val = nullptr;
-
-        if (next_sexp_wrapper != nullptr) {
-            // Rolling the logic of make_list_v() manually here to keep a pointer to `val`
-            // i.e. let s = cons1[next_sexp_wrapper cons2[val nil]]
-            auto [cons1, _] = env->heap.allocate<ConsCell>();
-            // WORKAROUND(msvc): no support for P2169 "Placeholder variables with no name" yet
-            auto [cons2, __] = env->heap.allocate<ConsCell>();
-            cons1->car = Sexp(*next_sexp_wrapper);
-            cons1->cdr = Sexp(cons2);
-            cons2->car = val;
-            cons2->cdr = Sexp();
-
-            p_val = &cons2->car;
-            val = Sexp(cons1);
-        }
-
-        auto [the_cons, _] = env->heap.allocate<ConsCell>();
-        the_cons->car = val;
-        *curr = Sexp(the_cons);
-
-        if (p_val == nullptr)
-            p_val = &the_cons->car;
-        curr = &the_cons->cdr;
-
-        next_sexp_wrapper = nullptr;
-        return p_val;
-    }
-
-    void enter_nesting() {
-        // The nil is our nested list
-        // Sexp wrapping is taken care by push_sexp() automatically
-        Sexp* car = push_sexp(Sexp());
-        Sexp* cdr = curr;
-        path.push_back(cdr);
-        curr = car;
-    }
-
-    bool leave_nesting() {
-        if (path.empty())
-            return false;
-
-        curr = path.back();
-        path.pop_back();
-        return true;
-    }
-
-    static bool is_token_separator(char c) {
-        return std::isspace(c) || c == '(' || c == ')';
-    }
-
-    std::string_view take_token() {
-        size_t begin = cursor;
-        while (cursor < src.length() && !is_token_separator(src[cursor]))
-            cursor += 1;
-        size_t end = cursor;
-
-        const char* d = src.data();
-        return std::string_view(d + begin, d + end);
-    }
-
-    void skip_until(char c) {
-        while (cursor < src.length() && src[cursor] != c)
-            cursor += 1;
-    }
-};
-
-Sexp SexpParser::parse() {
-    this->path = {};
-    this->curr = {};
-    this->cursor = 0;
-    this->next_sexp_wrapper = nullptr;
-
-    // Synthesized a top-level list, so we can pretend that every sexp in the source file is actually inside a giant list enclosing everything
-    Sexp program;
-    curr = &program;
-    // We do not push into path, because it makes no sense to leave the synthesized top-level
-    /*path.push_back(curr);*/
-
-    auto& sym_quote = env->sym_pool.intern("quote");
-    auto& sym_unquote = env->sym_pool.intern("unquote");
-    auto& sym_quasiquote = env->sym_pool.intern("quasiquote");
-
-    while (cursor < src.length()) {
-        // Skip all whitespace
-        // Token splitting is automatically handled by each case (it stops right on a whitespace character)
-        if (std::isspace(src[cursor])) {
-            ++cursor;
-            continue;
-        }
-
-        if (src[cursor] == ';') {
-            skip_until('\n');
-            continue;
-        }
-
-#define CHECK_FOR_WRAP(literal, sym) \
-    if (src[cursor] == literal) {    \
-        next_sexp_wrapper = &(sym);  \
-        cursor++;                    \
-        continue;                    \
-    }
-        CHECK_FOR_WRAP('\'', sym_quote);
-        CHECK_FOR_WRAP(',', sym_unquote);
-        CHECK_FOR_WRAP('`', sym_quasiquote);
-#undef CHECK_FOR_WRAP
-
-        if (src[cursor] == '(') {
-            enter_nesting();
-            cursor += 1;
-            continue;
-        }
-        if (src[cursor] == ')') {
-            leave_nesting();
-            cursor += 1;
-            continue;
-        }
-
-        if (src[cursor] == '"') {
-            cursor += 1;
-
-            size_t str_size = 0;
-            size_t str_begin = cursor;
-            while (true) {
-                // Break conditions
-                if (cursor >= src.length())
-                    throw ParseException("unexpected EOF while parsing string"s);
-                if (src[cursor] == '"')
-                    break;
-
-                if (src[cursor] == '\\') {
-                    str_size += 1;
-                    cursor += 2;
-                    continue;
-                }
-
-                // otherwise...
-                str_size += 1;
-                cursor += 1;
-            }
-            cursor += 1;
-
-            auto [h_str, _] = env->heap.allocate<String>();
-            auto& str = h_str->v;
-            str.reserve(str_size);
-
-            size_t i = str_begin;
-            while (i < str_begin + str_size) {
-                if (src[i] != '\\') {
-                    str.push_back(src[i]);
-                    i += 1;
-                    continue;
-                }
-
-                char esc = src[i + 1];
-                i += 2;
-                switch (esc) {
-                    case 'n': str.push_back('\n'); break;
-                    case '\\': str.push_back('\\'); break;
-                    default: throw ParseException(std::format("invalid escaped char '{}'", esc));
-                }
-            }
-
-            push_sexp(Sexp(h_str));
-
-            continue;
-        }
-
-        if (src[cursor] == '#') {
-            cursor += 1;
-            if (cursor >= src.length()) throw ParseException("unexpected EOF while parsing #-symbols"s);
-
-            char next_c = src[cursor];
-            cursor += 1;
-
-            auto token = take_token();
-            if (token == "t"sv) {
-                push_sexp(Sexp(true));
-                continue;
-            }
-            if (token == "f"sv) {
-                push_sexp(Sexp(false));
-                continue;
-            }
-
-            throw ParseException("invalid #-symbol"s);
-        }
-
-        auto token = take_token();
-
-        // Try parse a number literal
-        float v;
-        auto [rest, ec] = std::from_chars(&src[cursor], src.data() + src.size(), v);
-        if (ec == std::errc()) {
-            // TODO proper Scheme numeric literal parsing
-            if (auto n = static_cast<int32_t>(v); n == v)
-                push_sexp(Sexp(n));
-            else
-                push_sexp(Sexp(v));
-
-            cursor += rest - &src[cursor];
-            continue;
-        } else if (ec == std::errc::result_out_of_range) {
-            throw ParseException("number literal out of range"s);
-        } else if (ec == std::errc::invalid_argument) {
-            // Not a number, continue
-        }
-
-        // Parse a symbol
-        const Symbol& h_sym = env->sym_pool.intern(token);
-        push_sexp(Sexp(h_sym));
-    }
-
-    return program;
-}
-
-Sexp parse_sexp(std::string_view src, Environment& env) {
-    SexpParser parser;
-    parser.env = &env;
-    parser.src = src;
-
-    return parser.parse();
-}
-
 template <typename T>
 void dump_numerical_value(std::string& output, T v) {
     // TODO I have no idea why max_digits10 isn't big enough
@@ -395,6 +264,23 @@ void dump_numerical_value(std::string& output, T v) {
     }
 }
 
+void dump_sexp_impl(std::string& output, Sexp sexp, Environment& env);
+
+template <typename T>
+void dump_vector_items(std::string& output, std::string_view prefix, std::span<const T> items, Environment& env) {
+    output += prefix;
+    for (auto& v : items) {
+        if constexpr (std::is_same_v<T, Sexp>)
+            dump_sexp_impl(output, v, env);
+        else
+            dump_numerical_value(output, v);
+        output += " ";
+    }
+    if (!items.empty())
+        output.pop_back(); // Remove the trailing space
+    output += ")";
+}
+
 void dump_sexp_impl(std::string& output, Sexp sexp, Environment& env) {
     switch (sexp.get_flags()) {
         case SCVAL_FLAG_INT: {
@@ -415,6 +301,11 @@ void dump_sexp_impl(std::string& output, Sexp sexp, Environment& env) {
             output += v;
         } break;
 
+        case SCVAL_FLAG_LOCAL_REF: {
+            auto v = sexp.as_local_ref();
+            output += std::format("#LOCAL:{}:{}", v.depth, v.slot);
+        } break;
+
         case SCVAL_FLAG_PTR: {
             HeapPtr<void> ptr = sexp.as_ptr();
 
@@ -432,9 +323,10 @@ void dump_sexp_impl(std::string& output, Sexp sexp, Environment& env) {
                     output += "#UNKNOWN";
                 } break;
 
-                case TYPE_CONS_CELL: {
+                case TYPE_CONS_CELL:
+                case TYPE_COMPACT_LIST: {
                     output += "(";
-                    for (Sexp elm : iterate(ptr.get_as_unchecked<ConsCell>(), env)) {
+                    for (Sexp elm : iterate(sexp, env)) {
                         dump_sexp_impl(output, elm, env);
                         output += " ";
                     }
@@ -442,23 +334,33 @@ void dump_sexp_impl(std::string& output, Sexp sexp, Environment& env) {
                     output += ")";
                 } break;
 
+                case TYPE_VECTOR: {
+                    dump_vector_items<Vector::Item>(output, "#(", ptr.get_as_unchecked<Vector>()->items(), env);
+                } break;
+
+                case TYPE_INT_VECTOR: {
+                    dump_vector_items<IntVector::Item>(output, "#s64(", ptr.get_as_unchecked<IntVector>()->items(), env);
+                } break;
+
+                case TYPE_FLOAT_VECTOR: {
+                    dump_vector_items<FloatVector::Item>(output, "#f64(", ptr.get_as_unchecked<FloatVector>()->items(), env);
+                } break;
+
+                case TYPE_BOXED_INT: {
+                    dump_numerical_value(output, ptr.get_as_unchecked<BoxedInt>()->v);
+                } break;
+
                 case TYPE_STRING: {
-                    auto& v = ptr.get_as_unchecked<String>()->v;
+                    auto v = ptr.get_as_unchecked<String>()->view();
                     output += '"';
                     output += v;
                     output += '"';
                 } break;
 
                 case TYPE_USER_PROC: {
-                    auto& v = *ptr.get_as_unchecked<UserProc>();
-                    output += "#BUILTIN:";
-                    output += *v.name;
-                } break;
-
-                case TYPE_BUILTIN_PROC: {
-                    auto& v = *ptr.get_as_unchecked<BuiltinProc>();
-                    if (v.name->empty()) {
-                        // Unnamed proc, probably a lambda
+                    auto& v = *ptr.get_as_unchecked<UserProc>()->code;
+                    if (v.name == nullptr || v.name->empty()) {
+                        // Unnamed proc, probably a lambda, or one defined inside another proc whose name has been resolved into a LocalRef
                         output += "#PROC:<unnamed>";
                     } else {
                         output += "#PROC:";
@@ -466,9 +368,23 @@ void dump_sexp_impl(std::string& output, Sexp sexp, Environment& env) {
                     }
                 } break;
 
+                case TYPE_BUILTIN_PROC: {
+                    auto& v = *ptr.get_as_unchecked<BuiltinProc>();
+                    output += "#BUILTIN:";
+                    output += *v.name;
+                } break;
+
                 case TYPE_CALL_FRAME: {
                     assert(false && "unimplemented");
                 } break;
+
+                case TYPE_BYTECODE: {
+                    output += "#BYTECODE";
+                } break;
+
+                case TYPE_FREE: {
+                    assert(false && "reference to a dead object");
+                } break;
             }
         } break;
     }
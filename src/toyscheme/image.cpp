@@ -0,0 +1,897 @@
+module;
+#include "opcodes.hpp"
+#include "util.hpp"
+#include <cassert>
+
+module toyscheme;
+import std;
+
+using namespace std::literals;
+
+namespace toyscheme {
+
+// An image is the state of the globals, saved after running some code such as a prelude, to be restored without running it again.
+// A form cache holds the top-level forms of a source file as parsed, to be read back without lexing or parsing it again.
+// Heap objects hold std::vector and std::string, that can't be mapped back in place, so both are a compact encoding of object graphs
+// instead, decoded straight from the mapped file: names and string literals keep pointing into it.
+//
+// Layout, all integers in native byte order:
+//   FileHeader
+//   groups, each an object graph of its own but for the symbols they share:
+//     u32 object count, then the object table: for each, u8 ObjectType and u32 extra, the item count of a CompactList or a vector, or the name of a BuiltinProc
+//     object contents, in the same order, see GraphWriter::write_object()
+//     u32 root count, then the roots as encoded values
+//   symbols: for each, u32 size and its name
+// Values are encoded as a u8 SexpKind, followed by the raw Sexp, a u32 symbol, or a u32 object and u8 CompactList offset.
+// An image is a single group, whose roots are the name and the value of each global; a form cache has a group of one root per form.
+
+constexpr std::array<char, 8> IMAGE_MAGIC = { 'T', 'S', 'C', 'M', 'I', 'M', 'G', '\0' };
+/// Bumped whenever the layout or the instruction set changes, images of another version are refused
+constexpr uint32_t IMAGE_VERSION = 6;
+
+constexpr std::array<char, 8> FORM_CACHE_MAGIC = { 'T', 'S', 'C', 'M', 'S', 'C', 'M', 'C' };
+/// Bumped whenever the layout changes or the reader parses some text differently, caches of another version are parsed again
+constexpr uint32_t FORM_CACHE_VERSION = 2;
+
+struct FileHeader {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t group_count;
+    uint32_t symbol_count;
+    /// Of all groups, for the reader to reserve space
+    uint32_t object_count;
+    uint64_t symbols_offset;
+    /// Of a form cache, see hash_source_text(), and the size of the text it was parsed from
+    uint64_t source_hash;
+    uint64_t source_size;
+};
+
+enum class SexpKind : uint8_t {
+    /// A Sexp without any address in it, copied as is
+    RAW,
+    SYMBOL,
+    OBJECT,
+};
+
+/// Index of an object that may be null, in a u32: 0 for null, the index plus 1 otherwise
+constexpr uint32_t NULL_OBJECT = 0;
+
+/// The fewest bytes a value, an entry of an object table and a symbol take, that counts read from a file are checked against
+constexpr size_t MIN_SEXP_SIZE = sizeof(SexpKind) + sizeof(uint32_t);
+constexpr size_t OBJECT_ENTRY_SIZE = sizeof(uint8_t) + sizeof(uint32_t);
+constexpr size_t MIN_SYMBOL_SIZE = sizeof(uint32_t);
+
+#define X(name) +1
+constexpr size_t OPCODE_COUNT = 0 TOYSCHEME_OPCODES(X);
+#undef X
+
+class GraphWriter {
+public:
+    GraphWriter() {
+        out.resize(sizeof(FileHeader));
+    }
+
+    /// Appends the objects reachable from `roots`, followed by `roots` themselves, as the next group
+    void write_group(std::span<const Sexp> roots) {
+        // Number the objects reachable from the roots, breadth first
+        objects.clear();
+        object_indices.clear();
+        for (auto root : roots)
+            note_sexp(root);
+        for (size_t i = 0; i < objects.size(); ++i)
+            note_references(objects[i]);
+
+        put<uint32_t>(out, static_cast<uint32_t>(objects.size()));
+        for (auto obj : objects) {
+            auto type = find_header(obj)->get_type();
+            put<uint8_t>(out, std::to_underlying(type));
+            put<uint32_t>(out, object_extra(type, obj));
+        }
+        for (auto obj : objects)
+            write_object(out, obj);
+        write_sexps(out, roots);
+
+        group_count += 1;
+        object_count += objects.size();
+    }
+
+    /// Returns the whole file, with `header` completed by the counts
+    std::string finish(FileHeader header) {
+        header.group_count = group_count;
+        header.symbol_count = static_cast<uint32_t>(symbols.size());
+        header.object_count = static_cast<uint32_t>(object_count);
+        header.symbols_offset = out.size();
+        for (auto sym : symbols) {
+            put<uint32_t>(out, static_cast<uint32_t>(sym->size()));
+            out += std::string_view(*sym);
+        }
+        std::memcpy(out.data(), &header, sizeof(header));
+        return std::move(out);
+    }
+
+private:
+    std::string out;
+    uint32_t group_count = 0;
+    size_t object_count = 0;
+    std::vector<void*> objects;
+    std::unordered_map<const void*, uint32_t> object_indices;
+    std::vector<const Symbol*> symbols;
+    std::unordered_map<const Symbol*, uint32_t> symbol_indices;
+
+    template <typename T>
+    static void put(std::string& buf, T v) {
+        buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    static ObjectHeader* find_header(void* obj) {
+        return HeapPtr<void>(obj).get_header();
+    }
+
+    uint32_t symbol_index(const Symbol& sym) {
+        auto [iter, inserted] = symbol_indices.try_emplace(&sym, static_cast<uint32_t>(symbols.size()));
+        if (inserted)
+            symbols.push_back(&sym);
+        return iter->second;
+    }
+
+    void note_object(void* obj) {
+        if (obj == nullptr)
+            return;
+        auto [_, inserted] = object_indices.try_emplace(obj, static_cast<uint32_t>(objects.size()));
+        if (inserted)
+            objects.push_back(obj);
+    }
+
+    void note_sexp(Sexp v) {
+        if (v.is_symbol())
+            symbol_index(v.as_symbol());
+        else if (v.is_ptr() && !v.is_nil())
+            note_object(v.as_ptr().get());
+    }
+
+    void note_references(void* obj) {
+        switch (find_header(obj)->get_type()) {
+            using enum ObjectType;
+            case TYPE_CONS_CELL: {
+                auto& v = *static_cast<ConsCell*>(obj);
+                note_sexp(v.car);
+                note_sexp(v.cdr);
+            } break;
+            case TYPE_COMPACT_LIST: {
+                auto& v = *static_cast<CompactList*>(obj);
+                note_sexp(v.tail);
+                for (size_t i = 0; i < v.size; ++i)
+                    note_sexp(v.items()[i]);
+            } break;
+            case TYPE_USER_PROC: {
+                auto& v = *static_cast<UserProc*>(obj);
+                note_object(v.closure_frame.get());
+                note_object(v.code.get());
+            } break;
+            case TYPE_CALL_FRAME: {
+                auto& v = *static_cast<Scope*>(obj);
+                note_object(v.prev.get());
+                for (auto value : v.slots)
+                    note_sexp(value);
+            } break;
+            case TYPE_BYTECODE: {
+                auto& v = *static_cast<Bytecode*>(obj);
+                if (v.name != nullptr)
+                    symbol_index(*v.name);
+                for (auto constant : v.constants)
+                    note_sexp(constant);
+            } break;
+            case TYPE_VECTOR: {
+                for (auto item : static_cast<Vector*>(obj)->items())
+                    note_sexp(item);
+            } break;
+            case TYPE_BUILTIN_PROC: {
+                symbol_index(*static_cast<BuiltinProc*>(obj)->name);
+            } break;
+            case TYPE_STRING:
+            case TYPE_BOXED_INT:
+            case TYPE_INT_VECTOR:
+            case TYPE_FLOAT_VECTOR:
+                break;
+            case TYPE_UNKNOWN:
+            case TYPE_FREE:
+                throw ImageException(std::format("cannot save a heap object of type {}", object_type_name(find_header(obj)->get_type())));
+        }
+    }
+
+    /// What the reader needs to know to allocate `obj`, see allocate_object()
+    uint32_t object_extra(ObjectType type, void* obj) {
+        switch (type) {
+            using enum ObjectType;
+            case TYPE_COMPACT_LIST: return static_cast<uint32_t>(static_cast<CompactList*>(obj)->size);
+            case TYPE_VECTOR: return static_cast<uint32_t>(static_cast<Vector*>(obj)->size);
+            case TYPE_INT_VECTOR: return static_cast<uint32_t>(static_cast<IntVector*>(obj)->size);
+            case TYPE_FLOAT_VECTOR: return static_cast<uint32_t>(static_cast<FloatVector*>(obj)->size);
+            case TYPE_BUILTIN_PROC: return symbol_index(*static_cast<BuiltinProc*>(obj)->name);
+            default: return 0;
+        }
+    }
+
+    uint32_t object_ref(const void* obj) {
+        return obj == nullptr ? NULL_OBJECT : object_indices.at(obj) + 1;
+    }
+
+    void write_sexp(std::string& buf, Sexp v) {
+        if (v.is_symbol()) {
+            put(buf, SexpKind::SYMBOL);
+            put<uint32_t>(buf, symbol_index(v.as_symbol()));
+        } else if (v.is_ptr() && !v.is_nil()) {
+            put(buf, SexpKind::OBJECT);
+            put<uint32_t>(buf, object_indices.at(v.as_ptr().get()));
+            put<uint8_t>(buf, static_cast<uint8_t>(v.get_ptr_offset()));
+        } else {
+            put(buf, SexpKind::RAW);
+            put<uint64_t>(buf, v._value);
+        }
+    }
+
+    void write_sexps(std::string& buf, std::span<const Sexp> values) {
+        put<uint32_t>(buf, static_cast<uint32_t>(values.size()));
+        for (auto v : values)
+            write_sexp(buf, v);
+    }
+
+    template <typename T>
+    void write_numbers(std::string& buf, const std::vector<T>& values) {
+        put<uint32_t>(buf, static_cast<uint32_t>(values.size()));
+        buf.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+
+    /// Writes the items of a vector, whose count is in the object table
+    template <typename TVec>
+    void write_items(std::string& buf, TVec& vec) {
+        if constexpr (std::is_same_v<typename TVec::Item, Sexp>) {
+            for (auto item : vec.items())
+                write_sexp(buf, item);
+        } else {
+            buf.append(reinterpret_cast<const char*>(vec.items().data()), vec.items().size_bytes());
+        }
+    }
+
+    void write_object(std::string& buf, void* obj) {
+        switch (find_header(obj)->get_type()) {
+            using enum ObjectType;
+            case TYPE_CONS_CELL: {
+                auto& v = *static_cast<ConsCell*>(obj);
+                write_sexp(buf, v.car);
+                write_sexp(buf, v.cdr);
+            } break;
+            case TYPE_COMPACT_LIST: {
+                auto& v = *static_cast<CompactList*>(obj);
+                write_sexp(buf, v.tail);
+                for (size_t i = 0; i < v.size; ++i)
+                    write_sexp(buf, v.items()[i]);
+            } break;
+            case TYPE_STRING: {
+                auto text = static_cast<String*>(obj)->view();
+                put<uint32_t>(buf, static_cast<uint32_t>(text.size()));
+                buf += text;
+            } break;
+            case TYPE_USER_PROC: {
+                auto& v = *static_cast<UserProc*>(obj);
+                put<uint32_t>(buf, object_ref(v.closure_frame.get()));
+                put<uint32_t>(buf, object_ref(v.code.get()));
+            } break;
+            case TYPE_CALL_FRAME: {
+                auto& v = *static_cast<Scope*>(obj);
+                put<uint32_t>(buf, object_ref(v.prev.get()));
+                write_sexps(buf, v.slots);
+            } break;
+            case TYPE_BYTECODE: {
+                auto& v = *static_cast<Bytecode*>(obj);
+                put<uint32_t>(buf, v.name == nullptr ? NULL_OBJECT : symbol_index(*v.name) + 1);
+                put<uint32_t>(buf, static_cast<uint32_t>(v.n_params));
+                put<uint8_t>(buf, v.captures_scope);
+                write_numbers(buf, v.ops);
+                write_sexps(buf, v.constants);
+            } break;
+            case TYPE_BOXED_INT: {
+                put<int64_t>(buf, static_cast<BoxedInt*>(obj)->v);
+            } break;
+            case TYPE_VECTOR: {
+                write_items(buf, *static_cast<Vector*>(obj));
+            } break;
+            case TYPE_INT_VECTOR: {
+                write_items(buf, *static_cast<IntVector*>(obj));
+            } break;
+            case TYPE_FLOAT_VECTOR: {
+                write_items(buf, *static_cast<FloatVector*>(obj));
+            } break;
+            // Only its name, from the object table
+            case TYPE_BUILTIN_PROC:
+                break;
+            case TYPE_UNKNOWN:
+            case TYPE_FREE:
+                assert(false && "not saved");
+                break;
+        }
+    }
+};
+
+class GraphReader {
+public:
+    /// Checks the header of `file` against `magic` and `version`; `kind` names such files in errors, e.g. "an image".
+    /// `file` must stay mapped for as long as `env` lives once read_symbols() is called, as names and strings borrow its bytes.
+    GraphReader(std::string_view file, const std::array<char, 8>& magic, uint32_t version, std::string_view kind, Environment& env)
+        : env{ &env }
+        , image{ file } //
+    {
+        header = get<FileHeader>();
+        if (header.magic != magic)
+            throw ImageException(std::format("not {} file", kind));
+        if (header.version != version)
+            throw ImageException(std::format("version {} is not supported, expected {}", header.version, version));
+        if (header.symbols_offset < cursor || header.symbols_offset > image.size())
+            throw ImageException("file is truncated"s);
+    }
+
+    /// Interns the symbols of the file, before any group is read
+    void read_symbols() {
+        // The groups end where the symbols start
+        auto groups_begin = cursor;
+        cursor = header.symbols_offset;
+        check_count(header.symbol_count, MIN_SYMBOL_SIZE);
+        symbols.reserve(header.symbol_count);
+        for (uint32_t i = 0; i < header.symbol_count; ++i) {
+            auto size = get<uint32_t>();
+            symbols.push_back(&env->sym_pool.intern_borrowed(get_bytes(size)));
+        }
+        if (cursor != image.size())
+            throw ImageException("unexpected data at the end of the file"s);
+        image = image.substr(0, header.symbols_offset);
+        cursor = groups_begin;
+
+        check_count(header.object_count, OBJECT_ENTRY_SIZE);
+        types.reserve(header.object_count);
+        objects.reserve(header.object_count);
+    }
+
+    const FileHeader& get_header() const { return header; }
+
+    bool at_end() const { return groups_read == header.group_count; }
+
+    /// Decodes the next group into fresh old objects, and returns its roots.
+    /// They are only safe from the garbage collector until something else allocates, unless the caller stores them somewhere it traces.
+    std::span<const Sexp> read_group() {
+        if (at_end())
+            throw ImageException("no more groups in the file"s);
+        groups_read += 1;
+
+        if (!builtins_found) {
+            // Promote the builtins, and whatever else is young, so that the old objects decoded below can reference anything without write barriers
+            env->heap.collect_nursery();
+
+            // Builtins are bound to those of this environment, as functions can't be saved
+            for (auto name : env->globals) {
+                if (auto proc = name->global_value.is_ptr<BuiltinProc>() ? name->global_value.as_ptr<BuiltinProc>().get() : nullptr)
+                    builtins.emplace(proc->name, proc);
+            }
+            builtins_found = true;
+        }
+
+        // Allocate every object first, so that references can be resolved in any order.
+        // They are kept on the VM stack until the group is decoded, in case the allocations run a collection.
+        auto& stack = env->vm_stack;
+        size_t first_root = stack.size();
+        DEFER { stack.resize(first_root); };
+        types.clear();
+        objects.clear();
+        auto object_count = get_count(OBJECT_ENTRY_SIZE);
+        for (uint32_t i = 0; i < object_count; ++i) {
+            auto type = static_cast<ObjectType>(get<uint8_t>());
+            auto extra = get<uint32_t>();
+            void* obj = allocate_object(type, extra);
+            types.push_back(type);
+            objects.push_back(obj);
+            stack.push_back(Sexp(HeapPtr<void>(obj)));
+        }
+
+        for (size_t i = 0; i < objects.size(); ++i)
+            read_object(types[i], objects[i]);
+
+        roots.clear();
+        get_sexps(roots);
+        if (at_end() && cursor != image.size())
+            throw ImageException("unexpected data after the last group"s);
+        return roots;
+    }
+
+private:
+    Environment* env;
+    std::string_view image;
+    size_t cursor = 0;
+    FileHeader header;
+    uint32_t groups_read = 0;
+    std::vector<const Symbol*> symbols;
+    bool builtins_found = false;
+    std::unordered_map<const Symbol*, BuiltinProc*> builtins;
+    std::vector<Sexp> roots;
+    std::vector<ObjectType> types;
+    std::vector<void*> objects;
+
+    std::string_view get_bytes(size_t size) {
+        if (size > image.size() - cursor)
+            throw ImageException("file is truncated"s);
+        auto bytes = image.substr(cursor, size);
+        cursor += size;
+        return bytes;
+    }
+
+    template <typename T>
+    T get() {
+        T v;
+        std::memcpy(&v, get_bytes(sizeof(T)).data(), sizeof(T));
+        return v;
+    }
+
+    /// Throws unless what is left of the file can hold `count` items of at least `min_size` bytes, before room is made for them
+    void check_count(size_t count, size_t min_size) const {
+        if (count > (image.size() - cursor) / min_size)
+            throw ImageException("file is truncated"s);
+    }
+
+    /// Reads the count of the items that follow, of at least `min_size` bytes each
+    uint32_t get_count(size_t min_size) {
+        auto count = get<uint32_t>();
+        check_count(count, min_size);
+        return count;
+    }
+
+    const Symbol& get_symbol(uint32_t index) {
+        if (index >= symbols.size())
+            throw ImageException("invalid symbol in the file"s);
+        return *symbols[index];
+    }
+
+    template <typename T>
+    T* get_object(uint32_t index) {
+        if (index >= objects.size() || types[index] != T::HEAP_OBJECT_TYPE)
+            throw ImageException("invalid object reference in the file"s);
+        return static_cast<T*>(objects[index]);
+    }
+
+    template <typename T>
+    HeapPtr<T> get_nullable_object() {
+        auto ref = get<uint32_t>();
+        return ref == NULL_OBJECT ? HeapPtr<T>() : HeapPtr<T>(get_object<T>(ref - 1));
+    }
+
+    Sexp get_sexp() {
+        switch (get<SexpKind>()) {
+            case SexpKind::RAW: {
+                Sexp v;
+                v._value = get<uint64_t>();
+                // Anything but a number, a boolean, a local variable or '() would be taken for what its tag says it is
+                bool is_value = v.is_float() || v.is_int() || v._value == SCVAL_FALSE || v._value == SCVAL_TRUE || v.is_local_ref() || v.is_nil();
+                if (!is_value)
+                    throw ImageException("invalid value in the file"s);
+                return v;
+            }
+            case SexpKind::SYMBOL: return Sexp(get_symbol(get<uint32_t>()));
+            case SexpKind::OBJECT: {
+                auto index = get<uint32_t>();
+                auto offset = get<uint8_t>();
+                // Only a CompactList is referred to past its start, by the tails that share its items
+                if (index >= objects.size() ||
+                    (offset != 0 && (types[index] != ObjectType::TYPE_COMPACT_LIST || offset >= static_cast<CompactList*>(objects[index])->size)))
+                    throw ImageException("invalid object reference in the file"s);
+                return Sexp(HeapPtr<void>(objects[index]), offset);
+            }
+        }
+        throw ImageException("invalid value in the file"s);
+    }
+
+    void get_sexps(std::vector<Sexp>& out) {
+        auto n = get_count(MIN_SEXP_SIZE);
+        out.reserve(n);
+        for (uint32_t i = 0; i < n; ++i)
+            out.push_back(get_sexp());
+    }
+
+    template <typename T>
+    void get_numbers(std::vector<T>& out) {
+        auto n = get<uint32_t>();
+        auto bytes = get_bytes(static_cast<size_t>(n) * sizeof(T));
+        out.resize(n);
+        std::memcpy(out.data(), bytes.data(), bytes.size());
+    }
+
+    template <typename TVec>
+    void get_items(TVec& vec) {
+        if constexpr (std::is_same_v<typename TVec::Item, Sexp>) {
+            for (auto& item : vec.items())
+                item = get_sexp();
+        } else {
+            auto bytes = get_bytes(vec.items().size_bytes());
+            std::memcpy(vec.items().data(), bytes.data(), bytes.size());
+        }
+    }
+
+    /// Throws unless the VM can run `code` as it is, which it does without checking any of it: every instruction reached must be known and
+    /// complete, with constants of the kind it expects, jumps must land in the code, and whichever way it goes, it must not pop more values
+    /// or leave more scopes than it pushed or entered, nor run past the end. Scopes it did not enter itself are checked by the VM instead.
+    static void check_bytecode(const Bytecode& code) {
+        auto& ops = code.ops;
+        auto& constants = code.constants;
+        auto invalid = [] { return ImageException("invalid bytecode in the file"s); };
+
+        // Values on the stack and scopes entered when an instruction starts, the same along every path to it
+        struct State {
+            int64_t depth = -1;
+            /// 'h' for a heap scope, 's' for a stack scope, innermost last
+            std::string scopes;
+        };
+        std::vector<State> states(ops.size());
+        std::vector<size_t> work;
+        auto reach = [&](size_t pc, const State& state) {
+            if (pc >= ops.size())
+                throw invalid();
+            if (states[pc].depth == -1) {
+                states[pc] = state;
+                work.push_back(pc);
+            } else if (states[pc].depth != state.depth || states[pc].scopes != state.scopes) {
+                throw invalid();
+            }
+        };
+
+        reach(0, State{ .depth = 0 });
+        while (!work.empty()) {
+            size_t pc = work.back();
+            work.pop_back();
+            auto state = states[pc];
+            if (ops[pc] >= OPCODE_COUNT)
+                throw invalid();
+
+            size_t next = pc + 1;
+            auto operand = [&] {
+                if (ops.size() - next < sizeof(uint16_t))
+                    throw invalid();
+                uint16_t v;
+                std::memcpy(&v, ops.data() + next, sizeof(v));
+                next += sizeof(v);
+                return v;
+            };
+            auto constant = [&](auto is_valid) {
+                auto k = operand();
+                if (k >= constants.size() || !is_valid(constants[k]))
+                    throw invalid();
+            };
+            auto any = [](Sexp) { return true; };
+            auto symbol = [](Sexp c) { return c.is_symbol(); };
+            auto bytecode = [](Sexp c) { return c.is_ptr<Bytecode>(); };
+            auto builtin = [](Sexp c) { return c.is_ptr<BuiltinProc>() && c.as_ptr<BuiltinProc>()->fn != nullptr; };
+            auto leave = [&](char kind) {
+                if (state.scopes.empty() || state.scopes.back() != kind)
+                    throw invalid();
+                state.scopes.pop_back();
+            };
+
+            size_t pops = 0;
+            size_t pushes = 0;
+            std::optional<size_t> jump_target;
+            bool falls_through = true;
+            switch (static_cast<Opcode>(ops[pc])) {
+                using enum Opcode;
+                case CONST: constant(any); pushes = 1; break;
+                case NIL: pushes = 1; break;
+                case LOCAL: operand(); operand(); pushes = 1; break;
+                case LOCAL_0: operand(); pushes = 1; break;
+                case SET_LOCAL: operand(); operand(); pops = 1; break;
+                case GLOBAL: constant(symbol); pushes = 1; break;
+                case SET_GLOBAL:
+                case DEFINE_GLOBAL: constant(symbol); pops = 1; break;
+                case POP: pops = 1; break;
+                case JUMP: jump_target = operand(); falls_through = false; break;
+                case JUMP_IF_FALSE: jump_target = operand(); pops = 1; break;
+                case CLOSURE: constant(bytecode); pushes = 1; break;
+                case CALL: pops = operand() + 1; pushes = 1; break;
+                case TAIL_CALL: pops = operand() + 1; falls_through = false; break;
+                case RETURN: pops = 1; falls_through = false; break;
+                case CALL_BUILTIN:
+                case ADD:
+                case SUB:
+                case MUL:
+                case DIV:
+                case NUM_EQ:
+                case LT:
+                case LE:
+                case GT:
+                case GE: constant(builtin); pops = operand(); pushes = 1; break;
+                case CAR:
+                case CDR:
+                case IS_NULL: constant(builtin); pops = 1; pushes = 1; break;
+                case CONS: constant(builtin); pops = 2; pushes = 1; break;
+                case ENTER_SCOPE: pops = operand(); state.scopes.push_back('h'); break;
+                case ENTER_STACK_SCOPE: pops = operand(); state.scopes.push_back('s'); break;
+                case LEAVE_SCOPE: leave('h'); break;
+                case LEAVE_STACK_SCOPE: leave('s'); break;
+            }
+            if (state.depth < static_cast<int64_t>(pops))
+                throw invalid();
+            state.depth += static_cast<int64_t>(pushes) - static_cast<int64_t>(pops);
+            if (jump_target)
+                reach(*jump_target, state);
+            if (falls_through)
+                reach(next, state);
+        }
+    }
+
+    void* allocate_object(ObjectType type, uint32_t extra) {
+        auto& heap = env->heap;
+        switch (type) {
+            using enum ObjectType;
+            case TYPE_CONS_CELL: return heap.allocate_old<ConsCell>().first;
+            case TYPE_COMPACT_LIST: {
+                if (extra == 0 || extra > CompactList::MAX_SIZE)
+                    throw ImageException("invalid list in the file"s);
+                auto [obj, _] = heap.allocate_old(sizeof(CompactList) + extra * sizeof(Sexp), alignof(CompactList), TYPE_COMPACT_LIST);
+                auto list = new (obj) CompactList{ .size = extra, .tail = Sexp() };
+                std::uninitialized_fill_n(list->items(), extra, Sexp());
+                return list;
+            }
+            case TYPE_STRING: return heap.allocate_old<String>().first;
+            case TYPE_USER_PROC: return heap.allocate_old<UserProc>().first;
+            case TYPE_CALL_FRAME: return heap.allocate_old<Scope>().first;
+            case TYPE_BYTECODE: return heap.allocate_old<Bytecode>().first;
+            case TYPE_BOXED_INT: return heap.allocate_old<BoxedInt>().first;
+            // Their items come after the object table, so they must fit in what is left of the file
+            case TYPE_VECTOR: {
+                check_count(extra, MIN_SEXP_SIZE);
+                return allocate_vector<Vector>(extra, heap, true);
+            }
+            case TYPE_INT_VECTOR: {
+                check_count(extra, sizeof(int64_t));
+                return allocate_vector<IntVector>(extra, heap, true);
+            }
+            case TYPE_FLOAT_VECTOR: {
+                check_count(extra, sizeof(double));
+                return allocate_vector<FloatVector>(extra, heap, true);
+            }
+            case TYPE_BUILTIN_PROC: {
+                auto& name = get_symbol(extra);
+                auto iter = builtins.find(&name);
+                if (iter == builtins.end())
+                    throw ImageException(std::format("file refers to an unknown builtin '{}'", std::string_view(name)));
+                return iter->second;
+            }
+            case TYPE_UNKNOWN:
+            case TYPE_FREE:
+                break;
+        }
+        throw ImageException("invalid object in the file"s);
+    }
+
+    void read_object(ObjectType type, void* obj) {
+        switch (type) {
+            using enum ObjectType;
+            case TYPE_CONS_CELL: {
+                auto& v = *static_cast<ConsCell*>(obj);
+                v.car = get_sexp();
+                v.cdr = get_sexp();
+            } break;
+            case TYPE_COMPACT_LIST: {
+                auto& v = *static_cast<CompactList*>(obj);
+                v.tail = get_sexp();
+                for (size_t i = 0; i < v.size; ++i)
+                    v.items()[i] = get_sexp();
+            } break;
+            case TYPE_STRING: {
+                static_cast<String*>(obj)->borrowed = get_bytes(get<uint32_t>());
+            } break;
+            case TYPE_USER_PROC: {
+                auto& v = *static_cast<UserProc*>(obj);
+                v.closure_frame = get_nullable_object<Scope>();
+                v.code = get_nullable_object<Bytecode>();
+                if (v.code == nullptr)
+                    throw ImageException("proc without code in the file"s);
+            } break;
+            case TYPE_CALL_FRAME: {
+                auto& v = *static_cast<Scope*>(obj);
+                v.prev = get_nullable_object<Scope>();
+                get_sexps(v.slots);
+            } break;
+            case TYPE_BYTECODE: {
+                auto& v = *static_cast<Bytecode*>(obj);
+                auto name = get<uint32_t>();
+                v.name = name == NULL_OBJECT ? nullptr : &get_symbol(name - 1);
+                v.n_params = get<uint32_t>();
+                v.captures_scope = get<uint8_t>() != 0;
+                get_numbers(v.ops);
+                get_sexps(v.constants);
+                check_bytecode(v);
+            } break;
+            case TYPE_BOXED_INT: {
+                static_cast<BoxedInt*>(obj)->v = get<int64_t>();
+            } break;
+            case TYPE_VECTOR: {
+                get_items(*static_cast<Vector*>(obj));
+            } break;
+            case TYPE_INT_VECTOR: {
+                get_items(*static_cast<IntVector*>(obj));
+            } break;
+            case TYPE_FLOAT_VECTOR: {
+                get_items(*static_cast<FloatVector*>(obj));
+            } break;
+            case TYPE_BUILTIN_PROC:
+            case TYPE_UNKNOWN:
+            case TYPE_FREE:
+                break;
+        }
+    }
+};
+
+namespace {
+
+/// Writes `data` to a temporary file renamed to `path` once complete, so that concurrent runs reading `path` never see half of it
+bool write_file_atomically(const std::filesystem::path& path, std::string_view data) {
+    auto tmp_path = path;
+    tmp_path += std::format(".{:08x}.tmp", std::random_device{}());
+
+    std::ofstream out(tmp_path, std::ios::binary);
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    out.close();
+
+    std::error_code ec;
+    if (out)
+        std::filesystem::rename(tmp_path, path, ec);
+    if (!out || ec) {
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+void dump_image(const std::filesystem::path& path, Environment& env) {
+    // The name and the value of each global, as roots of a single group
+    std::vector<Sexp> roots;
+    roots.reserve(env.globals.size() * 2);
+    for (auto name : env.globals) {
+        roots.push_back(Sexp(*name));
+        roots.push_back(name->global_value);
+    }
+
+    GraphWriter writer;
+    writer.write_group(roots);
+    auto image = writer.finish(FileHeader{ .magic = IMAGE_MAGIC, .version = IMAGE_VERSION });
+
+    // Runs that loaded the image keep its strings mapped, so it must be replaced rather than overwritten
+    if (!write_file_atomically(path, image))
+        throw ImageException("unable to write the image file"s);
+}
+
+void load_image(const std::filesystem::path& path, Environment& env) {
+    auto file = env.load_source(path);
+    if (!file)
+        throw ImageException("unable to open the image file"s);
+
+    GraphReader reader(file->text(), IMAGE_MAGIC, IMAGE_VERSION, "an image", env);
+    reader.read_symbols();
+    if (reader.get_header().group_count != 1)
+        throw ImageException("an image has a single group"s);
+    auto roots = reader.read_group();
+    if (roots.size() % 2 != 0)
+        throw ImageException("a global without a value in the image"s);
+    for (size_t i = 0; i < roots.size(); i += 2) {
+        if (!roots[i].is_symbol())
+            throw ImageException("a global without a name in the image"s);
+        env.define_global(roots[i].as_symbol(), roots[i + 1]);
+    }
+}
+
+uint64_t hash_source_text(std::string_view text) {
+    // Not cryptographic, only quick to compute: 4 lanes of 8 bytes each, mixed with a multiply and a rotate, so that the lanes don't wait on each other
+    constexpr uint64_t K1 = 0x9E37'79B9'7F4A'7C15;
+    constexpr uint64_t K2 = 0xC2B2'AE3D'27D4'EB4F;
+    auto mix = [](uint64_t h, uint64_t word) { return std::rotl(h ^ (word * K2), 31) * K1; };
+    auto load = [&](size_t offset) {
+        uint64_t word;
+        std::memcpy(&word, text.data() + offset, sizeof(word));
+        return word;
+    };
+
+    std::array<uint64_t, 4> lanes = { K1, K2, K1 ^ K2, text.size() };
+    size_t i = 0;
+    for (; i + 32 <= text.size(); i += 32) {
+        for (size_t lane = 0; lane < lanes.size(); ++lane)
+            lanes[lane] = mix(lanes[lane], load(i + lane * 8));
+    }
+
+    uint64_t h = text.size();
+    for (auto lane : lanes)
+        h = mix(h, lane);
+    for (; i + 8 <= text.size(); i += 8)
+        h = mix(h, load(i));
+    uint64_t tail = 0;
+    std::memcpy(&tail, text.data() + i, text.size() - i);
+    h = mix(h, tail);
+
+    // Let every input bit reach all bits of the hash
+    h ^= h >> 33;
+    h *= K2;
+    h ^= h >> 29;
+    return h;
+}
+
+struct FormCacheReader::Reader : GraphReader {
+    using GraphReader::GraphReader;
+};
+
+std::unique_ptr<FormCacheReader> FormCacheReader::open(const std::filesystem::path& cache_path, const SourceFile& source, uint64_t source_hash, Environment& env) {
+    auto file = SourceFile::open(cache_path);
+    if (!file)
+        return nullptr;
+
+    try {
+        auto reader = std::make_unique<Reader>(file->text(), FORM_CACHE_MAGIC, FORM_CACHE_VERSION, "a form cache", env);
+        auto& header = reader->get_header();
+        if (header.source_size != source.text().size() || header.source_hash != source_hash)
+            return nullptr;
+
+        // Nothing reads the source itself anymore
+        source.release_before(source.text().size());
+        env.sources.push_back(std::move(file));
+        reader->read_symbols();
+        return std::unique_ptr<FormCacheReader>(new FormCacheReader(std::move(reader)));
+    } catch (const ImageException&) {
+        return nullptr;
+    } catch (const std::exception&) {
+        // Such as bad_alloc, for counts that a corrupt file got wrong but still fit in it: the source is parsed as if there were no cache
+        return nullptr;
+    }
+}
+
+FormCacheReader::FormCacheReader(std::unique_ptr<Reader> reader)
+    : _reader(std::move(reader)) {}
+
+FormCacheReader::~FormCacheReader() = default;
+
+std::optional<Sexp> FormCacheReader::next() {
+    if (_reader->at_end())
+        return std::nullopt;
+    try {
+        auto roots = _reader->read_group();
+        if (roots.size() != 1)
+            throw ImageException("a form cache has one form per group"s);
+        return roots[0];
+    } catch (const ImageException& e) {
+        throw ParseException(std::format("corrupt form cache: {}", e.msg));
+    } catch (const std::exception& e) {
+        throw ParseException(std::format("corrupt form cache: {}", e.what()));
+    }
+}
+
+struct FormCacheWriter::Writer : GraphWriter {};
+
+FormCacheWriter::FormCacheWriter(const SourceFile& source, uint64_t source_hash)
+    : _writer(std::make_unique<Writer>())
+    , _source_hash(source_hash)
+    , _source_size(source.text().size()) {}
+
+FormCacheWriter::~FormCacheWriter() = default;
+
+void FormCacheWriter::add(Sexp form) {
+    _writer->write_group(std::span(&form, 1));
+}
+
+bool FormCacheWriter::save(const std::filesystem::path& cache_path) {
+    auto data = _writer->finish(FileHeader{
+        .magic = FORM_CACHE_MAGIC,
+        .version = FORM_CACHE_VERSION,
+        .source_hash = _source_hash,
+        .source_size = _source_size,
+    });
+
+    std::error_code ec;
+    if (cache_path.has_parent_path())
+        std::filesystem::create_directories(cache_path.parent_path(), ec);
+    return write_file_atomically(cache_path, data);
+}
+
+} // namespace toyscheme
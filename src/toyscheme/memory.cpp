@@ -1,5 +1,15 @@
 module;
 #include <cassert>
+#include <csetjmp>
+#if defined(_WIN32)
+#    define WIN32_LEAN_AND_MEAN
+#    define NOMINMAX
+#    include <windows.h>
+#else
+#    include <pthread.h>
+#    include <sys/mman.h>
+#    include <unistd.h>
+#endif
 
 module toyscheme;
 
@@ -19,22 +29,9 @@ void ObjectHeader::set_flag(int flag_bit, bool value) {
     }
 }
 
-size_t ObjectHeader::_read_size() const {
-    return (_size_p3 << 24) | (_size_p2 << 16) | (_size_p1 << 8) | _size_p0;
-}
-
 size_t ObjectHeader::get_size() const {
-    // TODO just store the size in the header?
-    switch (get_type()) {
-        using enum ObjectType;
-        case TYPE_UNKNOWN: return _read_size();
-        case TYPE_CONS_CELL: return sizeof(ConsCell);
-        case TYPE_CALL_FRAME: return sizeof(Scope);
-        case TYPE_STRING: return sizeof(String);
-        case TYPE_USER_PROC: return sizeof(UserProc);
-        case TYPE_BUILTIN_PROC: return sizeof(BuiltinProc);
-    }
-    return 0;
+    // Widened first, as the bytes promote to int, which the top one would overflow for large objects of 2 GiB and more
+    return (static_cast<size_t>(_size_p3) << 24) | (static_cast<size_t>(_size_p2) << 16) | (static_cast<size_t>(_size_p1) << 8) | _size_p0;
 }
 
 void ObjectHeader::set_size(size_t size) {
@@ -54,6 +51,13 @@ size_t ObjectHeader::get_alignment() const {
         case TYPE_STRING: return alignof(String);
         case TYPE_USER_PROC: return alignof(UserProc);
         case TYPE_BUILTIN_PROC: return alignof(BuiltinProc);
+        case TYPE_BYTECODE: return alignof(Bytecode);
+        case TYPE_COMPACT_LIST: return alignof(CompactList);
+        case TYPE_BOXED_INT: return alignof(BoxedInt);
+        case TYPE_VECTOR: return alignof(Vector);
+        case TYPE_INT_VECTOR: return alignof(IntVector);
+        case TYPE_FLOAT_VECTOR: return alignof(FloatVector);
+        case TYPE_FREE: return alignof(FreeChunk);
     }
     return 0;
 }
@@ -74,62 +78,891 @@ void ObjectHeader::set_type(ObjectType type) {
     _type_p1 = (n >> 8) & 0xFF;
 }
 
-constexpr size_t HEAP_SEGMENT_SIZE = 32 * 1024;
+std::string_view object_type_name(ObjectType type) {
+    switch (type) {
+        using enum ObjectType;
+        case TYPE_UNKNOWN: return "unknown";
+        case TYPE_CONS_CELL: return "cons-cell";
+        case TYPE_STRING: return "string";
+        case TYPE_USER_PROC: return "user-proc";
+        case TYPE_BUILTIN_PROC: return "builtin-proc";
+        case TYPE_CALL_FRAME: return "call-frame";
+        case TYPE_BYTECODE: return "bytecode";
+        case TYPE_COMPACT_LIST: return "compact-list";
+        case TYPE_BOXED_INT: return "boxed-int";
+        case TYPE_VECTOR: return "vector";
+        case TYPE_INT_VECTOR: return "s64vector";
+        case TYPE_FLOAT_VECTOR: return "f64vector";
+        case TYPE_FREE: return "free";
+    }
+    return "invalid";
+}
+
+/// Number of segments in the young generation, sized to stay in cache
+constexpr size_t NURSERY_SEGMENT_COUNT = 8;
+/// Segments a collection may take past the limit of the heap, as it can't back out half way:
+/// enough for every survivor of the nursery to start a segment of its size class, and for replacing pinned nursery segments
+constexpr size_t GC_HEADROOM_SEGMENTS = 2 * NURSERY_SEGMENT_COUNT + FREE_LIST_COUNT;
+/// Alignment of the reserved range when backed by transparent huge pages, so that the nursery at its start sits in one of them
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/// Allocation budget of the old generation between two full collections will never be smaller than this
+constexpr size_t GC_MIN_THRESHOLD = 1024 * 1024;
+/// Number of completely empty segments kept around after a sweep, instead of being returned to the system
+constexpr size_t GC_RETAINED_EMPTY_SEGMENTS = 4;
+/// Number of unused stack scopes kept around after a full collection, e.g. after a deep recursion, see Environment::stack_scopes
+constexpr size_t GC_RETAINED_STACK_SCOPES = 256;
 
-Heap::Heap() {
-    new_heap_segment();
+namespace {
+std::byte* find_native_stack_top() {
+#if defined(_WIN32)
+    ULONG_PTR low, high;
+    GetCurrentThreadStackLimits(&low, &high);
+    return std::bit_cast<std::byte*>(high);
+#elif defined(__APPLE__)
+    return static_cast<std::byte*>(pthread_get_stackaddr_np(pthread_self()));
+#else
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    pthread_getattr_np(pthread_self(), &attr);
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    return static_cast<std::byte*>(addr) + size;
+#endif
 }
 
-Heap::~Heap() {
-    for (auto& hg : heap_segments) {
-        std::free(hg.arena);
+size_t find_page_size() {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+const size_t SYSTEM_PAGE_SIZE = find_page_size();
+
+/// Reserves `size` bytes of address space, which take no memory until committed; returns nullptr on failure
+std::byte* reserve_address_range(size_t size) {
+#if defined(_WIN32)
+    return static_cast<std::byte*>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS));
+#else
+    // Mapped readable and writable right away, as pages only take memory once touched.
+    // Committing is then free, and doesn't split the mapping in many like changing the protection of parts of it would.
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return addr == MAP_FAILED ? nullptr : static_cast<std::byte*>(addr);
+#endif
+}
+
+bool commit_pages(std::byte* addr, size_t size) {
+#if defined(_WIN32)
+    return VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    (void)addr;
+    (void)size;
+    return true;
+#endif
+}
+
+/// Gives the memory behind the pages back to the system, keeping their address range reserved; they read as zeros once committed again.
+/// The range must be made of whole pages.
+void decommit_pages(std::byte* addr, size_t size) {
+#if defined(_WIN32)
+    VirtualFree(addr, size, MEM_DECOMMIT);
+#else
+    madvise(addr, size, MADV_DONTNEED);
+#endif
+}
+
+void release_address_range(std::byte* addr, size_t size) {
+#if defined(_WIN32)
+    (void)size;
+    VirtualFree(addr, 0, MEM_RELEASE);
+#else
+    munmap(addr, size);
+#endif
+}
+
+void advise_huge_pages(std::byte* addr, size_t size) {
+#if defined(MADV_HUGEPAGE)
+    madvise(addr, size, MADV_HUGEPAGE);
+#else
+    (void)addr;
+    (void)size;
+#endif
+}
+
+/// Size class of an object with a payload of `size` bytes, or FREE_LIST_COUNT - 1 for the bigger objects
+size_t free_list_index(size_t size) {
+    if (size > SIZE_CLASS_LIMIT)
+        return FREE_LIST_COUNT - 1;
+    return size / alignof(void*);
+}
+
+/// Runs the destructor of objects with non-trivial members, so that e.g. the buffer of a String is released
+void destroy_object(ObjectHeader* header, std::byte* obj) {
+    switch (header->get_type()) {
+        using enum ObjectType;
+        case TYPE_STRING: reinterpret_cast<String*>(obj)->~String(); break;
+        case TYPE_USER_PROC: reinterpret_cast<UserProc*>(obj)->~UserProc(); break;
+        case TYPE_CALL_FRAME: reinterpret_cast<Scope*>(obj)->~Scope(); break;
+        case TYPE_BYTECODE: reinterpret_cast<Bytecode*>(obj)->~Bytecode(); break;
+        // Trivially destructible
+        case TYPE_UNKNOWN:
+        case TYPE_CONS_CELL:
+        case TYPE_COMPACT_LIST:
+        case TYPE_BOXED_INT:
+        case TYPE_VECTOR:
+        case TYPE_INT_VECTOR:
+        case TYPE_FLOAT_VECTOR:
+        case TYPE_BUILTIN_PROC:
+        case TYPE_FREE:
+            break;
     }
 }
 
-std::pair<std::byte*, ObjectHeader*> Heap::allocate(size_t size, size_t alignment) {
-    // We only support types that aligns to 64-bit word boundraries
-    // because Sexp uses pointer tagging with the lowest 3 bits
-    assert(alignment == alignof(void*));
+template <typename T>
+void relocate_as(std::byte* src, std::byte* dst) {
+    auto src_obj = reinterpret_cast<T*>(src);
+    new (dst) T(std::move(*src_obj));
+    src_obj->~T();
+}
+
+/// Moves the object at `src` to the uninitialized memory at `dst`
+void relocate_object(ObjectHeader* header, std::byte* src, std::byte* dst) {
+    switch (header->get_type()) {
+        using enum ObjectType;
+        // Members like std::string may point into the object itself, so these can't just be memcpy'd
+        case TYPE_STRING: relocate_as<String>(src, dst); break;
+        case TYPE_USER_PROC: relocate_as<UserProc>(src, dst); break;
+        case TYPE_CALL_FRAME: relocate_as<Scope>(src, dst); break;
+        case TYPE_BYTECODE: relocate_as<Bytecode>(src, dst); break;
+        case TYPE_UNKNOWN:
+        case TYPE_CONS_CELL:
+        case TYPE_COMPACT_LIST:
+        case TYPE_BOXED_INT:
+        case TYPE_VECTOR:
+        case TYPE_INT_VECTOR:
+        case TYPE_FLOAT_VECTOR:
+        case TYPE_BUILTIN_PROC:
+        case TYPE_FREE:
+            std::memcpy(dst, src, header->get_size());
+            break;
+    }
+}
+
+void* reference_target(const Sexp& s) {
+    return s.is_ptr() ? s.as_ptr().get() : nullptr;
+}
+template <typename T>
+void* reference_target(const HeapPtr<T>& p) {
+    return p.get();
+}
+template <typename T>
+void* reference_target(T* const& p) {
+    return p;
+}
+
+void update_reference(Sexp& s, void* obj) {
+    s.set_pointer(HeapPtr<void>(obj), s.get_ptr_offset());
+}
+template <typename T>
+void update_reference(HeapPtr<T>& p, void* obj) {
+    p.ptr = static_cast<T*>(obj);
+}
+template <typename T>
+void update_reference(T*& p, void* obj) {
+    p = static_cast<T*>(obj);
+}
+
+/// Calls `visitor` on every field of the object that may reference another heap object
+void visit_references(ObjectHeader* header, std::byte* obj, auto&& visitor) {
+    switch (header->get_type()) {
+        using enum ObjectType;
+        case TYPE_CONS_CELL: {
+            auto& v = *reinterpret_cast<ConsCell*>(obj);
+            visitor(v.car);
+            visitor(v.cdr);
+        } break;
+
+        case TYPE_COMPACT_LIST: {
+            auto& v = *reinterpret_cast<CompactList*>(obj);
+            visitor(v.tail);
+            for (size_t i = 0; i < v.size; ++i)
+                visitor(v.items()[i]);
+        } break;
+
+        case TYPE_USER_PROC: {
+            auto& v = *reinterpret_cast<UserProc*>(obj);
+            visitor(v.closure_frame);
+            visitor(v.code);
+        } break;
 
-    auto& hg = heap_segments.back();
+        case TYPE_CALL_FRAME: {
+            auto& v = *reinterpret_cast<Scope*>(obj);
+            visitor(v.prev);
+            for (auto& value : v.slots)
+                visitor(value);
+        } break;
+
+        case TYPE_BYTECODE: {
+            auto& v = *reinterpret_cast<Bytecode*>(obj);
+            for (auto& constant : v.constants)
+                visitor(constant);
+        } break;
+
+        case TYPE_VECTOR: {
+            auto& v = *reinterpret_cast<Vector*>(obj);
+            for (auto& item : v.items())
+                visitor(item);
+        } break;
+
+        // No references to other heap objects
+        case TYPE_UNKNOWN:
+        case TYPE_STRING:
+        case TYPE_BOXED_INT:
+        case TYPE_INT_VECTOR:
+        case TYPE_FLOAT_VECTOR:
+        case TYPE_BUILTIN_PROC:
+        case TYPE_FREE:
+            break;
+    }
+}
 
-    auto start = std::bit_cast<uintptr_t>(hg.last_object);
-    uintptr_t raw = shift_down_and_align(start, size, alignment);
-    // N.B. no need to align because ObjectHeader has alignment of 1
-    uintptr_t raw_header = raw - sizeof(ObjectHeader);
+/// Conservatively scans the native stack from the current frame up to `stack_top`,
+/// calling `on_object(segment, header)` for each live object in `segments` that some word points at or into.
+void scan_native_stack(std::byte* stack_top, std::span<HeapSegment> segments, auto&& on_object) {
+    // Spill callee-saved registers onto the stack, so that pointers only living in registers are scanned too
+    std::jmp_buf regs;
+    setjmp(regs);
 
-    if (raw_header < std::bit_cast<uintptr_t>(hg.arena)) {
-        // We ran out of space
+    // Segments sorted by address, and for each of them the object headers sorted by address; the latter built on demand
+    std::vector<HeapSegment*> sorted_segments;
+    for (auto& hg : segments)
+        sorted_segments.push_back(&hg);
+    std::ranges::sort(sorted_segments, {}, &HeapSegment::arena);
+    std::vector<std::vector<std::byte*>> segment_objects(sorted_segments.size());
+
+    auto scan_word = [&](uintptr_t word) {
+        auto addr = std::bit_cast<std::byte*>(word);
+
+        auto seg_it = std::ranges::upper_bound(sorted_segments, addr, {}, &HeapSegment::arena);
+        if (seg_it == sorted_segments.begin())
+            return;
+        --seg_it;
+        auto& hg = **seg_it;
+        auto end = hg.arena + hg.arena_size;
+        if (addr < hg.last_object || addr >= end)
+            return;
+
+        // Tagged and interior pointers are accepted as well, as long as they point inside some object
+        ObjectHeader* header;
+        if (hg.slot_size != 0) {
+            // Slots are laid out back to back from the end of the segment
+            size_t slot = static_cast<size_t>(end - addr - 1) / hg.slot_size;
+            header = reinterpret_cast<ObjectHeader*>(end - (slot + 1) * hg.slot_size);
+        } else {
+            auto& objects = segment_objects[seg_it - sorted_segments.begin()];
+            if (objects.empty()) {
+                for (auto curr = hg.last_object; curr < end;) {
+                    objects.push_back(curr);
+                    curr += sizeof(ObjectHeader) + reinterpret_cast<ObjectHeader*>(curr)->get_size();
+                }
+            }
+            auto obj_it = std::ranges::upper_bound(objects, addr);
+            header = reinterpret_cast<ObjectHeader*>(*std::prev(obj_it));
+        }
+        if (header->get_type() == ObjectType::TYPE_FREE)
+            return;
+        on_object(hg, header);
+    };
+
+    auto lo = std::bit_cast<uintptr_t>(&regs) & ~(alignof(uintptr_t) - 1);
+    auto hi = std::bit_cast<uintptr_t>(stack_top);
+    for (auto p = lo; p + sizeof(uintptr_t) <= hi; p += sizeof(uintptr_t)) {
+        auto word = *std::bit_cast<const uintptr_t*>(p);
+        scan_word(word);
+
+        // Sexp stores pointers shifted into a NaN, decode them as well
+        Sexp s;
+        s._value = word;
+        if (s.is_ptr() && !s.is_nil())
+            scan_word(std::bit_cast<uintptr_t>(s.as_ptr().get()));
+    }
+}
+} // namespace
+
+Heap::Heap(Environment& env, const HeapConfig& config)
+    : env{ &env }
+    , config{ config }
+    , stack_top{ find_native_stack_top() }
+    , gc_threshold{ GC_MIN_THRESHOLD } //
+{
+    // The nursery and one old segment are the least a heap can work with
+    auto& limits = this->config;
+    limits.max_bytes = std::max(limits.max_bytes, (NURSERY_SEGMENT_COUNT + 1) * HEAP_SEGMENT_SIZE);
+    limits.initial_bytes = std::min(limits.initial_bytes, limits.max_bytes);
+
+    while (true) {
+        size_t segment_count = (limits.max_bytes + HEAP_SEGMENT_SIZE - 1) / HEAP_SEGMENT_SIZE + GC_HEADROOM_SEGMENTS;
+        reserved_size = segment_count * HEAP_SEGMENT_SIZE + (limits.huge_pages ? HUGE_PAGE_SIZE : 0);
+        reserved_range = reserve_address_range(reserved_size);
+        if (reserved_range != nullptr)
+            break;
+        if (limits.max_bytes / 2 < (NURSERY_SEGMENT_COUNT + 1) * HEAP_SEGMENT_SIZE)
+            throw OutOfMemoryException(std::format("unable to reserve {} bytes of address space for the heap", reserved_size));
+        limits.max_bytes /= 2;
+        limits.initial_bytes = std::min(limits.initial_bytes, limits.max_bytes);
+    }
+    gc_threshold = std::max(GC_MIN_THRESHOLD, limits.initial_bytes);
+    next_segment = reserved_range;
+    if (limits.huge_pages) {
+        auto aligned = (std::bit_cast<uintptr_t>(reserved_range) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        next_segment = std::bit_cast<std::byte*>(aligned);
+        advise_huge_pages(next_segment, reserved_range + reserved_size - next_segment);
+    }
+
+    for (size_t i = 0; i < NURSERY_SEGMENT_COUNT; ++i)
+        nursery_segments.push_back(map_segment());
+    nursery = &nursery_segments.front();
+    do {
         new_heap_segment();
-        return allocate(size, alignment);
+    } while (committed_bytes + HEAP_SEGMENT_SIZE <= limits.initial_bytes);
+}
+
+Heap::~Heap() {
+    auto destroy_segments = [](std::vector<HeapSegment>& segments) {
+        for (auto& hg : segments) {
+            auto curr = hg.last_object;
+            auto end = hg.arena + hg.arena_size;
+            while (curr < end) {
+                auto header = reinterpret_cast<ObjectHeader*>(curr);
+                auto obj = curr + sizeof(ObjectHeader);
+                curr = obj + header->get_size();
+                destroy_object(header, obj);
+            }
+            if (hg.large_object)
+                release_address_range(hg.arena, hg.arena_size);
+        }
+    };
+    destroy_segments(heap_segments);
+    destroy_segments(nursery_segments);
+    release_address_range(reserved_range, reserved_size);
+}
+
+void Heap::refill_nursery(size_t size) {
+    assert(size <= LARGE_OBJECT_THRESHOLD);
+
+    // Move on to the next segment; only once all of them are used up, make room with a collection
+    while (nursery != &nursery_segments.back()) {
+        nursery += 1;
+        if (static_cast<size_t>(nursery->last_object - nursery->arena) >= size)
+            return;
+    }
+
+    collect_nursery();
+    if (bytes_since_gc >= gc_threshold || committed_bytes > config.max_bytes)
+        collect_old_generation();
+    if (committed_bytes > config.max_bytes)
+        throw OutOfMemoryException(std::format("the heap takes {} bytes after a full collection, past its limit of {} bytes", committed_bytes, config.max_bytes));
+}
+
+std::pair<std::byte*, ObjectHeader*> Heap::allocate_large(size_t size, size_t alignment, ObjectType type) {
+    assert(alignment == alignof(void*));
+
+    size = (size + alignment - 1) & ~(alignment - 1);
+    size_t total_size = size + sizeof(ObjectHeader);
+    size_t mapping_size = (total_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE * SYSTEM_PAGE_SIZE;
+    if (mapping_size > config.max_bytes)
+        throw OutOfMemoryException(std::format("unable to map {} bytes for a large object, past the limit of {} bytes", mapping_size, config.max_bytes));
+    if (size > std::numeric_limits<uint32_t>::max())
+        throw OutOfMemoryException(std::format("unable to allocate an object of {} bytes, larger than any the heap can hold", size));
+
+    if (bytes_since_gc >= gc_threshold || committed_bytes + mapping_size > config.max_bytes)
+        collect_garbage();
+    account_committed(mapping_size);
+    auto arena = reserve_address_range(mapping_size);
+    if (arena == nullptr || !commit_pages(arena, mapping_size)) {
+        committed_bytes -= mapping_size;
+        throw OutOfMemoryException(std::format("unable to map {} bytes for a large object", mapping_size));
     }
+    bytes_since_gc += mapping_size;
 
-    auto new_obj_header = std::bit_cast<std::byte*>(raw_header);
-    auto new_obj = std::bit_cast<std::byte*>(raw);
-    hg.last_object = new_obj_header;
+    // The object sits at the end of its mapping, as if bump allocated into a segment of its own, so that it is walked and swept like any other
+    auto& hg = heap_segments.emplace_back(HeapSegment{
+        .arena = arena,
+        .last_object = arena + mapping_size - total_size,
+        .arena_size = mapping_size,
+        .large_object = true,
+    });
+    auto h = reinterpret_cast<ObjectHeader*>(hg.last_object);
+    h->init(size, alignment, type, 0);
+    stats.allocations += 1;
+    stats.allocated_bytes += total_size;
+    stats.allocations_by_type[std::to_underlying(type)] += 1;
+    remember(h);
+    return { find_object(h), h };
+}
+
+std::pair<std::byte*, ObjectHeader*> Heap::allocate_old(size_t size, size_t alignment, ObjectType type) {
+    assert(alignment == alignof(void*));
 
-    // Padding members initialized to 0 automatically
-    auto h = new (new_obj_header) ObjectHeader{};
-    h->set_size(size);
-    h->set_alignment(alignment);
-    h->set_type(ObjectType::TYPE_UNKNOWN);
+    size = (size + alignment - 1) & ~(alignment - 1);
+    if (size + sizeof(ObjectHeader) > LARGE_OBJECT_THRESHOLD)
+        return allocate_large(size, alignment, type);
 
+    if (bytes_since_gc >= gc_threshold)
+        collect_garbage();
+
+    auto new_obj = allocate_in_old_segments(size);
+    auto h = find_header(new_obj);
+    h->init(size, alignment, type, 0);
+    stats.allocations += 1;
+    stats.allocated_bytes += size + sizeof(ObjectHeader);
+    stats.allocations_by_type[std::to_underlying(type)] += 1;
     return { new_obj, h };
 }
 
-std::byte* Heap::find_object(ObjectHeader* header) const {
-    return reinterpret_cast<std::byte*>(header) + sizeof(ObjectHeader);
+std::byte* Heap::allocate_in_old_segments(size_t size) {
+    bytes_since_gc += size + sizeof(ObjectHeader);
+
+    if (auto obj = allocate_from_free_list(size))
+        return obj;
+
+    // Objects of a size class are bumped out of segments of their own, so that sweeping and the native stack scan can step through them by a fixed size
+    assert(size + sizeof(ObjectHeader) <= LARGE_OBJECT_THRESHOLD);
+    size_t size_class = free_list_index(size);
+    size_t slot_size = size_class < SIZE_CLASS_COUNT ? size + sizeof(ObjectHeader) : 0;
+    auto& curr_segment = curr_segments[size_class];
+    bool collected = false;
+    while (true) {
+        if (curr_segment == heap_segments.size()) {
+            // Rather than going past the limit of the heap, see if a full collection makes room; it starts over the search from the first segment
+            if (!collecting && !collected && committed_bytes + HEAP_SEGMENT_SIZE > config.max_bytes) {
+                collect_garbage();
+                collected = true;
+                if (auto obj = allocate_from_free_list(size))
+                    return obj;
+                continue;
+            }
+            new_heap_segment();
+        }
+        auto& hg = heap_segments[curr_segment];
+        // Empty segments are taken over by whichever size class gets to them first
+        if (hg.last_object == hg.arena + hg.arena_size && !hg.large_object)
+            hg.slot_size = slot_size;
+        if (hg.slot_size != slot_size || hg.large_object) {
+            curr_segment += 1;
+            continue;
+        }
+
+        auto start = std::bit_cast<uintptr_t>(hg.last_object);
+        uintptr_t raw = shift_down_and_align(start, size, alignof(void*));
+        // N.B. no need to align because ObjectHeader has alignment of 1
+        uintptr_t raw_header = raw - sizeof(ObjectHeader);
+
+        if (raw_header >= std::bit_cast<uintptr_t>(hg.arena)) {
+            hg.last_object = std::bit_cast<std::byte*>(raw_header);
+            return std::bit_cast<std::byte*>(raw);
+        }
+
+        // We ran out of space, move on to the next segment that might have some left after a sweep
+        curr_segment += 1;
+    }
+}
+
+std::byte* Heap::allocate_from_free_list(size_t size) {
+    size_t index = free_list_index(size);
+    if (index < SIZE_CLASS_COUNT) {
+        // Every slot in the list of a size class fits exactly
+        auto node = free_lists[index];
+        if (node == nullptr)
+            return nullptr;
+        free_lists[index] = node->next;
+        return reinterpret_cast<std::byte*>(node);
+    }
+
+    FreeChunk** link = &free_lists[index];
+    while (*link != nullptr) {
+        auto chunk = reinterpret_cast<std::byte*>(*link);
+        auto chunk_header = find_header(chunk);
+        size_t chunk_size = chunk_header->get_size();
+        if (chunk_size < size) {
+            link = &(*link)->next;
+            continue;
+        }
+
+        *link = (*link)->next;
+        if (chunk_size == size)
+            return chunk;
+
+        // Split off the tail of the chunk for the new object, and keep the remainder at the front as a smaller free chunk
+        // A remainder too small for any of the bigger objects is left as a hole, until its neighbours die and a sweep coalesces them
+        size_t rest_size = chunk_size - size - sizeof(ObjectHeader);
+        chunk_header->set_size(rest_size);
+        if (rest_size > SIZE_CLASS_LIMIT)
+            push_free_chunk(chunk, rest_size);
+        return chunk + rest_size + sizeof(ObjectHeader);
+    }
+    return nullptr;
+}
+
+void Heap::push_free_chunk(std::byte* chunk, size_t size) {
+    auto& list = free_lists[free_list_index(size)];
+    auto node = reinterpret_cast<FreeChunk*>(chunk);
+    node->next = list;
+    list = node;
 }
 
-ObjectHeader* Heap::find_header(std::byte* object) const {
-    return reinterpret_cast<ObjectHeader*>(object - sizeof(ObjectHeader));
+void Heap::remember(ObjectHeader* header) {
+    if (header->is_flag_set(ObjectHeader::TRACKED_GC_REMEMBERED_BIT))
+        return;
+    header->set_flag(ObjectHeader::TRACKED_GC_REMEMBERED_BIT, true);
+    remembered_set.push_back(header);
 }
 
 void Heap::new_heap_segment() {
-    auto& hg = heap_segments.emplace_back();
-    hg.arena = static_cast<std::byte*>(std::malloc(HEAP_SEGMENT_SIZE));
-    hg.last_object = hg.arena + HEAP_SEGMENT_SIZE;
-    hg.arena_size = HEAP_SEGMENT_SIZE;
+    heap_segments.push_back(map_segment());
+}
+
+HeapSegment Heap::map_segment() {
+    account_committed(HEAP_SEGMENT_SIZE);
+
+    std::byte* arena = nullptr;
+    if (!released_segments.empty()) {
+        arena = released_segments.back();
+        released_segments.pop_back();
+        cold_segments = std::min(cold_segments, released_segments.size());
+        released_low_water = std::min(released_low_water, released_segments.size());
+    } else if (static_cast<size_t>(reserved_range + reserved_size - next_segment) >= HEAP_SEGMENT_SIZE) {
+        arena = next_segment;
+        next_segment += HEAP_SEGMENT_SIZE;
+    }
+    // Only a collection gets past the limit, by less than the headroom reserved for it, so running out of address range is fatal like anything
+    // that fails halfway through one; the system refusing to commit memory otherwise leaves the heap as it was
+    if (arena == nullptr || !commit_pages(arena, HEAP_SEGMENT_SIZE)) {
+        committed_bytes -= HEAP_SEGMENT_SIZE;
+        if (arena != nullptr)
+            released_segments.push_back(arena);
+        auto msg = arena == nullptr ? std::string("the address range reserved for the heap is used up")
+                                    : std::format("unable to commit {} bytes for a heap segment", HEAP_SEGMENT_SIZE);
+        throw OutOfMemoryException{ .msg = std::move(msg), .fatal = collecting };
+    }
+
+    return HeapSegment{
+        .arena = arena,
+        .last_object = arena + HEAP_SEGMENT_SIZE,
+        .arena_size = HEAP_SEGMENT_SIZE,
+    };
+}
+
+void Heap::unmap_segment(const HeapSegment& hg) {
+    committed_bytes -= hg.arena_size;
+    if (hg.large_object) {
+        release_address_range(hg.arena, hg.arena_size);
+    } else {
+        released_segments.push_back(hg.arena);
+    }
+}
+
+void Heap::account_committed(size_t size) {
+    if (!collecting && committed_bytes + size > config.max_bytes)
+        throw OutOfMemoryException(std::format("unable to take {} more bytes, the heap takes {} bytes out of its limit of {}", size, committed_bytes, config.max_bytes));
+    committed_bytes += size;
+    stats.peak_heap_bytes = std::max(stats.peak_heap_bytes, committed_bytes);
+}
+
+HeapSnapshot Heap::take_snapshot() const {
+    HeapSnapshot res{
+        .nursery_segments = nursery_segments.size(),
+        .segment_size = HEAP_SEGMENT_SIZE,
+        .committed_bytes = committed_bytes,
+        .max_bytes = config.max_bytes,
+        .live_bytes_at_last_gc = live_bytes,
+    };
+
+    auto count_object = [&](ObjectHeader* header) {
+        size_t bytes = sizeof(ObjectHeader) + header->get_size();
+        auto& count = res.types[std::to_underlying(header->get_type())];
+        count.objects += 1;
+        count.bytes += bytes;
+        return bytes;
+    };
+
+    for (auto& hg : heap_segments) {
+        if (hg.large_object) {
+            walk_segment(hg, [&](ObjectHeader* header, std::byte*) { count_object(header); });
+            res.large_objects += 1;
+            res.large_object_bytes += hg.arena_size;
+            continue;
+        }
+
+        res.old_segments += 1;
+        if (hg.slot_size != 0)
+            res.old_size_class_segments += 1;
+        size_t object_bytes = 0;
+        walk_segment(hg, [&](ObjectHeader* header, std::byte*) {
+            size_t bytes = count_object(header);
+            if (header->get_type() == ObjectType::TYPE_FREE)
+                res.old_free_bytes += bytes;
+            else
+                object_bytes += bytes;
+        });
+        res.old_object_bytes += object_bytes;
+        res.old_unused_bytes += hg.last_object - hg.arena;
+        size_t quarter = std::min<size_t>(object_bytes * 4 / hg.arena_size, res.old_segments_by_occupancy.size() - 1);
+        res.old_segments_by_occupancy[quarter] += 1;
+    }
+
+    for (auto& hg : nursery_segments) {
+        walk_segment(hg, [&](ObjectHeader* header, std::byte*) {
+            res.nursery_object_bytes += count_object(header);
+        });
+    }
+
+    return res;
+}
+
+void Heap::collect_nursery() {
+    stats.minor_collections += 1;
+    collecting = true;
+
+    // Young objects referenced from the native stack can't be moved, because we can't tell whether the word really is a pointer and hence can't update it.
+    // Instead, their whole segment is kept and promoted in place.
+    std::vector<HeapSegment*> pinned;
+    scan_native_stack(stack_top, nursery_segments, [&](HeapSegment& hg, ObjectHeader* header) {
+        if (std::ranges::find(pinned, &hg) == pinned.end())
+            pinned.push_back(&hg);
+        mark_object(find_object(header));
+    });
+    auto is_pinned = [&](const std::byte* obj) {
+        return std::ranges::any_of(pinned, [&](HeapSegment* hg) {
+            return obj >= hg->arena && obj < hg->arena + hg->arena_size;
+        });
+    };
+
+    auto evacuate_reference = [&](auto& ref) {
+        auto target = reference_target(ref);
+        if (target == nullptr)
+            return;
+
+        auto header = find_header(static_cast<std::byte*>(target));
+        if (!header->is_flag_set(ObjectHeader::TRACKED_GC_YOUNG_BIT))
+            return;
+        if (header->is_flag_set(ObjectHeader::TRACKED_GC_FORWARDED_BIT)) {
+            update_reference(ref, *reinterpret_cast<std::byte**>(target));
+            return;
+        }
+        if (is_pinned(static_cast<std::byte*>(target))) {
+            mark_object(target);
+            return;
+        }
+
+        // Copy the object into the old generation, leaving a forwarding pointer behind
+        auto src = static_cast<std::byte*>(target);
+        size_t size = header->get_size();
+        auto dst = allocate_in_old_segments(size);
+        auto dst_header = find_header(dst);
+        dst_header->init(size, header->get_alignment(), header->get_type(), 0);
+        relocate_object(header, src, dst);
+        header->set_flag(ObjectHeader::TRACKED_GC_FORWARDED_BIT, true);
+        *reinterpret_cast<std::byte**>(src) = dst;
+
+        update_reference(ref, dst);
+        mark_stack.push_back(dst_header);
+    };
+
+    for (auto name : env->globals)
+        evacuate_reference(name->global_value);
+    evacuate_reference(env->curr_scope);
+    clear_unused_stack_scopes();
+    for (auto s : env->stack_scopes | std::views::take(env->stack_scope_count)) {
+        evacuate_reference(s->prev);
+        for (auto& value : s->slots)
+            evacuate_reference(value);
+    }
+    for (auto& value : env->vm_stack)
+        evacuate_reference(value);
+    for (auto& frame : env->vm_frames) {
+        evacuate_reference(frame.code);
+        evacuate_reference(frame.scope);
+    }
+    for (auto header : remembered_set) {
+        header->set_flag(ObjectHeader::TRACKED_GC_REMEMBERED_BIT, false);
+        visit_references(header, find_object(header), evacuate_reference);
+    }
+    remembered_set.clear();
+
+    while (!mark_stack.empty()) {
+        auto header = mark_stack.back();
+        mark_stack.pop_back();
+        visit_references(header, find_object(header), evacuate_reference);
+    }
+
+    // Everything left behind in moved-out-of segments is dead
+    for (auto header : young_destructibles) {
+        auto obj = find_object(header);
+        if (!header->is_flag_set(ObjectHeader::TRACKED_GC_FORWARDED_BIT) && !is_pinned(obj))
+            destroy_object(header, obj);
+    }
+    young_destructibles.clear();
+
+    for (auto& hg : nursery_segments) {
+        if (std::ranges::find(pinned, &hg) != pinned.end()) {
+            bytes_since_gc += sweep_segment(hg);
+            heap_segments.push_back(hg);
+            hg = map_segment();
+        } else {
+            hg.last_object = hg.arena + hg.arena_size;
+        }
+    }
+    nursery = &nursery_segments.front();
+    collecting = false;
+}
+
+void Heap::collect_garbage() {
+    collect_nursery();
+    collect_old_generation();
+}
+
+void Heap::collect_old_generation() {
+    stats.major_collections += 1;
+    collecting = true;
+
+    auto mark_reference = [&](auto& ref) {
+        mark_object(reference_target(ref));
+    };
+
+    // Precise roots
+    for (auto name : env->globals)
+        mark_reference(name->global_value);
+    mark_reference(env->curr_scope);
+    // Unused stack scopes are kept alive too, up to a few, to serve the next calls
+    clear_unused_stack_scopes();
+    auto& stack_scopes = env->stack_scopes;
+    stack_scopes.resize(std::min(stack_scopes.size(), env->stack_scope_count + GC_RETAINED_STACK_SCOPES));
+    for (auto s : stack_scopes)
+        mark_object(s);
+    for (auto& value : env->vm_stack)
+        mark_reference(value);
+    for (auto& frame : env->vm_frames) {
+        mark_reference(frame.code);
+        mark_reference(frame.scope);
+    }
+
+    // Temporaries of builtins and callers up the C++ stack, e.g. the Bytecode being compiled
+    scan_native_stack(stack_top, heap_segments, [&](HeapSegment&, ObjectHeader* header) {
+        mark_object(find_object(header));
+    });
+
+    while (!mark_stack.empty()) {
+        auto header = mark_stack.back();
+        mark_stack.pop_back();
+        visit_references(header, find_object(header), mark_reference);
+    }
+
+    live_bytes = 0;
+    free_lists.fill(nullptr);
+    for (auto& hg : heap_segments)
+        live_bytes += sweep_segment(hg);
+
+    // Segments released by the previous collection and not reused since are likely not needed anymore; decommitting them right away would only have
+    // the next allocations fault their pages back in. Segments smaller than a page, e.g. with 64 KiB pages, share theirs with neighbours and are kept as they are.
+    if (HEAP_SEGMENT_SIZE % SYSTEM_PAGE_SIZE == 0) {
+        for (auto arena : std::span(released_segments).subspan(cold_segments, released_low_water - cold_segments))
+            decommit_pages(arena, HEAP_SEGMENT_SIZE);
+    }
+    cold_segments = released_low_water;
+
+    // Give completely empty segments back to the system, except for a few to serve the next allocations, unless the heap is past its limit,
+    // and those making up its initial size. Large objects always go, as their mapping fits no other.
+    size_t n_empty = 0;
+    std::erase_if(heap_segments, [&](const HeapSegment& hg) {
+        if (hg.last_object != hg.arena + hg.arena_size)
+            return false;
+        if (!hg.large_object && (committed_bytes <= config.initial_bytes || (++n_empty <= GC_RETAINED_EMPTY_SEGMENTS && committed_bytes <= config.max_bytes)))
+            return false;
+        unmap_segment(hg);
+        return true;
+    });
+    curr_segments.fill(0);
+    released_low_water = released_segments.size();
+
+    bytes_since_gc = 0;
+    gc_threshold = std::max({ GC_MIN_THRESHOLD, config.initial_bytes, live_bytes });
+    collecting = false;
+}
+
+void Heap::clear_unused_stack_scopes() {
+    // They hold whatever their last user left, which may not even be valid objects anymore, as they were not traced since
+    for (auto s : env->stack_scopes | std::views::drop(env->stack_scope_count)) {
+        s->prev = HeapPtr<Scope>();
+        s->slots.clear();
+    }
+}
+
+void Heap::mark_object(void* obj) {
+    if (obj == nullptr)
+        return;
+
+    auto header = find_header(static_cast<std::byte*>(obj));
+    if (header->is_flag_set(ObjectHeader::TRACKED_GC_MARK_BIT))
+        return;
+    header->set_flag(ObjectHeader::TRACKED_GC_MARK_BIT, true);
+    mark_stack.push_back(header);
+}
+
+size_t Heap::sweep_segment(HeapSegment& hg) {
+    size_t segment_live_bytes = 0;
+    auto end = hg.arena + hg.arena_size;
+
+    // Consecutive dead objects are coalesced into one free chunk, starting at `dead_begin`
+    std::byte* dead_begin = nullptr;
+    auto flush_dead = [&](std::byte* dead_end) {
+        if (dead_begin == hg.last_object) {
+            // Dead objects at the bottom of the segment are simply given back to the bump allocator
+            hg.last_object = dead_end;
+        } else {
+            size_t size = dead_end - dead_begin - sizeof(ObjectHeader);
+            auto header = reinterpret_cast<ObjectHeader*>(dead_begin);
+            header->init(size, alignof(FreeChunk), ObjectType::TYPE_FREE, 0);
+            // Small chunks between the objects of a mixed segment are left as holes, as only bigger objects are allocated there
+            if (hg.slot_size != 0 || size > SIZE_CLASS_LIMIT)
+                push_free_chunk(find_object(header), size);
+        }
+        dead_begin = nullptr;
+    };
+
+    auto curr = hg.last_object;
+    while (curr < end) {
+        auto header = reinterpret_cast<ObjectHeader*>(curr);
+        auto obj = curr + sizeof(ObjectHeader);
+        auto next = obj + header->get_size();
+
+        if (header->is_flag_set(ObjectHeader::TRACKED_GC_MARK_BIT)) {
+            header->set_flag(ObjectHeader::TRACKED_GC_MARK_BIT, false);
+            // For segments promoted in place
+            header->set_flag(ObjectHeader::TRACKED_GC_YOUNG_BIT, false);
+            segment_live_bytes += next - curr;
+            if (dead_begin)
+                flush_dead(curr);
+        } else {
+            destroy_object(header, obj);
+            if (!dead_begin)
+                dead_begin = curr;
+            // Slots are not coalesced, so that they stay the size of their class
+            if (hg.slot_size != 0 && dead_begin != hg.last_object)
+                flush_dead(next);
+        }
+
+        curr = next;
+    }
+    if (dead_begin)
+        flush_dead(end);
+
+    return segment_live_bytes;
 }
 
 }
@@ -0,0 +1,40 @@
+// This file should only contain macros
+#pragma once
+
+// X-macro listing every bytecode instruction, so that the Opcode enum and the VM's dispatch table are generated from the same list.
+// Operands are unsigned 16-bit integers following the opcode byte, noted in the comment of each instruction.
+// CALL_BUILTIN and the primitive instructions, from ADD on, call the builtin constants[k]; if its global no longer holds it, they call that instead.
+#define TOYSCHEME_OPCODES(X)                                                                \
+    X(CONST)         /* k: push constants[k] */                                             \
+    X(NIL)           /* push '() */                                                         \
+    X(LOCAL)         /* depth slot: push the local variable */                              \
+    X(LOCAL_0)       /* slot: same as LOCAL, for a depth of 0 */                            \
+    X(SET_LOCAL)     /* depth slot: pop into the local variable */                          \
+    X(GLOBAL)        /* k: push the global variable named by the symbol constants[k] */     \
+    X(SET_GLOBAL)    /* k: pop into the global variable, if it is defined */                \
+    X(DEFINE_GLOBAL) /* k: pop into the global variable, defining it if needed */           \
+    X(POP)           /* discard the top of the stack */                                     \
+    X(JUMP)          /* target: continue at the offset `target` */                          \
+    X(JUMP_IF_FALSE) /* target: pop, and jump if it is #f */                                \
+    X(CLOSURE)       /* k: push a proc running the Bytecode constants[k] in this scope */   \
+    X(CALL)          /* n: pop the proc, and call it with the n arguments below it */       \
+    X(TAIL_CALL)     /* n: same as CALL, but the proc returns straight to our caller */     \
+    X(CALL_BUILTIN)  /* k n: call the builtin constants[k] with the n arguments on top */   \
+    X(RETURN)        /* pop the result, and return to the caller */                         \
+    X(ENTER_SCOPE)   /* n: pop n values into the first slots of a new nested scope */       \
+    X(LEAVE_SCOPE)   /* go back to the enclosing scope */                                   \
+    X(ENTER_STACK_SCOPE) /* n: same as ENTER_SCOPE, with a scope of the stack scopes */     \
+    X(LEAVE_STACK_SCOPE) /* same as LEAVE_SCOPE, popping the stack scope */                 \
+    X(ADD)           /* k n: pop n numbers and push their sum, same for the other operators */ \
+    X(SUB)           /* k n */                                                              \
+    X(MUL)           /* k n */                                                              \
+    X(DIV)           /* k n */                                                              \
+    X(NUM_EQ)        /* k n */                                                              \
+    X(LT)            /* k n */                                                              \
+    X(LE)            /* k n */                                                              \
+    X(GT)            /* k n */                                                              \
+    X(GE)            /* k n */                                                              \
+    X(CAR)           /* k */                                                                \
+    X(CDR)           /* k */                                                                \
+    X(CONS)          /* k */                                                                \
+    X(IS_NULL)       /* k */
@@ -0,0 +1,170 @@
+module toyscheme;
+import std;
+
+using namespace std::literals;
+
+namespace toyscheme {
+
+void Profiler::add_source(std::string_view text, std::string name) {
+    _sources.push_back(Source{ .text = text, .name = std::move(name) });
+}
+
+const char* Profiler::find_form_position(const Sexp* form_head) const {
+    auto iter = _form_positions.find(form_head);
+    return iter != _form_positions.end() ? iter->second : nullptr;
+}
+
+std::string Profiler::describe_position(const char* pos) {
+    for (auto& source : _sources) {
+        auto begin = source.text.data();
+        if (pos < begin || pos >= begin + source.text.size())
+            continue;
+
+        if (source.line_starts.empty()) {
+            source.line_starts.push_back(0);
+            for (size_t i = source.text.find('\n'); i != std::string_view::npos; i = source.text.find('\n', i + 1))
+                source.line_starts.push_back(i + 1);
+        }
+        auto offset = static_cast<size_t>(pos - begin);
+        auto line = std::ranges::upper_bound(source.line_starts, offset) - source.line_starts.begin();
+        return std::format("{}:{}", source.name, line);
+    }
+    return {};
+}
+
+uint32_t Profiler::find_proc(std::string label) {
+    auto [iter, inserted] = _proc_ids.try_emplace(label, static_cast<uint32_t>(_procs.size()));
+    if (inserted)
+        _procs.push_back(Proc{ .label = std::move(label) });
+    return iter->second;
+}
+
+void Profiler::enter(Bytecode& code, const Heap& heap) {
+    if (code.profile_id == 0) {
+        std::string label;
+        if (code.name != nullptr && !code.name->empty()) {
+            label = *code.name;
+        } else if (code.source_pos != nullptr) {
+            auto where = describe_position(code.source_pos);
+            label = where.empty() ? "<lambda>"s : std::format("<lambda@{}>", where);
+        } else {
+            label = "<lambda>"s;
+        }
+        code.profile_id = find_proc(std::move(label)) + 1;
+    }
+    enter_proc(code.profile_id - 1, heap);
+}
+
+void Profiler::enter_toplevel(const Heap& heap) {
+    if (_toplevel_id == NO_PROC)
+        _toplevel_id = find_proc("<toplevel>"s);
+    enter_proc(_toplevel_id, heap);
+}
+
+void Profiler::enter(const BuiltinProc& proc, const Heap& heap) {
+    auto [iter, inserted] = _builtin_ids.try_emplace(proc.name, 0);
+    if (inserted)
+        iter->second = find_proc(std::string(*proc.name));
+    enter_proc(iter->second, heap);
+}
+
+void Profiler::enter_proc(uint32_t proc, const Heap& heap) {
+    // Direct recursion stays in the same stack node, so that deep recursion doesn't make for a tall flame graph of the same proc
+    uint32_t parent = _frames.empty() ? NO_NODE : _frames.back().node;
+    uint32_t node;
+    if (parent != NO_NODE && _nodes[parent].proc == proc) {
+        node = parent;
+    } else {
+        auto key = (static_cast<uint64_t>(parent) << 32) | proc;
+        auto [iter, inserted] = _children.try_emplace(key, static_cast<uint32_t>(_nodes.size()));
+        if (inserted)
+            _nodes.push_back(StackNode{ .proc = proc, .parent = parent });
+        node = iter->second;
+    }
+
+    auto& p = _procs[proc];
+    p.calls += 1;
+    p.active += 1;
+    _frames.push_back(Frame{
+        .node = node,
+        .start = Clock::now(),
+        .start_alloc_bytes = heap.get_stats().allocated_bytes,
+    });
+}
+
+void Profiler::leave(const Heap& heap) {
+    auto now = Clock::now();
+    auto frame = _frames.back();
+    _frames.pop_back();
+
+    auto elapsed = now - frame.start;
+    auto alloc_bytes = heap.get_stats().allocated_bytes - frame.start_alloc_bytes;
+    auto self_time = elapsed - frame.child_time;
+
+    auto& node = _nodes[frame.node];
+    node.self_time += self_time;
+    auto& p = _procs[node.proc];
+    p.self_time += self_time;
+    p.self_alloc_bytes += alloc_bytes - frame.child_alloc_bytes;
+    p.active -= 1;
+    if (p.active == 0) {
+        p.total_time += elapsed;
+        p.total_alloc_bytes += alloc_bytes;
+    }
+
+    if (!_frames.empty()) {
+        _frames.back().child_time += elapsed;
+        _frames.back().child_alloc_bytes += alloc_bytes;
+    }
+}
+
+void Profiler::leave_to(size_t depth, const Heap& heap) {
+    while (_frames.size() > depth)
+        leave(heap);
+}
+
+void Profiler::print_report(std::ostream& out, size_t top_n) const {
+    std::vector<const Proc*> procs;
+    uint64_t calls = 0;
+    Clock::duration time{};
+    for (auto& p : _procs) {
+        procs.push_back(&p);
+        calls += p.calls;
+        time += p.self_time;
+    }
+    std::ranges::sort(procs, std::greater<>{}, &Proc::self_time);
+
+    auto to_ms = [](Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    out << std::format("profile: {} calls of {} procs, {:.3f} ms in total\n", calls, procs.size(), to_ms(time));
+    out << std::format("{:<32} {:>12} {:>12} {:>12} {:>14} {:>14}\n", "proc", "calls", "total ms", "self ms", "total alloc", "self alloc");
+    for (auto p : procs | std::views::take(top_n)) {
+        out << std::format("{:<32} {:>12} {:>12.3f} {:>12.3f} {:>14} {:>14}\n",
+                           p->label, p->calls, to_ms(p->total_time), to_ms(p->self_time), p->total_alloc_bytes, p->self_alloc_bytes);
+    }
+}
+
+void Profiler::write_folded_stacks(std::ostream& out) const {
+    std::vector<uint32_t> path;
+    std::string line;
+    for (uint32_t i = 0; i < _nodes.size(); ++i) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(_nodes[i].self_time).count();
+        if (us <= 0)
+            continue;
+
+        path.clear();
+        for (uint32_t n = i; n != NO_NODE; n = _nodes[n].parent)
+            path.push_back(n);
+
+        line.clear();
+        for (auto n : path | std::views::reverse) {
+            // Frames are separated by semicolons, and the count follows the last space
+            for (char c : _procs[_nodes[n].proc].label)
+                line += c == ';' || c == ' ' ? '_' : c;
+            line += ';';
+        }
+        line.back() = ' ';
+        out << line << us << '\n';
+    }
+}
+
+} // namespace toyscheme
@@ -0,0 +1,814 @@
+module;
+#include "util.hpp"
+#include <cassert>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+// The lexer classifies a block of source bytes at a time. SSE2 is part of the x86-64 baseline, AVX2 is only used if the build targets it.
+#    define TOYSCHEME_SIMD_SCAN 1
+#    include <immintrin.h>
+#else
+#    define TOYSCHEME_SIMD_SCAN 0
+#endif
+
+module toyscheme;
+import std;
+
+using namespace std::literals;
+
+namespace toyscheme {
+
+namespace {
+/******** Scanning ********/
+// Finding where runs of whitespace, tokens, strings and comments end, the bulk of what lexing does.
+// Characters are classified as in the "C" locale, without going through std::isspace() and its locale.
+
+bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+bool is_token_separator(char c) {
+    return is_space(c) || c == '(' || c == ')';
+}
+
+#if TOYSCHEME_SIMD_SCAN
+struct Simd {
+#    if defined(__AVX2__)
+    using Vec = __m256i;
+    static constexpr size_t WIDTH = 32;
+
+    static Vec load(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static Vec splat(char c) { return _mm256_set1_epi8(c); }
+    static Vec eq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+    static Vec gt(Vec a, Vec b) { return _mm256_cmpgt_epi8(a, b); }
+    static Vec or_(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+    static Vec and_(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+    static uint32_t mask(Vec v) { return static_cast<uint32_t>(_mm256_movemask_epi8(v)); }
+#    else
+    using Vec = __m128i;
+    static constexpr size_t WIDTH = 16;
+
+    static Vec load(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static Vec splat(char c) { return _mm_set1_epi8(c); }
+    static Vec eq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+    static Vec gt(Vec a, Vec b) { return _mm_cmpgt_epi8(a, b); }
+    static Vec or_(Vec a, Vec b) { return _mm_or_si128(a, b); }
+    static Vec and_(Vec a, Vec b) { return _mm_and_si128(a, b); }
+    static uint32_t mask(Vec v) { return static_cast<uint32_t>(_mm_movemask_epi8(v)); }
+#    endif
+
+    static constexpr uint32_t ALL = WIDTH == 32 ? ~uint32_t(0) : (uint32_t(1) << WIDTH) - 1;
+
+    /// Bit set for each byte that is_space(). Compares are signed, so bytes over 0x7F never fall in the '\t'..'\r' range.
+    static uint32_t spaces(Vec v) {
+        Vec ctrl = and_(gt(v, splat('\t' - 1)), gt(splat('\r' + 1), v));
+        return mask(or_(eq(v, splat(' ')), ctrl));
+    }
+};
+
+/// Returns the index of the first byte of `src` from `i` on that `match` flags, checking a whole Simd::Vec at a time.
+/// If there is none, returns where less than a Simd::Vec is left, for the caller to check those bytes one by one.
+template <typename Matcher>
+size_t find_first_in_blocks(std::string_view src, size_t i, Matcher match) {
+    while (i + Simd::WIDTH <= src.size()) {
+        if (uint32_t m = match(Simd::load(src.data() + i)))
+            return i + std::countr_zero(m);
+        i += Simd::WIDTH;
+    }
+    return i;
+}
+#endif
+
+size_t skip_spaces(std::string_view src, size_t i) {
+#if TOYSCHEME_SIMD_SCAN
+    i = find_first_in_blocks(src, i, [](Simd::Vec v) { return Simd::spaces(v) ^ Simd::ALL; });
+#endif
+    while (i < src.size() && is_space(src[i]))
+        i += 1;
+    return i;
+}
+
+size_t find_token_end(std::string_view src, size_t i) {
+#if TOYSCHEME_SIMD_SCAN
+    i = find_first_in_blocks(src, i, [](Simd::Vec v) {
+        auto parens = Simd::or_(Simd::eq(v, Simd::splat('(')), Simd::eq(v, Simd::splat(')')));
+        return Simd::spaces(v) | Simd::mask(parens);
+    });
+#endif
+    while (i < src.size() && !is_token_separator(src[i]))
+        i += 1;
+    return i;
+}
+
+/// Finds the closing quote of a string literal, or the escape sequence before it
+size_t find_string_special(std::string_view src, size_t i) {
+#if TOYSCHEME_SIMD_SCAN
+    i = find_first_in_blocks(src, i, [](Simd::Vec v) {
+        return Simd::mask(Simd::or_(Simd::eq(v, Simd::splat('"')), Simd::eq(v, Simd::splat('\\'))));
+    });
+#endif
+    while (i < src.size() && src[i] != '"' && src[i] != '\\')
+        i += 1;
+    return i;
+}
+
+size_t find_line_end(std::string_view src, size_t i) {
+    // A single character search, that the standard library already vectorizes
+    return std::min(src.find('\n', i), src.size());
+}
+
+/******** Lexing ********/
+
+/// Splits source text into Lexemes, one top-level form at a time
+class Lexer {
+public:
+    /* ---- Inputs ---- */
+    /* Initialize them with aggregate initialization, and then call lex_next_form() */
+    LexedSource* out;
+    /// Where in `out->src` to lex from next
+    size_t cursor;
+
+    /// Skips what separates top-level forms: whitespace, comments, and stray closing parens, that are ignored
+    void skip_blanks() {
+        auto src = out->src;
+        while (cursor < src.size()) {
+            if (is_space(src[cursor]))
+                cursor = skip_spaces(src, cursor + 1);
+            else if (src[cursor] == ';')
+                cursor = find_line_end(src, cursor);
+            else if (src[cursor] == ')')
+                cursor += 1;
+            else
+                break;
+        }
+    }
+
+    /// Lexes the next top-level form into `out`, unless it starts at or after `stop`.
+    /// Returns false if there is none, or if it fails to lex, in which case `out->error` says why.
+    bool lex_next_form(size_t stop) {
+        skip_blanks();
+        out->end = cursor;
+        if (cursor >= stop || cursor >= out->src.size())
+            return false;
+
+        size_t lexeme_count = out->lexemes.size();
+        size_t decoded_size = out->decoded.size();
+        try {
+            lex_form();
+        } catch (const ParseException& e) {
+            // Leave nothing of the form behind, so that `out` ends with the last form that lexed
+            out->lexemes.resize(lexeme_count);
+            out->decoded.resize(decoded_size);
+            out->error = e.msg;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // Defined out of line to reduce indentation
+    void lex_form();
+
+    void push(Lexeme::Kind kind) {
+        out->lexemes.push_back({ .kind = kind });
+    }
+
+    void push_text(Lexeme::Kind kind, size_t offset, size_t size) {
+        if (size > std::numeric_limits<uint32_t>::max())
+            throw ParseException("string literal or symbol too long"s);
+        Lexeme& lexeme = out->lexemes.emplace_back(Lexeme{ .kind = kind, .size = static_cast<uint32_t>(size) });
+        lexeme.offset = offset;
+    }
+
+    std::string_view take_token() {
+        size_t begin = cursor;
+        cursor = find_token_end(out->src, cursor);
+        return out->src.substr(begin, cursor - begin);
+    }
+
+    void lex_string() {
+        auto src = out->src;
+        cursor += 1;
+
+        // Jump from one escape sequence to the next, until the closing quote
+        size_t escape_count = 0;
+        size_t str_begin = cursor;
+        while (true) {
+            cursor = find_string_special(src, cursor);
+            if (cursor >= src.length())
+                throw ParseException("unexpected EOF while parsing string"s);
+            if (src[cursor] == '"')
+                break;
+
+            // An escape sequence, two characters that stand for one
+            escape_count += 1;
+            cursor += 2;
+        }
+        size_t str_end = cursor;
+        cursor += 1;
+
+        // Without escape sequences, the characters are the same as in the source
+        if (escape_count == 0) {
+            push_text(Lexeme::STRING, str_begin, str_end - str_begin);
+            return;
+        }
+
+        auto& str = out->decoded;
+        size_t decoded_begin = str.size();
+        str.reserve(decoded_begin + (str_end - str_begin - escape_count));
+
+        size_t i = str_begin;
+        while (i < str_end) {
+            if (src[i] != '\\') {
+                str.push_back(src[i]);
+                i += 1;
+                continue;
+            }
+
+            char esc = src[i + 1];
+            i += 2;
+            switch (esc) {
+                case 'n': str.push_back('\n'); break;
+                case '\\': str.push_back('\\'); break;
+                default: throw ParseException(std::format("invalid escaped char '{}'", esc));
+            }
+        }
+
+        push_text(Lexeme::DECODED_STRING, decoded_begin, str.size() - decoded_begin);
+    }
+
+    /// Lexes #-syntax: booleans, and the opening paren of vector literals, in which case returns true
+    bool lex_hash() {
+        auto src = out->src;
+        cursor += 1;
+        if (cursor >= src.length())
+            throw ParseException("unexpected EOF while parsing #-symbols"s);
+
+        // Vector literals: #(...), or #s64(...) and #f64(...) for numeric vectors
+        if (src[cursor] == '(') {
+            push(Lexeme::OPEN_VECTOR);
+            cursor += 1;
+            return true;
+        }
+
+        auto token = take_token();
+        if (cursor < src.length() && src[cursor] == '(') {
+            if (token == "s64"sv)
+                push(Lexeme::OPEN_INT_VECTOR);
+            else if (token == "f64"sv)
+                push(Lexeme::OPEN_FLOAT_VECTOR);
+            else
+                throw ParseException("invalid #-symbol"s);
+            cursor += 1;
+            return true;
+        }
+
+        if (token == "t"sv)
+            push(Lexeme::TRUE);
+        else if (token == "f"sv)
+            push(Lexeme::FALSE);
+        else
+            throw ParseException("invalid #-symbol"s);
+        return false;
+    }
+
+    /// Lexes a number or a symbol
+    void lex_atom() {
+        size_t begin = cursor;
+        auto token = take_token();
+        if (!try_lex_number(token))
+            push_text(Lexeme::SYMBOL, begin, token.size());
+    }
+
+    /// Pushes the number that `token` spells, if it is one: an exact integer, unless it has a decimal point or an exponent
+    bool try_lex_number(std::string_view token) {
+        // Most tokens are symbols, tell them apart from the first characters without trying to parse them:
+        // numbers start with a digit, optionally after a sign and/or a decimal point
+        size_t digits_begin = token.starts_with('+') || token.starts_with('-') ? 1 : 0;
+        size_t first_digit = token.substr(digits_begin).starts_with('.') ? digits_begin + 1 : digits_begin;
+        if (first_digit >= token.size() || token[first_digit] < '0' || token[first_digit] > '9')
+            return false;
+
+        // std::from_chars() takes a leading -, but not a +
+        auto digits = token[0] == '+' ? token.substr(1) : token;
+        const char* end = digits.data() + digits.size();
+        bool is_decimal = digits.find_first_of(".eE"sv) != std::string_view::npos;
+
+        if (!is_decimal) {
+            int64_t v;
+            auto [rest, ec] = std::from_chars(digits.data(), end, v);
+            if (ec == std::errc() && rest == end) {
+                out->lexemes.push_back({ .kind = Lexeme::INTEGER });
+                out->lexemes.back().integer = v;
+                return true;
+            }
+            // Beyond 64 bits, integers are inexact, like the results of arithmetic that overflows
+            if (ec != std::errc::result_out_of_range)
+                return false;
+        }
+
+        double v;
+        auto [rest, ec] = std::from_chars(digits.data(), end, v);
+        if (ec == std::errc::result_out_of_range)
+            throw ParseException("number literal out of range"s);
+        if (ec != std::errc() || rest != end)
+            return false; // e.g. 1+ or 3rd, symbols that happen to start like numbers
+        out->lexemes.push_back({ .kind = Lexeme::FLOAT });
+        out->lexemes.back().flonum = v;
+        return true;
+    }
+};
+
+void Lexer::lex_form() {
+    auto src = out->src;
+    LexedSource::Form form{ .src_begin = cursor, .first_lexeme = out->lexemes.size() };
+
+    // Quotes are part of the form of the datum they wrap, which ends the form unless it opens a list
+    size_t depth = 0;
+    while (cursor < src.length()) {
+        char c = src[cursor];
+        if (is_space(c)) {
+            cursor = skip_spaces(src, cursor + 1);
+            continue;
+        }
+        if (c == ';') {
+            cursor = find_line_end(src, cursor);
+            continue;
+        }
+
+        if (c == '\'' || c == ',' || c == '`') {
+            push(c == '\'' ? Lexeme::QUOTE : c == ',' ? Lexeme::UNQUOTE : Lexeme::QUASIQUOTE);
+            cursor += 1;
+            continue;
+        }
+
+        if (c == '(') {
+            push(Lexeme::OPEN_LIST);
+            depth += 1;
+            cursor += 1;
+            continue;
+        }
+
+        if (c == ')') {
+            cursor += 1;
+            // A stray ) between quotes and what they wrap is ignored, as at the top-level
+            if (depth == 0)
+                continue;
+            push(Lexeme::CLOSE);
+            depth -= 1;
+        } else if (c == '"') {
+            lex_string();
+        } else if (c == '#') {
+            if (lex_hash()) {
+                depth += 1;
+                continue;
+            }
+        } else {
+            lex_atom();
+        }
+
+        if (depth == 0) {
+            out->forms.push_back(form);
+            return;
+        }
+    }
+
+    // Quotes at the end of the source have nothing to wrap, and are dropped
+    if (depth == 0) {
+        out->lexemes.resize(form.first_lexeme);
+        return;
+    }
+    // Lists left open at the end of the source are closed implicitly
+    for (; depth > 0; --depth)
+        push(Lexeme::CLOSE);
+    out->forms.push_back(form);
+}
+
+/// Lexes the top-level forms of `out.src` from `begin` on, until one starts at or after `stop`, or one fails to lex
+void lex_forms(LexedSource& out, size_t begin, size_t stop) {
+    Lexer lexer{ .out = &out, .cursor = begin };
+    while (lexer.lex_next_form(stop)) {}
+}
+
+/******** Parsing ********/
+
+/// Builds the Sexps of lexed forms, on the heap of `env`
+class SexpParser {
+public:
+    /* ---- Inputs ---- */
+    /* Initalize them with aggregate initilization, and then call parse_form() */
+    Environment* env;
+    const LexedSource* lexed;
+    /// Whether the text of `lexed` lives as long as `env`, see parse_sexp()
+    bool borrow_src = false;
+
+private:
+    /* ---- State Variables ---- */
+    /// A list still being parsed
+    struct OpenList {
+        /// Index of its first item in `items`
+        size_t first_item;
+        /// The wrapper the list shall be wrapped in once it is closed, see `next_sexp_wrapper`
+        const Symbol* wrapper;
+        /// What the items are gathered into once it is closed: TYPE_COMPACT_LIST, or one of the vector types for #(...) literals
+        ObjectType type;
+        /// Where its head is in the source text, if it is a (lambda) or (define) form and we are profiling, see Profiler::note_form_position()
+        const char* head_pos = nullptr;
+    };
+    /// Every list we are in, the innermost one last
+    std::vector<OpenList> open_lists;
+    /// Items parsed so far in each list of `open_lists`, and at the top-level, back to back.
+    /// Once a list is closed, its items are moved into a CompactList. In the mean time, they are kept on the VM stack, where the garbage collector sees them.
+    std::vector<Sexp>* items;
+    /// If not null, the next sexp `x` produced by the parser loop shall be rewritten as `(wrapper x)`
+    const Symbol* next_sexp_wrapper = nullptr;
+
+public:
+    // Defined out of line to reduce indentation
+    /// Builds the form at `form_index` in `lexed->forms`
+    Sexp parse_form(size_t form_index);
+
+private:
+    void push_sexp(Sexp val) {
+        if (next_sexp_wrapper != nullptr) {
+            const Sexp wrapped[] = { Sexp(*next_sexp_wrapper), val };
+            val = make_compact_list(wrapped, *env, true);
+        }
+
+        items->push_back(val);
+        next_sexp_wrapper = nullptr;
+    }
+
+    void enter_nesting(ObjectType type = ObjectType::TYPE_COMPACT_LIST) {
+        // The wrapper applies to the whole nested list, not to its first item
+        open_lists.push_back({ .first_item = items->size(), .wrapper = next_sexp_wrapper, .type = type });
+        next_sexp_wrapper = nullptr;
+    }
+
+    void leave_nesting() {
+        auto list = open_lists.back();
+        open_lists.pop_back();
+
+        auto list_items = std::span(*items).subspan(list.first_item);
+        Sexp val;
+        if (list.type == ObjectType::TYPE_COMPACT_LIST) {
+            val = make_compact_list(list_items, *env, true);
+        } else {
+            try {
+                val = make_vector(list_items, list.type, *env, true);
+            } catch (const EvalException& e) {
+                throw ParseException(e.msg);
+            }
+        }
+        items->resize(list.first_item);
+        next_sexp_wrapper = list.wrapper;
+        push_sexp(val);
+
+        if (list.head_pos != nullptr)
+            env->profiler->note_form_position(as_pair(val).car, list.head_pos);
+    }
+
+    /// Whether the next sexp is the first item of a list
+    bool is_list_head() const {
+        return !open_lists.empty() && open_lists.back().type == ObjectType::TYPE_COMPACT_LIST && items->size() == open_lists.back().first_item
+            && next_sexp_wrapper == nullptr;
+    }
+
+    void push_string(std::string_view text, bool borrow) {
+        auto [h_str, _] = env->heap.allocate_old<String>();
+        if (borrow)
+            h_str->borrowed = text;
+        else
+            h_str->v = text;
+        push_sexp(Sexp(h_str));
+    }
+};
+
+Sexp SexpParser::parse_form(size_t form_index) {
+    this->open_lists.clear();
+    this->items = &env->vm_stack;
+    this->next_sexp_wrapper = nullptr;
+
+    size_t form_first_item = items->size();
+    DEFER { items->resize(form_first_item); };
+
+    auto& sym_quote = env->sym_pool.intern("quote");
+    auto& sym_unquote = env->sym_pool.intern("unquote");
+    auto& sym_quasiquote = env->sym_pool.intern("quasiquote");
+
+    auto& forms = lexed->forms;
+    size_t begin = forms[form_index].first_lexeme;
+    size_t end = form_index + 1 < forms.size() ? forms[form_index + 1].first_lexeme : lexed->lexemes.size();
+    for (size_t i = begin; i < end; ++i) {
+        const Lexeme& lexeme = lexed->lexemes[i];
+        switch (lexeme.kind) {
+            case Lexeme::OPEN_LIST: enter_nesting(); break;
+            case Lexeme::OPEN_VECTOR: enter_nesting(ObjectType::TYPE_VECTOR); break;
+            case Lexeme::OPEN_INT_VECTOR: enter_nesting(ObjectType::TYPE_INT_VECTOR); break;
+            case Lexeme::OPEN_FLOAT_VECTOR: enter_nesting(ObjectType::TYPE_FLOAT_VECTOR); break;
+            case Lexeme::CLOSE: leave_nesting(); break;
+
+            case Lexeme::QUOTE: next_sexp_wrapper = &sym_quote; break;
+            case Lexeme::UNQUOTE: next_sexp_wrapper = &sym_unquote; break;
+            case Lexeme::QUASIQUOTE: next_sexp_wrapper = &sym_quasiquote; break;
+
+            case Lexeme::INTEGER: {
+                int64_t v = lexeme.integer;
+                if (v >= std::numeric_limits<int32_t>::min() && v <= std::numeric_limits<int32_t>::max()) {
+                    push_sexp(Sexp(static_cast<int32_t>(v)));
+                } else {
+                    auto [boxed, _] = env->heap.allocate_old<BoxedInt>(v);
+                    push_sexp(Sexp(boxed));
+                }
+            } break;
+            case Lexeme::FLOAT: push_sexp(Sexp(lexeme.flonum)); break;
+            case Lexeme::TRUE: push_sexp(Sexp(true)); break;
+            case Lexeme::FALSE: push_sexp(Sexp(false)); break;
+
+            // Without escape sequences, the characters are the same as in the source, no need to copy them if it lives long enough
+            case Lexeme::STRING: push_string(lexed->src.substr(lexeme.offset, lexeme.size), borrow_src); break;
+            case Lexeme::DECODED_STRING: push_string(std::string_view(lexed->decoded).substr(lexeme.offset, lexeme.size), false); break;
+
+            case Lexeme::SYMBOL: {
+                auto name = lexed->src.substr(lexeme.offset, lexeme.size);
+                const Symbol& h_sym = borrow_src ? env->sym_pool.intern_borrowed(name) : env->sym_pool.intern(name);
+                if (env->profiler && is_list_head() && (name == "lambda"sv || name == "define"sv))
+                    open_lists.back().head_pos = name.data();
+                push_sexp(Sexp(h_sym));
+            } break;
+        }
+    }
+
+    assert(open_lists.empty() && items->size() == form_first_item + 1);
+    return (*items)[form_first_item];
+}
+} // namespace
+
+Sexp parse_sexp(std::string_view src, Environment& env, bool borrow_src) {
+    LexedSource lexed{ .src = src };
+    lex_forms(lexed, 0, src.size());
+    if (lexed.error)
+        throw ParseException(*lexed.error);
+
+    SexpParser parser;
+    parser.env = &env;
+    parser.lexed = &lexed;
+    parser.borrow_src = borrow_src;
+
+    // As if every sexp in the source was inside a giant list enclosing everything
+    auto& items = env.vm_stack;
+    size_t program_first_item = items.size();
+    DEFER { items.resize(program_first_item); };
+    for (size_t i = 0; i < lexed.forms.size(); ++i)
+        items.push_back(parser.parse_form(i));
+
+    return make_compact_list(std::span(items).subspan(program_first_item), env, true);
+}
+
+namespace {
+/// Finds where the top-level form starting at `begin` in `src` ends, without parsing it, to tell whether all its source has been read yet.
+/// Returns std::nullopt if it may go on past the end of `src`, unless `at_eof`, in which case the parser deals with unterminated forms.
+std::optional<size_t> find_form_end(std::string_view src, size_t begin, bool at_eof) {
+    size_t i = begin;
+    size_t depth = 0;
+    auto incomplete = [&]() { return at_eof ? std::optional(src.size()) : std::nullopt; };
+
+    while (i < src.size()) {
+        char c = src[i];
+        if (is_space(c)) {
+            i = skip_spaces(src, i + 1);
+        } else if (c == ';') {
+            i = find_line_end(src, i);
+        } else if (c == '"') {
+            i = find_string_special(src, i + 1);
+            while (i < src.size() && src[i] != '"')
+                i = find_string_special(src, i + 2);
+            if (i >= src.size())
+                return incomplete();
+            i += 1;
+            if (depth == 0)
+                return i;
+        } else if (c == '(') {
+            depth += 1;
+            i += 1;
+        } else if (c == ')') {
+            i += 1;
+            // A stray ) at the top-level ends a form too, that the parser ignores
+            if (depth <= 1)
+                return i;
+            depth -= 1;
+        } else if (c == '\'' || c == ',' || c == '`') {
+            // Quotes wrap the sexp that follows
+            i += 1;
+        } else {
+            // Atoms, and # prefixes of vector literals, split the same way as Lexer::take_token()
+            size_t token_begin = i;
+            i = find_token_end(src, i);
+            // Even at the top-level, an atom at the end of `src` may be continued by what comes next
+            if (i >= src.size())
+                return incomplete();
+            bool is_prefix = src[token_begin] == '#' && src[i] == '(';
+            if (depth == 0 && !is_prefix)
+                return i;
+        }
+    }
+    return incomplete();
+}
+} // namespace
+
+namespace {
+/// Files are split in chunks of at least this size to be lexed ahead, one per thread at most
+constexpr size_t LEX_AHEAD_MIN_CHUNK_SIZE = 256 * 1024;
+
+/// Drops the first `count` forms of `lexed`
+void drop_forms(LexedSource& lexed, size_t count) {
+    if (count == 0)
+        return;
+    size_t first_lexeme = lexed.forms[count].first_lexeme;
+    lexed.lexemes.erase(lexed.lexemes.begin(), lexed.lexemes.begin() + first_lexeme);
+    lexed.forms.erase(lexed.forms.begin(), lexed.forms.begin() + count);
+    for (auto& form : lexed.forms)
+        form.first_lexeme -= first_lexeme;
+}
+
+/// Appends `chunk` to `segments`, the lexemes of a file up to where the last one ends, lexing whatever comes in between into the last one first.
+/// `chunk` was lexed from a guess of where a top-level form starts, that may have been wrong, so its first forms may be wrong too.
+/// But lexing from where a form starts always gives the same forms, so that once a chunk has one that starts where `segments` are at, the rest of it holds.
+void merge_chunk(std::vector<LexedSource>& segments, LexedSource& chunk) {
+    auto& last = segments.back();
+    Lexer lexer{ .out = &last, .cursor = last.end };
+    while (true) {
+        lexer.skip_blanks();
+        last.end = lexer.cursor;
+        if (lexer.cursor > chunk.end)
+            return;
+
+        auto form = std::ranges::lower_bound(chunk.forms, lexer.cursor, {}, &LexedSource::Form::src_begin);
+        if (form != chunk.forms.end() && form->src_begin == lexer.cursor) {
+            drop_forms(chunk, form - chunk.forms.begin());
+            segments.push_back(std::move(chunk));
+            return;
+        }
+        if (lexer.cursor == chunk.end) {
+            // Where the chunk stopped, either at its end or at a form that fails to lex, which would fail just the same here
+            last.error = std::move(chunk.error);
+            return;
+        }
+
+        if (!lexer.lex_next_form(last.src.size()))
+            return;
+    }
+}
+
+/// Lexes the forms of `text` from `begin`, a form boundary, up to about `thread_count` chunks ahead, one on each thread.
+/// Returns their lexemes in consecutive segments, the last of which ends where the next window starts, unless it failed to lex.
+std::vector<LexedSource> lex_window(std::string_view text, size_t begin, unsigned thread_count) {
+    struct Chunk {
+        size_t begin;
+        size_t stop;
+        LexedSource lexed;
+    };
+
+    size_t window_begin = begin;
+    size_t window_size = std::min(text.size() - begin, thread_count * LEX_AHEAD_MIN_CHUNK_SIZE);
+    size_t chunk_count = std::clamp<size_t>(window_size / LEX_AHEAD_MIN_CHUNK_SIZE, 1, thread_count);
+
+    std::vector<Chunk> chunks;
+    for (size_t i = 1; i <= chunk_count && begin < text.size(); ++i) {
+        // Split before lines that start with a paren, most likely top-level forms, see merge_chunk()
+        size_t stop = text.size();
+        if (size_t guess = window_begin + i * window_size / chunk_count; guess < text.size()) {
+            size_t split = text.find("\n("sv, std::max(begin, guess));
+            if (split != std::string_view::npos)
+                stop = split + 1;
+        }
+        chunks.push_back({ .begin = begin, .stop = stop, .lexed = { .src = text } });
+        begin = stop;
+    }
+
+    std::atomic<size_t> next_chunk = 0;
+    auto lex_chunks = [&]() {
+        for (size_t i; (i = next_chunk.fetch_add(1, std::memory_order_relaxed)) < chunks.size();) {
+            auto& chunk = chunks[i];
+            lex_forms(chunk.lexed, chunk.begin, chunk.stop);
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        for (size_t i = 1; i < chunks.size(); ++i)
+            workers.emplace_back(lex_chunks);
+        lex_chunks();
+    }
+
+    // Stitch the chunks back together
+    std::vector<LexedSource> segments;
+    segments.push_back({ .src = text, .end = chunks.front().begin });
+    for (auto& chunk : chunks) {
+        if (!segments.back().error)
+            merge_chunk(segments, chunk.lexed);
+    }
+    return segments;
+}
+} // namespace
+
+SexpReader::SexpReader(std::istream& input, Environment& env)
+    : _env{ &env }
+    , _input{ &input } {}
+
+SexpReader::SexpReader(std::string_view src, Environment& env)
+    : _env{ &env }
+    , _src{ src }
+    , _at_eof{ true } {}
+
+SexpReader::SexpReader(const SourceFile& file, Environment& env, unsigned lex_threads)
+    : _env{ &env }
+    , _file{ &file }
+    , _src{ file.text() }
+    , _at_eof{ true }
+    , _lex_threads{ lex_threads } {}
+
+void SexpReader::read_more(size_t min_size) {
+    // Drop what has been parsed already
+    _buffer.erase(0, _cursor);
+    _cursor = 0;
+
+    size_t old_size = _buffer.size();
+    _buffer.resize(old_size + min_size);
+    _input->read(_buffer.data() + old_size, min_size);
+    _buffer.resize(old_size + _input->gcount());
+    if (!*_input)
+        _at_eof = true;
+    _src = _buffer;
+}
+
+std::optional<Sexp> SexpReader::next() {
+    // Large enough to amortize the reads, small enough to not hold on to much of a big input at once
+    constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    while (_next_form == _lexed.forms.size()) {
+        // The forms before one that fails to lex are still returned, before the error is reported
+        if (_lexed.error) {
+            auto msg = std::move(*_lexed.error);
+            _lexed.error.reset();
+            throw ParseException(std::move(msg));
+        }
+
+        if (_next_segment < _lexed_ahead.size()) {
+            _lexed = std::move(_lexed_ahead[_next_segment++]);
+            _next_form = 0;
+            continue;
+        }
+        // Lex the next window of a big file on several threads, only a few chunks ahead so that its lexemes don't all pile up at once
+        if (_lex_threads > 1 && _src.size() - _cursor >= 2 * LEX_AHEAD_MIN_CHUNK_SIZE) {
+            _lexed_ahead = lex_window(_src, _cursor, _lex_threads);
+            _next_segment = 0;
+            auto& last = _lexed_ahead.back();
+            _cursor = last.error ? _src.size() : last.end;
+            continue;
+        }
+
+        // Take the complete forms in what is read so far, up to about a chunk of them, reading more until there is at least one
+        size_t end = _cursor;
+        while (true) {
+            while (end - _cursor < CHUNK_SIZE) {
+                auto form_end = find_form_end(_src, end, _at_eof);
+                if (!form_end || *form_end == end)
+                    break;
+                end = *form_end;
+            }
+            if (end > _cursor || _at_eof)
+                break;
+            // Read at least as much again as is buffered, so that a form much bigger than a chunk is only scanned a few times
+            read_more(std::max(CHUNK_SIZE, _buffer.size()));
+            end = _cursor;
+        }
+
+        if (end == _cursor)
+            return std::nullopt;
+
+        _lexed.src = _src.substr(_cursor, end - _cursor);
+        _lexed.lexemes.clear();
+        _lexed.forms.clear();
+        _lexed.decoded.clear();
+        _cursor = end;
+        _next_form = 0;
+        lex_forms(_lexed, 0, _lexed.src.size());
+    }
+
+    // Let the OS drop the pages of the source that is behind us, a chunk at a time
+    size_t form_index = _next_form++;
+    if (_file) {
+        size_t offset = _lexed.src.data() - _file->text().data() + _lexed.forms[form_index].src_begin;
+        if (offset - _released >= CHUNK_SIZE) {
+            _file->release_before(offset);
+            _released = offset;
+        }
+    }
+
+    SexpParser parser;
+    parser.env = _env;
+    parser.lexed = &_lexed;
+    parser.borrow_src = _file != nullptr;
+    return parser.parse_form(form_index);
+}
+
+} // namespace toyscheme
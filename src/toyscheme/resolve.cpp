@@ -0,0 +1,256 @@
+module;
+#include <cassert>
+
+module toyscheme;
+import std;
+
+using namespace std::literals;
+
+namespace toyscheme {
+
+namespace {
+/// Resolves variable references to lexical addresses, by tracking which names each enclosing scope binds, in the same order as the evaluator fills its slots.
+/// Malformed special forms are walked like ordinary calls, leaving it up to the evaluator to report them.
+class LexicalResolver {
+public:
+    Environment* env;
+
+private:
+    /// Names bound by each scope enclosing the current form, innermost last; the index of a name is its slot
+    std::vector<std::vector<const Symbol*>> scopes;
+
+    const Symbol* sym_quote;
+    const Symbol* sym_lambda;
+    const Symbol* sym_define;
+    const Symbol* sym_let;
+    const Symbol* sym_let_star;
+
+public:
+    explicit LexicalResolver(Environment& env)
+        : env{ &env }
+        , sym_quote{ &env.sym_pool.intern("quote") }
+        , sym_lambda{ &env.sym_pool.intern("lambda") }
+        , sym_define{ &env.sym_pool.intern("define") }
+        , sym_let{ &env.sym_pool.intern("let") }
+        , sym_let_star{ &env.sym_pool.intern("let*") } {}
+
+    void resolve_toplevel(Sexp form) {
+        resolve(form);
+    }
+
+private:
+    void resolve_lambda(Sexp param_decl, Sexp body) {
+        std::vector<const Symbol*> params;
+        for (Sexp param : iterate(param_decl, *env))
+            params.push_back(param.is_symbol() ? &param.as_symbol() : nullptr);
+
+        scopes.push_back(std::move(params));
+        resolve_body(body);
+        scopes.pop_back();
+    }
+
+    void resolve_let(Sexp params, bool sequential) {
+        Sexp arg_1st;
+        Sexp arg_rest;
+        if (!take_prefix(params, { &arg_1st }, &arg_rest)) {
+            resolve_each(params);
+            return;
+        }
+
+        // (let proc-id ((id val-expr) ...) body ...)
+        if (arg_1st.is_symbol()) {
+            Sexp binding_forms;
+            Sexp body;
+            if (!take_prefix(arg_rest, { &binding_forms }, &body)) {
+                resolve_each(params);
+                return;
+            }
+
+            // The val-exprs are arguments to the proc, evaluated outside of it
+            std::vector<const Symbol*> ids;
+            for (auto& form : iterate(binding_forms, *env)) {
+                ids.push_back(resolve_let_binding(form));
+            }
+
+            scopes.push_back({ &arg_1st.as_symbol() });
+            scopes.push_back(std::move(ids));
+            resolve_body(body);
+            scopes.pop_back();
+            scopes.pop_back();
+            return;
+        }
+
+        // (let ((id val-expr) ...) body ...)
+        // (let* ((id val-expr) ...) body ...)
+        auto& binding_forms = arg_1st;
+        auto& body = arg_rest;
+        if (sequential) {
+            // Each val-expr sees the ids bound before it
+            scopes.push_back({});
+            for (auto& form : iterate(binding_forms, *env)) {
+                auto id = resolve_let_binding(form);
+                scopes.back().push_back(id);
+            }
+        } else {
+            std::vector<const Symbol*> ids;
+            for (auto& form : iterate(binding_forms, *env)) {
+                ids.push_back(resolve_let_binding(form));
+            }
+            scopes.push_back(std::move(ids));
+        }
+        resolve_body(body);
+        scopes.pop_back();
+    }
+
+    /// Same as list_get_prefix(), but returns false instead of throwing if the list is too short
+    bool take_prefix(Sexp list, std::initializer_list<Sexp*> out_prefix, Sexp* out_rest) {
+        Sexp curr = list;
+        for (auto out : out_prefix) {
+            auto pair = as_pair(curr);
+            if (!pair)
+                return false;
+            *out = *pair.car;
+            curr = pair.cdr;
+        }
+        if (out_rest)
+            *out_rest = curr;
+        return true;
+    }
+
+    static LocalRef make_local_ref(size_t depth, size_t slot) {
+        if (depth > std::numeric_limits<uint16_t>::max() || slot > std::numeric_limits<uint16_t>::max())
+            throw EvalException("too many nested scopes or local variables"s);
+        return LocalRef{ .depth = static_cast<uint16_t>(depth), .slot = static_cast<uint16_t>(slot) };
+    }
+
+    std::optional<LocalRef> lookup(const Symbol& name) const {
+        for (size_t depth = 0; depth < scopes.size(); ++depth) {
+            auto& names = scopes[scopes.size() - 1 - depth];
+            // Search backwards, so that an id bound again in the same (let*) shadows the previous one
+            for (size_t slot = names.size(); slot-- > 0;) {
+                if (names[slot] == &name)
+                    return make_local_ref(depth, slot);
+            }
+        }
+        return std::nullopt;
+    }
+
+    /// Slot of `name` in the innermost scope, added if it is not bound there yet
+    LocalRef define_in_innermost(const Symbol& name) {
+        auto& names = scopes.back();
+        auto iter = std::ranges::find(names, &name);
+        if (iter != names.end())
+            return make_local_ref(0, iter - names.begin());
+        names.push_back(&name);
+        return make_local_ref(0, names.size() - 1);
+    }
+
+    /// True if `head` is the keyword `keyword`, and it is neither shadowed by a local variable nor redefined
+    bool is_special_form(Sexp head, const Symbol* keyword) const {
+        return head.is_symbol() && &head.as_symbol() == keyword && !lookup(*keyword) && find_builtin(head, *env);
+    }
+
+    /// Resolves the val-expr of a (id val-expr) let binding, and returns the id
+    const Symbol* resolve_let_binding(Sexp form) {
+        auto pair = as_pair(form);
+        if (!pair)
+            return nullptr;
+        resolve_each(pair.cdr);
+        auto id = *pair.car;
+        return id.is_symbol() ? &id.as_symbol() : nullptr;
+    }
+
+    void resolve_body(Sexp body) {
+        if (!is_pair(body))
+            return;
+
+        // Internal defines are visible to the whole body, e.g. so that procs defined in it can call each other
+        for (Sexp form : iterate(body, *env)) {
+            Sexp head;
+            Sexp declaration;
+            if (!is_pair(form) || !take_prefix(form, { &head, &declaration }, nullptr))
+                continue;
+            if (!is_special_form(head, sym_define))
+                continue;
+            if (declaration.is_symbol())
+                define_in_innermost(declaration.as_symbol());
+            else if (is_pair(declaration) && car(declaration).is_symbol())
+                define_in_innermost(car(declaration).as_symbol());
+        }
+
+        resolve_each(body);
+    }
+
+    void resolve_each(Sexp list) {
+        while (auto pair = as_pair(list)) {
+            resolve(*pair.car);
+            list = pair.cdr;
+        }
+    }
+
+    void resolve(Sexp& sexp) {
+        if (sexp.is_symbol()) {
+            if (auto ref = lookup(sexp.as_symbol()))
+                sexp = Sexp(*ref);
+            return;
+        }
+        auto form = as_pair(sexp);
+        if (!form)
+            return;
+
+        auto head = *form.car;
+        auto params = form.cdr;
+
+        if (is_special_form(head, sym_quote))
+            return;
+
+        if (is_special_form(head, sym_lambda)) {
+            Sexp param_decl;
+            Sexp body;
+            if (take_prefix(params, { &param_decl }, &body)) {
+                resolve_lambda(param_decl, body);
+                return;
+            }
+        }
+
+        if (is_special_form(head, sym_let) || is_special_form(head, sym_let_star)) {
+            resolve_let(params, &head.as_symbol() == sym_let_star);
+            return;
+        }
+
+        // Top-level defines bind globals, and only have their val-expr or proc body to resolve
+        if (is_special_form(head, sym_define) && is_pair(params)) {
+            auto decl_pair = as_pair(params);
+            auto& declaration = *decl_pair.car;
+            auto body = decl_pair.cdr;
+
+            // (define id val-expr)
+            if (declaration.is_symbol()) {
+                resolve_each(body);
+                if (!scopes.empty())
+                    declaration = Sexp(define_in_innermost(declaration.as_symbol()));
+                return;
+            }
+
+            // (define (proc-id param ...) body ...)
+            if (is_pair(declaration) && car(declaration).is_symbol()) {
+                auto name_pair = as_pair(declaration);
+                if (!scopes.empty())
+                    *name_pair.car = Sexp(define_in_innermost(name_pair.car->as_symbol()));
+                resolve_lambda(name_pair.cdr, body);
+                return;
+            }
+        }
+
+        // Proc calls, and special forms without bindings of their own such as (if) and (set!)
+        resolve_each(sexp);
+    }
+};
+} // namespace
+
+// NOTE: rewriting is idempotent, as references resolved already are not symbols anymore, and no symbol is left that a second pass could resolve
+void resolve_lexical_addresses(Sexp form, Environment& env) {
+    LexicalResolver(env).resolve_toplevel(form);
+}
+
+} // namespace toyscheme
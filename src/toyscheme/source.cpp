@@ -0,0 +1,127 @@
+module;
+#include "util.hpp"
+
+#if defined(_WIN32)
+#    define WIN32_LEAN_AND_MEAN
+#    define NOMINMAX
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+module toyscheme;
+import std;
+
+namespace toyscheme {
+
+namespace {
+
+/// Reads all of `path` into `out`, for when it can't be mapped (e.g. an empty file, or a pipe whose whole text the profiler needs)
+bool read_whole_file(const std::filesystem::path& path, std::string& out) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs)
+        return false;
+    out.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return !ifs.bad();
+}
+
+} // namespace
+
+#if defined(_WIN32)
+
+std::unique_ptr<SourceFile> SourceFile::open(const std::filesystem::path& path) {
+    auto file = std::make_unique<SourceFile>();
+
+    HANDLE h_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (h_file != INVALID_HANDLE_VALUE) {
+        DEFER { CloseHandle(h_file); };
+
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(h_file, &size) && size.QuadPart > 0) {
+            // The view keeps the mapping alive on its own
+            HANDLE h_mapping = CreateFileMappingW(h_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (h_mapping != nullptr) {
+                DEFER { CloseHandle(h_mapping); };
+
+                void* view = MapViewOfFile(h_mapping, FILE_MAP_READ, 0, 0, 0);
+                if (view != nullptr) {
+                    file->_data = static_cast<const char*>(view);
+                    file->_size = static_cast<size_t>(size.QuadPart);
+                    file->_is_mapped = true;
+                    return file;
+                }
+            }
+        }
+    }
+
+    if (!read_whole_file(path, file->_fallback))
+        return nullptr;
+    file->_data = file->_fallback.data();
+    file->_size = file->_fallback.size();
+    return file;
+}
+
+SourceFile::~SourceFile() {
+    if (_is_mapped)
+        UnmapViewOfFile(_data);
+}
+
+void SourceFile::release_before(size_t /*offset*/) const {
+    // Windows trims the working set of mapped views by itself as they go unused
+}
+
+#else
+
+std::unique_ptr<SourceFile> SourceFile::open(const std::filesystem::path& path) {
+    auto file = std::make_unique<SourceFile>();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        DEFER { ::close(fd); };
+
+        // Only regular files can be mapped; mapping a zero sized one fails
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            size_t size = static_cast<size_t>(st.st_size);
+            void* addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                // Parsing goes front to back, let the kernel read ahead aggressively
+                ::madvise(addr, size, MADV_SEQUENTIAL);
+
+                file->_data = static_cast<const char*>(addr);
+                file->_size = size;
+                file->_is_mapped = true;
+                return file;
+            }
+        }
+    }
+
+    if (!read_whole_file(path, file->_fallback))
+        return nullptr;
+    file->_data = file->_fallback.data();
+    file->_size = file->_fallback.size();
+    return file;
+}
+
+SourceFile::~SourceFile() {
+    if (_is_mapped)
+        ::munmap(const_cast<char*>(_data), _size);
+}
+
+void SourceFile::release_before(size_t offset) const {
+    if (!_is_mapped)
+        return;
+
+    // Only whole pages can be dropped, and the mapping starts at a page boundary
+    auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t len = std::min(offset, _size) / page_size * page_size;
+    if (len > 0)
+        ::madvise(const_cast<char*>(_data), len, MADV_DONTNEED);
+}
+
+#endif
+
+} // namespace toyscheme
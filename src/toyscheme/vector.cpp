@@ -0,0 +1,669 @@
+module;
+#include "util.hpp"
+#include <cassert>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+// The bulk numerical builtins have AVX2 kernels, picked at runtime if the CPU supports them, so that the rest of the build can target the baseline ISA
+#    define TOYSCHEME_AVX2_KERNELS 1
+#    define TOYSCHEME_TARGET_AVX2 __attribute__((target("avx2")))
+#    include <immintrin.h>
+#else
+#    define TOYSCHEME_AVX2_KERNELS 0
+#endif
+
+module toyscheme;
+import std;
+
+using namespace std::literals;
+
+namespace toyscheme {
+
+namespace {
+
+/******** Kernels ********/
+// Bulk operations on the items of numeric vectors. The scalar ones work on any CPU, and serve as the reference for the vectorized ones.
+// Kernels on exact integers return false if the result overflows 64 bits, for the caller to carry on in floating point instead.
+
+enum class MapOp {
+    ADD,
+    SUB,
+    MUL,
+};
+
+double sum_scalar(const double* p, size_t n) {
+    double res = 0.0;
+    for (size_t i = 0; i < n; ++i)
+        res += p[i];
+    return res;
+}
+
+double dot_scalar(const double* a, const double* b, size_t n) {
+    double res = 0.0;
+    for (size_t i = 0; i < n; ++i)
+        res += a[i] * b[i];
+    return res;
+}
+
+// Any NaN makes the result NaN, wherever it is
+template <typename T>
+T min_scalar(const T* p, size_t n) {
+    assert(n > 0);
+    T res = p[0];
+    for (size_t i = 0; i < n; ++i) {
+        if constexpr (std::is_floating_point_v<T>) {
+            if (std::isnan(p[i]))
+                return p[i];
+        }
+        res = p[i] < res ? p[i] : res;
+    }
+    return res;
+}
+
+template <typename T>
+T max_scalar(const T* p, size_t n) {
+    assert(n > 0);
+    T res = p[0];
+    for (size_t i = 0; i < n; ++i) {
+        if constexpr (std::is_floating_point_v<T>) {
+            if (std::isnan(p[i]))
+                return p[i];
+        }
+        res = p[i] > res ? p[i] : res;
+    }
+    return res;
+}
+
+void map_scalar(MapOp op, const double* a, const double* b, double* out, size_t n) {
+    switch (op) {
+        case MapOp::ADD:
+            for (size_t i = 0; i < n; ++i)
+                out[i] = a[i] + b[i];
+            break;
+        case MapOp::SUB:
+            for (size_t i = 0; i < n; ++i)
+                out[i] = a[i] - b[i];
+            break;
+        case MapOp::MUL:
+            for (size_t i = 0; i < n; ++i)
+                out[i] = a[i] * b[i];
+            break;
+    }
+}
+
+bool sum_scalar(const int64_t* p, size_t n, int64_t& res) {
+    res = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (add_overflow(res, p[i], res))
+            return false;
+    }
+    return true;
+}
+
+bool dot_scalar(const int64_t* a, const int64_t* b, size_t n, int64_t& res) {
+    res = 0;
+    for (size_t i = 0; i < n; ++i) {
+        int64_t product;
+        if (mul_overflow(a[i], b[i], product) || add_overflow(res, product, res))
+            return false;
+    }
+    return true;
+}
+
+bool map_scalar(MapOp op, const int64_t* a, const int64_t* b, int64_t* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        bool overflow = false;
+        switch (op) {
+            case MapOp::ADD: overflow = add_overflow(a[i], b[i], out[i]); break;
+            case MapOp::SUB: overflow = sub_overflow(a[i], b[i], out[i]); break;
+            case MapOp::MUL: overflow = mul_overflow(a[i], b[i], out[i]); break;
+        }
+        if (overflow)
+            return false;
+    }
+    return true;
+}
+
+#if TOYSCHEME_AVX2_KERNELS
+bool has_avx2() {
+    static const bool v = __builtin_cpu_supports("avx2");
+    return v;
+}
+
+// Two accumulators, to hide the latency of the adds. For 8 items and more, this adds in another order than sum_scalar(), so the results
+// can differ in the last bits
+TOYSCHEME_TARGET_AVX2 double sum_avx2(const double* p, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(p + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(p + i + 4));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    double res = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i)
+        res += p[i];
+    return res;
+}
+
+// Same order of additions as sum_avx2(), not the one of dot_scalar()
+TOYSCHEME_TARGET_AVX2 double dot_avx2(const double* a, const double* b, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    double res = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i)
+        res += a[i] * b[i];
+    return res;
+}
+
+TOYSCHEME_TARGET_AVX2 double min_avx2(const double* p, size_t n) {
+    if (n < 4)
+        return min_scalar(p, n);
+
+    // _mm256_min_pd() returns its second operand whenever either is NaN, so NaNs are tracked on the side
+    __m256d acc = _mm256_loadu_pd(p);
+    __m256d nan = _mm256_cmp_pd(acc, acc, _CMP_UNORD_Q);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(p + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+        acc = _mm256_min_pd(acc, v);
+    }
+    if (_mm256_movemask_pd(nan) != 0)
+        return std::numeric_limits<double>::quiet_NaN();
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double res = min_scalar(lanes, 4);
+    for (; i < n; ++i) {
+        if (std::isnan(p[i]))
+            return p[i];
+        res = p[i] < res ? p[i] : res;
+    }
+    return res;
+}
+
+TOYSCHEME_TARGET_AVX2 double max_avx2(const double* p, size_t n) {
+    if (n < 4)
+        return max_scalar(p, n);
+
+    // _mm256_max_pd() returns its second operand whenever either is NaN, so NaNs are tracked on the side
+    __m256d acc = _mm256_loadu_pd(p);
+    __m256d nan = _mm256_cmp_pd(acc, acc, _CMP_UNORD_Q);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(p + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+        acc = _mm256_max_pd(acc, v);
+    }
+    if (_mm256_movemask_pd(nan) != 0)
+        return std::numeric_limits<double>::quiet_NaN();
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double res = max_scalar(lanes, 4);
+    for (; i < n; ++i) {
+        if (std::isnan(p[i]))
+            return p[i];
+        res = p[i] > res ? p[i] : res;
+    }
+    return res;
+}
+
+TOYSCHEME_TARGET_AVX2 void map_avx2(MapOp op, const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    switch (op) {
+        case MapOp::ADD:
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+            break;
+        case MapOp::SUB:
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(out + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+            break;
+        case MapOp::MUL:
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+            break;
+    }
+    map_scalar(op, a + i, b + i, out + i, n - i);
+}
+
+// Signed overflow of a + b = s happened in the lanes where a and b have the same sign, but s doesn't: the sign bit of (a ^ s) & (b ^ s)
+TOYSCHEME_TARGET_AVX2 bool sum_avx2(const int64_t* p, size_t n, int64_t& res) {
+    __m256i acc = _mm256_setzero_si256();
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i s = _mm256_add_epi64(acc, v);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(acc, s), _mm256_xor_si256(v, s)));
+        acc = s;
+    }
+    // Some lane overflowed, the total may still fit though, as another lane could be making up for it
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) != 0)
+        return sum_scalar(p, n, res);
+
+    int64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    int64_t rest;
+    if (!sum_scalar(lanes, 4, res) || !sum_scalar(p + i, n - i, rest) || add_overflow(res, rest, res))
+        return sum_scalar(p, n, res);
+    return true;
+}
+
+TOYSCHEME_TARGET_AVX2 int64_t min_avx2(const int64_t* p, size_t n) {
+    if (n < 4)
+        return min_scalar(p, n);
+
+    __m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(acc, v));
+    }
+
+    int64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    int64_t res = min_scalar(lanes, 4);
+    for (; i < n; ++i)
+        res = p[i] < res ? p[i] : res;
+    return res;
+}
+
+TOYSCHEME_TARGET_AVX2 int64_t max_avx2(const int64_t* p, size_t n) {
+    if (n < 4)
+        return max_scalar(p, n);
+
+    __m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(v, acc));
+    }
+
+    int64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    int64_t res = max_scalar(lanes, 4);
+    for (; i < n; ++i)
+        res = p[i] > res ? p[i] : res;
+    return res;
+}
+
+// AVX2 has no 64-bit multiplication, so products stay scalar
+TOYSCHEME_TARGET_AVX2 bool map_avx2(MapOp op, const int64_t* a, const int64_t* b, int64_t* out, size_t n) {
+    if (op == MapOp::MUL)
+        return map_scalar(op, a, b, out, n);
+
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i r;
+        if (op == MapOp::ADD) {
+            r = _mm256_add_epi64(va, vb);
+            overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(va, r), _mm256_xor_si256(vb, r)));
+        } else {
+            // a - b overflowed if a and b have different signs, and r doesn't have the sign of a
+            r = _mm256_sub_epi64(va, vb);
+            overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(va, vb), _mm256_xor_si256(va, r)));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), r);
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) != 0)
+        return false;
+    return map_scalar(op, a + i, b + i, out + i, n - i);
+}
+#endif
+
+// Entry points, picking the fastest kernel the CPU supports
+
+#if TOYSCHEME_AVX2_KERNELS
+#    define DISPATCH(name, ...)                  \
+        do {                                     \
+            if (has_avx2())                      \
+                return name##_avx2(__VA_ARGS__); \
+            return name##_scalar(__VA_ARGS__);   \
+        } while (false)
+#else
+#    define DISPATCH(name, ...) return name##_scalar(__VA_ARGS__)
+#endif
+
+double kernel_sum(std::span<const double> v) { DISPATCH(sum, v.data(), v.size()); }
+bool kernel_sum(std::span<const int64_t> v, int64_t& res) { DISPATCH(sum, v.data(), v.size(), res); }
+double kernel_dot(std::span<const double> a, std::span<const double> b) { DISPATCH(dot, a.data(), b.data(), a.size()); }
+// No vectorized version, see map_avx2()
+bool kernel_dot(std::span<const int64_t> a, std::span<const int64_t> b, int64_t& res) { return dot_scalar(a.data(), b.data(), a.size(), res); }
+template <typename T>
+T kernel_min(std::span<const T> v) { DISPATCH(min, v.data(), v.size()); }
+template <typename T>
+T kernel_max(std::span<const T> v) { DISPATCH(max, v.data(), v.size()); }
+void kernel_map(MapOp op, std::span<const double> a, std::span<const double> b, double* out) { DISPATCH(map, op, a.data(), b.data(), out, a.size()); }
+bool kernel_map(MapOp op, std::span<const int64_t> a, std::span<const int64_t> b, int64_t* out) { DISPATCH(map, op, a.data(), b.data(), out, a.size()); }
+
+#undef DISPATCH
+
+/******** Vector items ********/
+
+bool to_item(Sexp v, Sexp& out) {
+    out = v;
+    return true;
+}
+bool to_item(Sexp v, int64_t& out) {
+    return get_integer(v, out);
+}
+bool to_item(Sexp v, double& out) {
+    int64_t n;
+    if (get_integer(v, n)) {
+        out = static_cast<double>(n);
+        return true;
+    }
+    if (v.is_float()) {
+        out = v.as_float();
+        return true;
+    }
+    return false;
+}
+
+Sexp from_item(Sexp v, Environment& env) { return v; }
+Sexp from_item(int64_t v, Environment& env) { return make_integer(v, env); }
+Sexp from_item(double v, Environment& env) { return Sexp(v); }
+
+template <typename T>
+constexpr std::string_view vector_type_name() {
+    if constexpr (std::is_same_v<T, int64_t>)
+        return "s64vector";
+    else if constexpr (std::is_same_v<T, double>)
+        return "f64vector";
+    else
+        return "vector";
+}
+
+/// Heap object holding items of type T
+template <typename T>
+using VectorOf = std::conditional_t<std::is_same_v<T, Sexp>, Vector, NumericVector<T>>;
+
+/// Allocates a vector of items of type T holding `values`, which are only read once it is allocated, as that may move them
+template <typename T>
+Sexp make_vector_of(std::span<const Sexp> values, Environment& env, bool pretenure) {
+    auto vec = allocate_vector<VectorOf<T>>(values.size(), env.heap, pretenure);
+    auto items = vec->items();
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (!to_item(values[i], items[i]))
+            throw EvalException(std::format("{} can't hold {}", vector_type_name<T>(), dump_sexp(values[i], env)));
+    }
+    if constexpr (std::is_same_v<T, Sexp>) {
+        if (pretenure) {
+            for (auto item : items)
+                write_barrier(env.heap, vec, item);
+        }
+    }
+    return Sexp(vec);
+}
+
+/// Calls `f` with the vector `v` is, of any type; throws if it isn't one
+template <typename F>
+decltype(auto) visit_vector(Sexp v, std::string_view name, F&& f) {
+    if (v.is_ptr() && !v.is_nil()) {
+        auto ptr = v.as_ptr();
+        switch (ptr.get_type()) {
+            case ObjectType::TYPE_VECTOR: return f(*ptr.get_as_unchecked<Vector>());
+            case ObjectType::TYPE_INT_VECTOR: return f(*ptr.get_as_unchecked<IntVector>());
+            case ObjectType::TYPE_FLOAT_VECTOR: return f(*ptr.get_as_unchecked<FloatVector>());
+            default: break;
+        }
+    }
+    throw EvalException(std::format("{} expects a vector", name));
+}
+
+/// Same as visit_vector(), for the bulk numerical builtins, that only accept numeric vectors
+template <typename F>
+decltype(auto) visit_numeric_vector(Sexp v, std::string_view name, F&& f) {
+    if (v.is_ptr<IntVector>())
+        return f(*v.as_ptr<IntVector>());
+    if (v.is_ptr<FloatVector>())
+        return f(*v.as_ptr<FloatVector>());
+    throw EvalException(std::format("{} expects a s64vector or a f64vector", name));
+}
+
+size_t get_size_param(Sexp v, std::string_view name) {
+    if (!v.is_int() || v.as_int() < 0)
+        throw EvalException(std::format("{} expects a non-negative size", name));
+    return v.as_int();
+}
+
+size_t get_index_param(Sexp v, size_t size, std::string_view name) {
+    if (!v.is_int() || v.as_int() < 0 || static_cast<size_t>(v.as_int()) >= size)
+        throw EvalException(std::format("{}: index out of bounds", name));
+    return v.as_int();
+}
+
+/******** Builtins ********/
+
+template <typename T>
+Sexp builtin_make_vector(std::span<const Sexp> args, Environment& env) {
+    constexpr auto name = vector_type_name<T>();
+    if (args.empty() || args.size() > 2)
+        throw EvalException(std::format("make-{} expects 1 or 2 parameters", name));
+
+    size_t size = get_size_param(args[0], name);
+    // The fill value is only read once the vector is allocated, as that may move it
+    auto vec = allocate_vector<VectorOf<T>>(size, env.heap);
+    T fill{};
+    if constexpr (!std::is_same_v<T, Sexp>)
+        fill = 0;
+    if (args.size() == 2 && !to_item(args[1], fill))
+        throw EvalException(std::format("{} can't hold {}", name, dump_sexp(args[1], env)));
+    std::ranges::fill(vec->items(), fill);
+    return Sexp(vec);
+}
+
+Sexp builtin_vector(std::span<const Sexp> args, Environment& env) {
+    return make_vector(args, ObjectType::TYPE_VECTOR, env);
+}
+
+Sexp builtin_vector_length(std::span<const Sexp> args, Environment& env) {
+    if (args.size() != 1)
+        throw EvalException("vector-length expects exactly 1 parameter"s);
+    return visit_vector(args[0], "vector-length", [&](auto& vec) {
+        return make_integer(static_cast<int64_t>(vec.size), env);
+    });
+}
+
+Sexp builtin_vector_ref(std::span<const Sexp> args, Environment& env) {
+    if (args.size() != 2)
+        throw EvalException("vector-ref expects exactly 2 parameters"s);
+    return visit_vector(args[0], "vector-ref", [&](auto& vec) {
+        auto item = vec.items()[get_index_param(args[1], vec.size, "vector-ref")];
+        return from_item(item, env);
+    });
+}
+
+Sexp builtin_vector_set(std::span<const Sexp> args, Environment& env) {
+    if (args.size() != 3)
+        throw EvalException("vector-set! expects exactly 3 parameters"s);
+    return visit_vector(args[0], "vector-set!", [&](auto& vec) {
+        using T = std::remove_reference_t<decltype(vec)>::Item;
+        auto& slot = vec.items()[get_index_param(args[1], vec.size, "vector-set!")];
+        if (!to_item(args[2], slot))
+            throw EvalException(std::format("{} can't hold {}", vector_type_name<T>(), dump_sexp(args[2], env)));
+        if constexpr (std::is_same_v<T, Sexp>)
+            write_barrier(env.heap, &vec, slot);
+        return Sexp();
+    });
+}
+
+Sexp builtin_vector_sum(std::span<const Sexp> args, Environment& env) {
+    if (args.size() != 1)
+        throw EvalException("vector-sum expects exactly 1 parameter"s);
+    return visit_numeric_vector(args[0], "vector-sum", [&](auto& vec) {
+        using T = std::remove_reference_t<decltype(vec)>::Item;
+        std::span<const T> items = vec.items();
+        if constexpr (std::is_same_v<T, int64_t>) {
+            int64_t res;
+            if (kernel_sum(items, res))
+                return make_integer(res, env);
+            // Past 64 bits, the sum carries on in floating point, as with (+)
+            double inexact = 0.0;
+            for (auto v : items)
+                inexact += static_cast<double>(v);
+            return Sexp(inexact);
+        } else {
+            return Sexp(kernel_sum(items));
+        }
+    });
+}
+
+template <bool IsMax>
+Sexp builtin_vector_min_max(std::span<const Sexp> args, Environment& env) {
+    constexpr auto name = IsMax ? "vector-max"sv : "vector-min"sv;
+    if (args.size() != 1)
+        throw EvalException(std::format("{} expects exactly 1 parameter", name));
+    return visit_numeric_vector(args[0], name, [&](auto& vec) {
+        using T = std::remove_reference_t<decltype(vec)>::Item;
+        if (vec.size == 0)
+            throw EvalException(std::format("{} expects a non-empty vector", name));
+        std::span<const T> items = vec.items();
+        return from_item(IsMax ? kernel_max(items) : kernel_min(items), env);
+    });
+}
+
+/// Checks that the 2 vectors a bulk builtin operates on are of the same type and size, and returns the second one
+template <typename TVec>
+TVec& get_second_operand(TVec& a, Sexp b, std::string_view name) {
+    if (!b.is_ptr<TVec>() || b.as_ptr<TVec>()->size != a.size)
+        throw EvalException(std::format("{} expects 2 vectors of the same type and length", name));
+    return *b.as_ptr<TVec>();
+}
+
+Sexp builtin_vector_dot(std::span<const Sexp> args, Environment& env) {
+    if (args.size() != 2)
+        throw EvalException("vector-dot expects exactly 2 parameters"s);
+    return visit_numeric_vector(args[0], "vector-dot", [&](auto& a) {
+        using T = std::remove_reference_t<decltype(a)>::Item;
+        auto& b = get_second_operand(a, args[1], "vector-dot");
+        std::span<const T> items_a = a.items();
+        std::span<const T> items_b = b.items();
+        if constexpr (std::is_same_v<T, int64_t>) {
+            int64_t res;
+            if (kernel_dot(items_a, items_b, res))
+                return make_integer(res, env);
+            double inexact = 0.0;
+            for (size_t i = 0; i < items_a.size(); ++i)
+                inexact += static_cast<double>(items_a[i]) * static_cast<double>(items_b[i]);
+            return Sexp(inexact);
+        } else {
+            return Sexp(kernel_dot(items_a, items_b));
+        }
+    });
+}
+
+/// vector-map of any proc but the builtins +, - and *, called on each pair of items in turn
+Sexp map_with_proc(std::span<const Sexp> args, Environment& env) {
+    // The proc may grow the VM stack, which `args` points into, so they are copied first; being on the native stack also keeps them in place
+    Sexp proc = args[0];
+    Sexp vec_a = args[1];
+    Sexp vec_b = args[2];
+    return visit_vector(vec_a, "vector-map", [&](auto& a) {
+        using T = std::remove_reference_t<decltype(a)>::Item;
+        auto& b = get_second_operand(a, vec_b, "vector-map");
+        // Results may be any value, so they are collected into a vector of any values first, then checked and copied into one of the type of `a`
+        auto results = allocate_vector<Vector>(a.size, env.heap);
+        for (size_t i = 0; i < a.size; ++i) {
+            std::array<Sexp, 2> items = { from_item(a.items()[i], env), from_item(b.items()[i], env) };
+            auto result = apply_proc(proc, items, env);
+            results->items()[i] = result;
+            write_barrier(env.heap, results, result);
+        }
+        if constexpr (std::is_same_v<T, Sexp>)
+            return Sexp(results);
+        else
+            return make_vector_of<T>(results->items(), env, false);
+    });
+}
+
+/// (vector-map proc a b): calls proc on each pair of items of a and b, vectors of the same type and length, into a new vector of that type.
+/// The builtins +, - and * run over the items of numeric vectors directly, instead of being called on each pair.
+Sexp builtin_vector_map(std::span<const Sexp> args, Environment& env) {
+    if (args.size() != 3)
+        throw EvalException("vector-map expects exactly 3 parameters"s);
+
+    // Vectors of any values take the slow path whatever the proc
+    if (args[1].is_ptr<Vector>())
+        return map_with_proc(args, env);
+
+    MapOp op;
+    auto callee = args[0];
+    std::string_view op_name = callee.is_ptr<BuiltinProc>() ? std::string_view(*callee.as_ptr<BuiltinProc>()->name) : ""sv;
+    if (op_name == "+"sv)
+        op = MapOp::ADD;
+    else if (op_name == "-"sv)
+        op = MapOp::SUB;
+    else if (op_name == "*"sv)
+        op = MapOp::MUL;
+    else
+        return map_with_proc(args, env);
+
+    return visit_numeric_vector(args[1], "vector-map", [&](auto& a) {
+        using TVec = std::remove_reference_t<decltype(a)>;
+        using T = TVec::Item;
+        get_second_operand(a, args[2], "vector-map");
+        // Allocating the result may move `a` and `b`, so they are only taken from `args` after, which the garbage collector updates
+        auto res = allocate_vector<TVec>(a.size, env.heap);
+        std::span<const T> items_a = args[1].as_ptr<TVec>()->items();
+        std::span<const T> items_b = args[2].as_ptr<TVec>()->items();
+        if constexpr (std::is_same_v<T, int64_t>) {
+            if (!kernel_map(op, items_a, items_b, res->items().data())) {
+                // Some item overflowed 64 bits, so the whole result is made inexact, as with (+)
+                std::vector<double> fa(items_a.begin(), items_a.end());
+                std::vector<double> fb(items_b.begin(), items_b.end());
+                auto inexact = allocate_vector<FloatVector>(fa.size(), env.heap);
+                kernel_map(op, fa, fb, inexact->items().data());
+                return Sexp(inexact);
+            }
+        } else {
+            kernel_map(op, items_a, items_b, res->items().data());
+        }
+        return Sexp(res);
+    });
+}
+} // namespace
+
+Sexp make_vector(std::span<const Sexp> items, ObjectType type, Environment& env, bool pretenure) {
+    switch (type) {
+        case ObjectType::TYPE_VECTOR: return make_vector_of<Sexp>(items, env, pretenure);
+        case ObjectType::TYPE_INT_VECTOR: return make_vector_of<int64_t>(items, env, pretenure);
+        case ObjectType::TYPE_FLOAT_VECTOR: return make_vector_of<double>(items, env, pretenure);
+        default: assert(false && "not a vector type"); return Sexp();
+    }
+}
+
+void setup_vector_builtins(Environment& env) {
+#define PROC(name, func) define_builtin(env, name, func)
+    PROC("make-vector", builtin_make_vector<Sexp>);
+    PROC("make-s64vector", builtin_make_vector<int64_t>);
+    PROC("make-f64vector", builtin_make_vector<double>);
+    PROC("vector", builtin_vector);
+    PROC("vector-length", builtin_vector_length);
+    PROC("vector-ref", builtin_vector_ref);
+    PROC("vector-set!", builtin_vector_set);
+    PROC("vector-sum", builtin_vector_sum);
+    PROC("vector-min", builtin_vector_min_max<false>);
+    PROC("vector-max", builtin_vector_min_max<true>);
+    PROC("vector-dot", builtin_vector_dot);
+    PROC("vector-map", builtin_vector_map);
+#undef PROC
+}
+
+} // namespace toyscheme
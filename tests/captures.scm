@@ -15,3 +15,18 @@
 (define c2 (make-counter 0))
 ;; => 1
 (c2)
+
+;; Only the scopes that a closure is created in are captured, the others come and go with their call
+;; => '()
+(define (make-scaled-adder k)
+  (let ((scale (* k 10)))
+    (lambda (x)
+      (let ((y (* x scale)))
+        (+ y k)))))
+
+;; => '()
+(define add-scaled (make-scaled-adder 2))
+;; => 62
+(add-scaled 3)
+;; => 82
+(add-scaled 4)
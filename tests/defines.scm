@@ -13,6 +13,11 @@ a
 ;; => (1 2 3 "hello")
 my-list
 
+;; => '()
+(define path "c:\\dir\\file")
+;; => "c:\dir\file"
+path
+
 ;; => '()
 (define b 40)
 ;; => 42
@@ -37,10 +42,26 @@ my-list
      (* 2 a)))
 ;; => 1
 (calc 1 0 -1)
-;; => -0.46572697
+;; => -0.46572695328157604
 (calc -12 3 4)
 
 ;; => #PROC:my-add
 my-add
 ;; => #PROC:calc
 calc
+
+;; set! only changes globals that are defined already
+;; => '()
+(set! not-defined 1)
+;; => '()
+not-defined
+
+;; Redefining a global is seen by the procs that use it
+;; => '()
+(define (sq-plus-one x) (+ (sq x) 1))
+;; => 10
+(sq-plus-one 3)
+;; => '()
+(define (sq x) (+ x x))
+;; => 7
+(sq-plus-one 3)
@@ -18,3 +18,7 @@
 
 ;; This shouldn't cause reading uninitialized values!
 (-)
+
+(vector-map 5 #s64(1) #s64(2))
+
+(vector-map (lambda (a b) (quote x)) #s64(1) #s64(2))
@@ -0,0 +1,83 @@
+;; Allocates far more than the collection threshold, while keeping some data alive across collections
+
+;; => '()
+(define (make-list n)
+  (if (= n 0)
+      '()
+      (cons n (make-list (- n 1)))))
+
+;; => '()
+(define (len lst)
+  (if (null? lst)
+      0
+      (+ 1 (len (cdr lst)))))
+
+;; => '()
+(define kept (make-list 500))
+
+;; => '()
+(define (churn n)
+  (if (= n 0)
+      0
+      (let ((garbage (make-list 200))
+            (str "a string long enough to live outside of the std::string"))
+        (+ (len garbage) (churn (- n 1))))))
+
+;; => 20000
+(churn 100)
+
+;; => 300
+(let loop ((i 0))
+  (if (< i 300)
+      (let ()
+        (churn 50)
+        (loop (+ i 1)))
+      i))
+
+;; => 500
+(len kept)
+;; => 500
+(car kept)
+
+;; A young list only referenced from the already promoted global scope must survive minor collections
+;; => '()
+(define late (make-list 50))
+;; => 2000
+(churn 10)
+;; => 50
+(len late)
+
+;; Building the statistics allocates, which may run a collection halfway
+;; => 100
+(let loop ((i 0))
+  (if (< i 100)
+      (progn
+        (heap-stats)
+        (loop (+ i 1)))
+      i))
+;; => allocations
+(car (car (heap-stats)))
+
+;; A vector too big for the segments of the heap is a large object mapped on its own, that may reference young objects
+;; => '()
+(define big (make-s64vector 100000 7))
+;; => 700000
+(vector-sum big)
+;; => '()
+(define refs (make-vector 5000))
+;; => 5000
+(let loop ((i 0))
+  (if (< i 5000)
+      (progn
+        (vector-set! refs i (cons i (make-list 2)))
+        (loop (+ i 1)))
+      i))
+;; => 20000
+(churn 100)
+;; => (4321 2 1)
+(vector-ref refs 4321)
+
+;; Allocating past the limit of the heap, set by --heap-max to 16 GiB by default, fails that form only
+(make-s64vector 2147483647)
+;; => 100000
+(vector-length big)
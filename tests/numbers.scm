@@ -0,0 +1,81 @@
+;; Integers are exact: results too big for a fixnum are boxed as 64-bit integers instead of being rounded
+
+;; => 2147483648
+(* 65536 32768)
+
+;; => -2147483648
+(- (* 65536 32768))
+
+;; => 2147483648
+(- (- (* 65536 32768)))
+
+;; => '()
+(define big (* 65536 65536 65536))
+
+;; => 281474976710656
+big
+
+;; => 9223372036854775807
+(+ (* big 16384) (- (* big 16384) 1))
+
+;; Past 64 bits, arithmetic carries on in floating point
+;; => 18446744073709551616
+(* big 65536)
+
+;; A float would have rounded these away
+;; => 1
+(- (+ (* 16777216 16) 1) (* 16777216 16))
+
+;; => #f
+(= (+ (* big 16384) 1) (* big 16384))
+
+;; => #t
+(< 1 (* 65536 65536) 1e10)
+
+;; => 65536
+(/ (* 65536 65536) 65536)
+
+;; => 3.5
+(/ 7 2)
+
+;; => 3
+(+ 1.5 1.5)
+
+;; => 5000050000
+(let loop ((i 0) (acc 0))
+  (if (> i 100000)
+      acc
+      (loop (+ i 1) (+ acc i))))
+
+;; Floats are doubles
+;; => 0.30000000000000004
+(+ 0.1 0.2)
+
+;; => 1.4142135623730951
+(sqrt 2)
+
+;; => 16777217
+(+ 16777216.5 0.5)
+
+;; Integer literals are exact over the whole 64-bit range
+;; => 9007199254740993
+9007199254740993
+
+;; => -9223372036854775808
+-9223372036854775808
+
+;; => 1
+(- 9007199254740993 9007199254740992)
+
+;; => 42
++42
+
+;; => 1500
+1.5e3
+
+;; => -0.5
+-.5
+
+;; Tokens that only start like numbers are symbols
+;; => (1+ - ... 3rd)
+'(1+ - ... 3rd)
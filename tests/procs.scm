@@ -0,0 +1,68 @@
+;; Procs as values, and calls to any expression that evaluates to one
+
+;; => 42
+((lambda (x) (* x 2)) 21)
+
+;; => '()
+(define (apply-twice f x)
+  (f (f x)))
+
+;; => '(3)
+(apply-twice cdr '(1 2 3))
+
+;; => 9
+(apply-twice (lambda (x) (+ x x x)) 1)
+
+;; => '()
+(define (pick flag)
+  (if flag car cdr))
+
+;; => 1
+((pick #t) '(1 2))
+
+;; Primitives passed around keep working with any number of arguments
+;; => 10
+(apply-twice (lambda (x) (+ x 1 2)) 4)
+
+;; Extra arguments are ignored
+;; => 1
+((lambda (x) x) 1 2 3)
+
+;; Builtins can be shadowed by parameters...
+;; => 2
+(let ((+ -))
+  (+ 5 3))
+
+;; ...and redefined, even for procs compiled before
+;; => '()
+(define (second-item l)
+  (car (cdr l)))
+
+;; => 2
+(second-item '(1 2))
+
+;; => '()
+(define (car x) 7)
+
+;; => 7
+(car '(1 2))
+
+;; => 7
+(second-item '(1 2))
+
+;; Only the case taken by a constant condition is compiled, and any builtin is called directly
+;; => '()
+(define (constant-if x)
+  (if #f (no-such-proc x) (sqrt x)))
+
+;; => 3
+(constant-if 9)
+
+;; => '()
+(set! sqrt (lambda (x) (* x 2)))
+
+;; => 18
+(constant-if 9)
+
+;; => 2
+(if '#f 1 2)
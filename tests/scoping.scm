@@ -0,0 +1,85 @@
+;; Variable references in nested procs and lets, which are resolved to lexical addresses
+
+;; => '()
+(define x 100)
+
+;; => 3
+(let ((x 1))
+  (let ((y 2))
+    (+ x y)))
+
+;; => 100
+x
+
+;; Inner bindings shadow outer ones, also the ones of the same (let*)
+;; => 12
+(let* ((x 1)
+       (x (+ x 10))
+       (y (+ x 1)))
+  y)
+
+;; (let) val-exprs see the enclosing scope, not each other
+;; => 101
+(let ((x 1)
+      (y (+ x 1)))
+  y)
+
+;; => '()
+(define (make-adder n)
+  (lambda (m)
+    (let ((sum (+ n m)))
+      sum)))
+
+;; => '()
+(define add5 (make-adder 5))
+;; => 12
+(add5 7)
+
+;; Internal defines can refer to each other, regardless of the order they are written in
+;; => '()
+(define (parity n)
+  (define (my-even? n)
+    (if (= n 0) #t (my-odd? (- n 1))))
+  (define (my-odd? n)
+    (if (= n 0) #f (my-even? (- n 1))))
+  (my-even? n))
+
+;; => #t
+(parity 10)
+;; => #f
+(parity 7)
+
+;; A closure and its creator share the same binding
+;; => '()
+(define (make-account balance)
+  (define (withdraw amount)
+    (set! balance (- balance amount))
+    balance)
+  withdraw)
+
+;; => '()
+(define acc (make-account 100))
+;; => 70
+(acc 30)
+;; => 60
+(acc 10)
+
+;; Named lets nested in procs, calling procs from enclosing scopes
+;; => '()
+(define (sum-to n)
+  (let loop ((i 0)
+             (total 0))
+    (if (> i n)
+        total
+        (loop (+ i 1) (add5 (- (+ total i) 5))))))
+
+;; => 55
+(sum-to 10)
+
+;; Free variables still refer to the globals at the time of the call
+;; => '()
+(define (get-x) x)
+;; => '()
+(set! x 200)
+;; => 200
+(get-x)
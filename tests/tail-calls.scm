@@ -0,0 +1,42 @@
+;; Calls in tail position don't grow the stack, so loops written as recursion run in constant space
+
+;; => 1000000
+(let loop ((i 0))
+  (if (< i 1000000)
+      (loop (+ i 1))
+      i))
+
+;; => '()
+(define (count-down n)
+  (let* ((m (- n 1)))
+    (if (= m 0)
+        'done
+        (progn
+          (+ 1 2)
+          (count-down m)))))
+
+;; => done
+(count-down 1000000)
+
+;; Mutual recursion between internal defines
+;; => '()
+(define (parity n)
+  (define (even? n) (if (= n 0) #t (odd? (- n 1))))
+  (define (odd? n) (if (= n 0) #f (even? (- n 1))))
+  (even? n))
+
+;; => #t
+(parity 1000000)
+
+;; Builtins in tail position
+;; => 6
+(let ((x 1))
+  (let ((y 2))
+    (+ x y 3)))
+
+;; Calls that are not in tail position still return to their caller
+;; => 500500
+(let sum ((i 1000))
+  (if (= i 0)
+      0
+      (+ i (sum (- i 1)))))
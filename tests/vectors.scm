@@ -0,0 +1,127 @@
+;; Vectors, and numeric vectors with their bulk builtins
+
+;; => #(1 a (2 3))
+'#(1 a (2 3))
+
+;; => '()
+(define v (make-vector 3 0))
+
+;; => '()
+(vector-set! v 1 'x)
+
+;; => #(0 x 0)
+v
+
+;; => 3
+(vector-length v)
+
+;; => x
+(vector-ref v 1)
+
+;; => #(3 (1))
+(vector (+ 1 2) (cons 1 '()))
+
+;; Numeric vectors hold unboxed exact integers or doubles
+;; => #s64(1 2 3)
+#s64(1 2 3)
+
+;; => #f64(1.5 2 3)
+#f64(1.5 2 3)
+
+;; => #f64(0 0 0 0)
+(make-f64vector 4)
+
+;; => 6
+(vector-sum #s64(1 2 3))
+
+;; => 2.5
+(vector-sum #f64(0.5 1 1))
+
+;; => -7
+(vector-min #s64(4 -7 2 9 0 3 11 5 -1))
+
+;; => 11
+(vector-max #s64(4 -7 2 9 0 3 11 5 -1))
+
+;; => 0.25
+(vector-min #f64(4 0.25 2 9 1 3 11 5 6.5))
+
+;; => '()
+(define nans (make-f64vector 9 1))
+
+;; => '()
+(vector-set! nans 0 (/ 0. 0.))
+
+;; => nan
+(vector-min nans)
+
+;; => nan
+(vector-max nans)
+
+;; => '()
+(vector-set! nans 0 1)
+
+;; => '()
+(vector-set! nans 6 (/ 0. 0.))
+
+;; => nan
+(vector-min nans)
+
+;; => nan
+(vector-max nans)
+
+;; => 32
+(vector-dot #s64(1 2 3) #s64(4 5 6))
+
+;; => #s64(5 7 9 11 13)
+(vector-map + #s64(1 2 3 4 5) #s64(4 5 6 7 8))
+
+;; => #f64(0.5 3 7.5 14 22.5)
+(vector-map * #f64(1 2 3 4 5) #f64(0.5 1.5 2.5 3.5 4.5))
+
+;; Any other proc is called on each pair of items
+;; => #s64(0 3 8)
+(vector-map (lambda (a b) (- (* a a) b)) #s64(1 2 3) #s64(1 1 1))
+
+;; => #((1 a) (2 b))
+(vector-map cons #(1 2) #((a) (b)))
+
+;; => #(4 6)
+(vector-map + #(1 2) #(3 4))
+
+;; Results of exact integer kernels that overflow 64 bits become inexact
+;; => '()
+(define big (* 65536 65536 65536 16384))
+
+;; => 92233720368547758080
+(vector-sum (vector-map + (make-s64vector 10 big) (make-s64vector 10 big)))
+
+;; Bulk builtins over many items
+;; => '()
+(define n 100000)
+
+;; => '()
+(define xs (make-s64vector n))
+
+;; => '()
+(define (fill! i)
+  (if (< i n)
+      (progn
+        (vector-set! xs i i)
+        (fill! (+ i 1)))
+      'done))
+
+;; => done
+(fill! 0)
+
+;; => 4999950000
+(vector-sum xs)
+
+;; => 99999
+(vector-max xs)
+
+;; => 333328333350000
+(vector-dot xs xs)
+
+;; => 14999850000
+(vector-sum (vector-map (lambda (a b) (+ a (* 2 b) (car (cons 0 '())))) xs xs))
@@ -2,7 +2,19 @@ add_rules("mode.debug", "mode.release")
 
 set_languages("c++23")
 
+-- Everything but main(), compiled once for both the interpreter and the benchmarks
+target("toyscheme-core")
+    set_kind("static")
+    add_files("src/**.cpp|main.cpp")
+    add_files("src/**.cppm", {public = true})
+
 target("toyscheme")
     set_kind("binary")
-    add_files("src/**.cpp")
-    add_files("src/**.cppm")
+    add_deps("toyscheme-core")
+    add_files("src/main.cpp")
+
+-- Benchmarks, with their own main() instead of the interpreter's
+target("toyscheme-bench")
+    set_kind("binary")
+    add_deps("toyscheme-core")
+    add_files("bench/*.cpp")